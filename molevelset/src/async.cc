@@ -0,0 +1,201 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+
+#include "async.h"
+
+using std::string;
+using std::vector;
+
+struct levelset_job {
+  levelset_args la;           /* Args for the run. */
+  levelset_control control;   /* Options for the run. */
+  levelset_progress progress; /* Progress of the run. */
+  double *x;                  /* Copy of the points, or NULL. */
+  double *y;                  /* Copy of the responses, or NULL. */
+  float *xf;                  /* Copy of single precision points, or NULL. */
+  float *yf;                  /* Copy of single precision responses, or
+				 NULL. */
+  double *transform;          /* Copy of la.offset then la.scale, or
+				 NULL. */
+  void *cells;                /* Copy of cell coordinates, or NULL. */
+  int *kmax;                  /* Copy of la.kmax. */
+  char *checkpoint_path;      /* Copy of control.checkpoint_path. */
+  char *scratch_path;         /* Copy of control.scratch_path. */
+  levelset_estimate le;       /* The estimate, once done. */
+  vector<string> warnings;    /* Warnings from the run. */
+  int done;                   /* Set once the run has finished. */
+  std::mutex lock;            /* Guards done and warnings. */
+  std::condition_variable finished;
+  std::thread worker;
+};
+
+/* Jobs started and not yet done. */
+static std::atomic<int> n_running(0);
+
+static char *copy_string(const char *s) {
+  return s ? strdup(s) : NULL;
+}
+
+static void job_warning(const char *message, void *data) {
+  levelset_job *job = (levelset_job *)data;
+  std::lock_guard<std::mutex> guard(job->lock);
+  job->warnings.push_back(message);
+}
+
+static void run_levelset_job(levelset_job *job) {
+  /* Body of the worker thread. */
+  levelset_estimate le =
+    compute_levelset_control(levelset_points_to_boxes(&job->la), job->la,
+			     &job->control);
+  std::lock_guard<std::mutex> guard(job->lock);
+  job->le = le;
+  job->done = 1;
+  n_running--;
+  job->finished.notify_all();
+}
+
+levelset_job *start_levelset_job(levelset_args la, levelset_control *control,
+				 int copy_data) {
+  /* Start computing a levelset on a new thread.
+   *
+   * Args:
+   *   la: levelset_args, the parameter values for the levelset algorithm.
+   *   control: pointer to levelset_control, options for the run.  The
+   *     progress and warning fields are replaced by the job's own.
+   *   copy_data: integer, if non-zero the points and responses (x, xf
+   *     with its offset and scale or cells, y or yf) are copied, otherwise
+   *     they must stay valid until the job is done.
+   * Returns:
+   *   pointer to the new job.
+   */
+  levelset_job *job = new levelset_job;
+  job->x = NULL;
+  job->y = NULL;
+  job->xf = NULL;
+  job->yf = NULL;
+  job->transform = NULL;
+  job->cells = NULL;
+  if (copy_data && la.x) {
+    job->x = (double *)malloc(sizeof(double) * la.n * la.d + 1);
+    memcpy(job->x, la.x, sizeof(double) * la.n * la.d);
+    la.x = job->x;
+  } else if (copy_data && !la.xf) {
+    size_t size = (size_t)la.cell_bytes * la.n * la.d;
+    job->cells = malloc(size + 1);
+    memcpy(job->cells, la.cells, size);
+    la.cells = job->cells;
+  } else if (copy_data) {
+    job->xf = (float *)malloc(sizeof(float) * la.n * la.d + 1);
+    job->transform = (double *)malloc(sizeof(double) * 2 * la.d + 1);
+    memcpy(job->xf, la.xf, sizeof(float) * la.n * la.d);
+    memcpy(job->transform, la.offset, sizeof(double) * la.d);
+    memcpy(job->transform + la.d, la.scale, sizeof(double) * la.d);
+    la.xf = job->xf;
+    la.offset = job->transform;
+    la.scale = job->transform + la.d;
+  }
+  if (copy_data && la.y) {
+    job->y = (double *)malloc(sizeof(double) * la.n + 1);
+    memcpy(job->y, la.y, sizeof(double) * la.n);
+    la.y = job->y;
+  } else if (copy_data) {
+    job->yf = (float *)malloc(sizeof(float) * la.n + 1);
+    memcpy(job->yf, la.yf, sizeof(float) * la.n);
+    la.yf = job->yf;
+  }
+  job->kmax = (int *)malloc(sizeof(int) * la.d + 1);
+  memcpy(job->kmax, la.kmax, sizeof(int) * la.d);
+  la.kmax = job->kmax;
+  job->la = la;
+  job->control = *control;
+  job->checkpoint_path = copy_string(control->checkpoint_path);
+  job->scratch_path = copy_string(control->scratch_path);
+  job->control.checkpoint_path = job->checkpoint_path;
+  job->control.scratch_path = job->scratch_path;
+  job->control.progress = &job->progress;
+  job->control.warn = job_warning;
+  job->control.warn_data = job;
+
+  job->progress.level = 0;
+  job->progress.n_levels = total_splits(la.d, la.kmax);
+  job->progress.boxes = 0;
+  job->progress.cancel = 0;
+  job->done = 0;
+  n_running++;
+  job->worker = std::thread(run_levelset_job, job);
+  return job;
+}
+
+levelset_progress *levelset_job_progress(levelset_job *job) {
+  return &job->progress;
+}
+
+void cancel_levelset_job(levelset_job *job) {
+  /* Ask the job to stop, it will finish with LEVELSET_CANCELLED soon. */
+  job->progress.cancel = 1;
+}
+
+int wait_levelset_job(levelset_job *job, int milliseconds) {
+  /* Wait for a job to finish.
+   *
+   * Args:
+   *   job: pointer to the job.
+   *   milliseconds: integer, longest time to wait, 0 to only check.
+   * Returns:
+   *   1 if the job is done, 0 otherwise.
+   */
+  std::unique_lock<std::mutex> guard(job->lock);
+  job->finished.wait_for(guard, std::chrono::milliseconds(milliseconds),
+			 [job] { return job->done != 0; });
+  return job->done;
+}
+
+levelset_estimate *levelset_job_estimate(levelset_job *job, int *status,
+					 vector<string> *warnings) {
+  /* Get the result of a finished job.
+   *
+   * Args:
+   *   job: pointer to the job, wait_levelset_job must have returned 1.
+   *   status: set to the status of the run.
+   *   warnings: the warnings from the run are moved to the end of this.
+   * Returns:
+   *   pointer to the estimate, owned by the job.
+   */
+  std::lock_guard<std::mutex> guard(job->lock);
+  *status = job->control.status;
+  warnings->insert(warnings->end(), job->warnings.begin(),
+		   job->warnings.end());
+  job->warnings.clear();
+  return &job->le;
+}
+
+void free_levelset_job(levelset_job *job) {
+  /* Cancel a job if it is still running, wait for it and free it along with
+   * its estimate. */
+  if (!job) {
+    return;
+  }
+  cancel_levelset_job(job);
+  job->worker.join();
+  free_levelset_estimate(&job->le);
+  free(job->x);
+  free(job->y);
+  free(job->xf);
+  free(job->yf);
+  free(job->transform);
+  free(job->cells);
+  free(job->kmax);
+  free(job->checkpoint_path);
+  free(job->scratch_path);
+  delete job;
+}
+
+int levelset_jobs_running() {
+  return n_running;
+}
@@ -0,0 +1,28 @@
+#ifndef async_h
+#define async_h
+
+#include <string>
+#include <vector>
+
+#include "molevelset.h"
+
+/* A levelset job runs compute_levelset_control on a worker thread.  The
+ * thread that started it can poll the progress, cancel it, and wait for
+ * the estimate.  Nothing on the worker thread calls R, warnings are kept
+ * in the job until it is collected. */
+typedef struct levelset_job levelset_job;
+
+levelset_job *start_levelset_job(levelset_args la, levelset_control *control,
+				 int copy_data);
+levelset_progress *levelset_job_progress(levelset_job *);
+void cancel_levelset_job(levelset_job *);
+int wait_levelset_job(levelset_job *, int milliseconds);
+levelset_estimate *levelset_job_estimate(levelset_job *, int *status,
+					 std::vector<std::string> *warnings);
+void free_levelset_job(levelset_job *);
+
+/* Number of jobs whose run hasn't finished.  The process must not fork
+ * while there are any. */
+int levelset_jobs_running();
+
+#endif
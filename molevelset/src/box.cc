@@ -1,3 +1,4 @@
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
@@ -5,13 +6,10 @@
 #include <Rinternals.h>
 
 #include "box.h"
+#include "simd.h"
 
 using namespace::std;
 
-/* Some private functions. */
-unsigned int point_to_split(double *px, int d, int k_max);
-void point_to_box(double *px, int d, int k_max, unsigned int *pbox);
-
 box *new_box(box_split *split) {
   /* Create and initialize a new box. 
    *
@@ -93,8 +91,7 @@ int compare_splits(box_split *ps1, box_split *ps2) {
    * Returns:
    *   1 if splits are equal, 0 otherwise.
    */
-  int i, j;
-  unsigned int split_mask;
+  int i;
 
   if (!ps1 || !ps2) {
     return !ps1 & !ps2;
@@ -109,11 +106,7 @@ int compare_splits(box_split *ps1, box_split *ps2) {
       return 0;
     }
     
-    split_mask = 0;
-    for (j = 0; j < ps1->nsplit[i]; j++) {
-      split_mask |= 1 << j;
-    }
-    if ((ps1->split[i] ^ ps2->split[i]) & split_mask) {
+    if ((ps1->split[i] ^ ps2->split[i]) & split_mask(ps1->nsplit[i])) {
       return 0;
     }
   }
@@ -121,6 +114,17 @@ int compare_splits(box_split *ps1, box_split *ps2) {
   return 1;
 }
 
+unsigned long long split_mask(int nsplit) {
+  /* Mask of the low nsplit bits of a split word.
+   *
+   * Args:
+   *   nsplit: number of splits, 0 to 64.
+   * Returns:
+   *   word with bits 0 to nsplit - 1 set.
+   */
+  return nsplit >= 64 ? ~0ULL : (1ULL << nsplit) - 1;
+}
+
 int split_to_interval(box_split *split, int dim, double *x1, double *x2) {
   /* Extract the real interval associated with a split.
    *
@@ -141,7 +145,7 @@ int split_to_interval(box_split *split, int dim, double *x1, double *x2) {
   
   for (int i = 0; i < split->nsplit[dim]; i++) {
     double next_split = (*x1 + *x2) / 2;
-    if ((split->split[dim] & (1 << i)) == LEFT_SPLIT) {
+    if (((split->split[dim] >> i) & 1) == LEFT_SPLIT) {
       *x2 = next_split;
     } else {
       *x1 = next_split;
@@ -151,15 +155,15 @@ int split_to_interval(box_split *split, int dim, double *x1, double *x2) {
   return BOX_SUCCESS;
 }
 
-unsigned int point_to_split(double *px, int d, int k_max) {
+unsigned long long point_to_split(double *px, int d, int k_max) {
   double next_split = 0.5; 
   double divisor = 0.25;
-  unsigned int split = 0;
+  unsigned long long split = 0;
   
   for (int i = 0; i < k_max; i++) {
     /* go_left = <Is this point left of the next split?> */
     int go_left = *px < next_split;
-    split |= (go_left ? LEFT_SPLIT : RIGHT_SPLIT) << i;
+    split |= (unsigned long long)(go_left ? LEFT_SPLIT : RIGHT_SPLIT) << i;
     next_split = next_split + (go_left ? -1 : 1) * divisor;
     divisor = divisor / 2;
   }
@@ -167,11 +171,23 @@ unsigned int point_to_split(double *px, int d, int k_max) {
   return split;
 }
 
-void point_to_box(double *px, int d, int k_max, unsigned int *pbox) {
+unsigned long long cell_to_split(unsigned long long cell, int k_max) {
+  /* The split of cell, one of the 2^k_max finest intervals of a
+   * dimension, the split point_to_split gives for the points inside it.
+   * Split i is on the right when bit k_max - 1 - i of cell is set, so the
+   * split is the bits of cell reversed, no arithmetic on the point. */
+  unsigned long long split = 0;
+  for (int i = 0; i < k_max; i++) {
+    split |= ((cell >> (k_max - 1 - i)) & 1ULL) << i;
+  }
+  return split;
+}
+
+void point_to_box(double *px, int d, int *k_max, unsigned long long *pbox) {
   int i;
 
   for(i = 0; i < d; i++) {
-    pbox[i] = point_to_split(px + i, d, k_max);
+    pbox[i] = point_to_split(px + i, d, k_max[i]);
   }
 }
 
@@ -190,39 +206,68 @@ box_collection *new_box_collection(box_split_info *info) {
   return p;
 }
 
-box_collection *points_to_boxes(double *px, int n, int d, int k_max) {
-  /* Put a collection of points into boxes.
-   *
-   * Args:
-   *   px: pointer to points to box, column centric array.
-   *   n: number of points.
-   *   d: dimension.
-   *   k_max: max number of splits to use.
-   * Returns:
-   *   pointer to newly alloced box_collection. 
-   */
+typedef struct {
+  double *x;            /* Points in the unit cube, or NULL. */
+  const float *xf;      /* Single precision points, or NULL. */
+  const double *offset; /* Map of xf into the unit cube. */
+  const double *scale;
+  const void *cells;    /* Cell coordinates, when x and xf are NULL. */
+  int cell_bytes;       /* Size of a cell coordinate, 1, 2 or 4. */
+} point_source;
+
+static void bin_cells(const void *cells, int cell_bytes, int n, int d,
+		      const int *k_max, int from, int count,
+		      unsigned long long *splits) {
+  /* bin_points for cell coordinates, see points_to_boxes_cells. */
+  for (int j = 0; j < d; j++) {
+    size_t at = (size_t)j * n + from;
+    for (int k = 0; k < count; k++) {
+      unsigned long long cell =
+	cell_bytes == 1 ? ((const unsigned char *)cells)[at + k] :
+	cell_bytes == 2 ? ((const unsigned short *)cells)[at + k] :
+	((const unsigned int *)cells)[at + k];
+      splits[(size_t)k * d + j] = cell_to_split(cell, k_max[j]);
+    }
+  }
+}
+
+static box_collection *bin_to_boxes(const point_source *src, int n, int d,
+				    int *k_max) {
+  /* The body of points_to_boxes and its variants for other kinds of
+   * points. */
   int i, j;
-  double point[d];
   box *cur_box;
   box_collection *p_collection;
   box_split *p_split = new_box_split(d);
   box_split_info *info = new_box_split_info(d, k_max);
+  vector<unsigned long long> splits((size_t)BIN_BLOCK * d);
 
   /* Initialized once, nsplits is constant in this function. */
   for (j = 0; j < d; j++) {
-    p_split->nsplit[j] = k_max;
+    p_split->nsplit[j] = k_max[j];
   }
 
   p_collection = new_box_collection(info);
   free_box_split_info(info);
   
   for(i = 0; i < n; i++) {
+    /* Bin the points a block at a time, see simd.h. */
+    if (i % BIN_BLOCK == 0) {
+      int count = n - i < BIN_BLOCK ? n - i : BIN_BLOCK;
+      if (src->x) {
+	bin_points(src->x, n, d, k_max, i, count, &splits[0]);
+      } else if (src->xf) {
+	bin_points_float(src->xf, n, d, k_max, src->offset, src->scale, i,
+			 count, &splits[0]);
+      } else {
+	bin_cells(src->cells, src->cell_bytes, n, d, k_max, i, count,
+		  &splits[0]);
+      }
+    }
     for(j = 0; j < d; j++) {
-      point[j] = px[i + j * n];
+      p_split->split[j] = splits[(size_t)(i % BIN_BLOCK) * d + j];
     }
 
-    point_to_box(point, d, k_max, p_split->split);
-
     cur_box = find_box(p_collection, p_split);
     if (!cur_box) {
       cur_box = new_box(p_split);
@@ -237,6 +282,60 @@ box_collection *points_to_boxes(double *px, int n, int d, int k_max) {
   return p_collection;
 }
 
+box_collection *points_to_boxes(double *px, int n, int d, int *k_max) {
+  /* Put a collection of points into boxes.
+   *
+   * Args:
+   *   px: pointer to points to box, column centric array.
+   *   n: number of points.
+   *   d: dimension.
+   *   k_max: array of d integers, max number of splits to use in each
+   *     dimension.
+   * Returns:
+   *   pointer to newly alloced box_collection. 
+   */
+  point_source src = {px, NULL, NULL, NULL, NULL, 0};
+  return bin_to_boxes(&src, n, d, k_max);
+}
+
+box_collection *points_to_boxes_float(const float *px, const double *offset,
+				      const double *scale, int n, int d,
+				      int *k_max) {
+  /* Put a collection of single precision points into boxes.
+   *
+   * Args:
+   *   px: pointer to points to box, column centric array, in their
+   *     original coordinates.
+   *   offset, scale: arrays of d doubles, point j of a dimension is at
+   *     (px[j] - offset) / scale in the unit cube.
+   *   n, d, k_max: as for points_to_boxes.
+   * Returns:
+   *   pointer to newly alloced box_collection, the same as points_to_boxes
+   *   gives for the mapped points in double.
+   */
+  point_source src = {NULL, px, offset, scale, NULL, 0};
+  return bin_to_boxes(&src, n, d, k_max);
+}
+
+box_collection *points_to_boxes_cells(const void *cells, int cell_bytes,
+				      int n, int d, int *k_max) {
+  /* Put a collection of points given by their finest boxes into boxes.
+   *
+   * Args:
+   *   cells: pointer to the n x d column major matrix of cell
+   *     coordinates, unsigned integers of cell_bytes bytes.  Coordinate c
+   *     of dimension j is the interval [c, c + 1) / 2^k_max[j] of the unit
+   *     cube, c must be below 2^k_max[j].
+   *   cell_bytes: integer, 1, 2 or 4.
+   *   n, d, k_max: as for points_to_boxes.
+   * Returns:
+   *   pointer to newly alloced box_collection, the same as points_to_boxes
+   *   gives for points inside the cells.
+   */
+  point_source src = {NULL, NULL, NULL, NULL, cells, cell_bytes};
+  return bin_to_boxes(&src, n, d, k_max);
+}
+
 /**************************************************************************
  * Functions for manipulating box collections.
  **************************************************************************/
@@ -350,7 +449,7 @@ box *find_box_sibling(box_collection *pc, box_split *ps, int dim) {
   }
   
   box_split *s = copy_box_split(ps);
-  s->split[dim] ^= 1 << (s->nsplit[dim] - 1);
+  s->split[dim] ^= 1ULL << (s->nsplit[dim] - 1);
   box *sib = find_box(pc, s);
   free_box_split(s);
 
@@ -456,11 +555,8 @@ int remove_split(box_split *split, int dim) {
   if (!split->nsplit[dim]) 
     return BOX_SUCCESS;
   
-  unsigned int split_mask = 0;
-  for (int i = 0; i < split->nsplit[dim] - 1; i++) 
-    split_mask |= (1 << i);
-  split->split[dim] &= split_mask;
   split->nsplit[dim]--;
+  split->split[dim] &= split_mask(split->nsplit[dim]);
   
   return BOX_SUCCESS;
 }
@@ -513,14 +609,26 @@ box_split *new_box_split(int d) {
 
   p->d      = d;
   p->nsplit = (int *)malloc(d * sizeof(int));
-  p->split  = (unsigned int *)malloc(d * sizeof(unsigned int));
+  p->split  = (unsigned long long *)malloc(d * sizeof(unsigned long long));
   
   return p;
 }
 
-int box_split_key_hash_type(int d, int kmax) {
-  int total_max_splits = d * kmax;
-  if (total_max_splits <= sizeof(unsigned int) * CHAR_BIT)
+int total_splits(int d, const int *kmax) {
+  /* Number of splits in a box of the finest lattice, which is also the
+   * depth of the tree above it. */
+  int total = 0;
+  for (int i = 0; i < d; i++) {
+    total += kmax[i];
+  }
+  return total;
+}
+
+int box_split_key_hash_type(int d, const int *kmax) {
+  /* The unsigned long long key holds the number of splits and the splits
+   * of every dimension, kmax bits each, so two bits per split. */
+  int total_max_splits = total_splits(d, kmax);
+  if (2 * total_max_splits <= (int)(sizeof(unsigned long long) * CHAR_BIT))
     return KEY_UNSIGNED_LONG_LONG;
   else
     return KEY_STRING;
@@ -609,15 +717,20 @@ box **get_terminal_boxes(box *p) {
   return ret;
 }
 
-box_split_info *new_box_split_info(int d, int kmax) {
+box_split_info *new_box_split_info(int d, const int *kmax) {
   box_split_info *info = (box_split_info *)malloc(sizeof(box_split_info));
   info->d = d;
-  info->kmax = kmax;
+  info->kmax = (int *)malloc(d * sizeof(int) + 1);
+  memcpy(info->kmax, kmax, d * sizeof(int));
   info->key_hash_type = box_split_key_hash_type(d, kmax);
   return info;
 }
 
 void free_box_split_info(box_split_info *info) {
+  if (!info) {
+    return;
+  }
+  free(info->kmax);
   free(info);
 }
 
@@ -625,8 +738,9 @@ box_split_info * copy_box_split_info(box_split_info *src) {
   box_split_info *dst = (box_split_info *)malloc(sizeof(box_split_info));
 
   dst->d             = src->d;
-  dst->kmax          = src->kmax;
+  dst->kmax          = (int *)malloc(src->d * sizeof(int) + 1);
   dst->key_hash_type = src->key_hash_type;
+  memcpy(dst->kmax, src->kmax, src->d * sizeof(int));
 
   return dst;
 }
@@ -655,27 +769,30 @@ void BoxSplitKey::SetSplitULL(box_split *ps, box_split_info *pi) {
   lkey = 0;
 
   int shift = 0;
-  /* First encode the number of splits. */
+  /* First encode the number of splits, each dimension gets as many bits
+   * as it can have splits. */
   for (int i = 0; i < pi->d; i++) {
-    lkey |= ps->nsplit[i] << shift;
-    shift += pi->kmax;
+    lkey |= (unsigned long long)ps->nsplit[i] << shift;
+    shift += pi->kmax[i];
   }
 
   /* Now encode the splits in each direction. */
   for (int i = 0; i < pi->d; i++) {
     /* If we guaranteed a set state for the unused split bits, we 
      * wouldn't need this inner loop. */
-    lkey |= 
-      (ps->split[i] & ((1 << ps->nsplit[i]) - 1)) << shift;
-    shift += pi->kmax;
+    lkey |= (ps->split[i] & split_mask(ps->nsplit[i])) << shift;
+    shift += pi->kmax[i];
   }
 }
 
 void BoxSplitKey::SetSplitString(box_split *ps, box_split_info *pi) {
+  char field[48];
   skey = "";
   
   for (int i = 0; i < pi->d; i++) {
-    skey += (ps->split[i] & (1 << ps->nsplit[i] - 1)) + " ";
+    snprintf(field, sizeof(field), "%d:%llx ", ps->nsplit[i],
+	     ps->split[i] & split_mask(ps->nsplit[i]));
+    skey += field;
   }
 }
 
@@ -711,7 +828,7 @@ void print_split(box_split *s) {
   for (int i = 0; i < s->d; i++) {
     Rprintf("[%d:%d:", i, s->nsplit[i]);
     for (int j = 0; j < s->nsplit[i]; j++) {
-      int tmp = (s->split[i] & (1 << j)) >> j;
+      int tmp = (int)((s->split[i] >> j) & 1);
       Rprintf(" %d", tmp + 1);
     }
     Rprintf("] ");
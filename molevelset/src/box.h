@@ -5,7 +5,11 @@
 #include <string>
 #include <vector>
 
-#define MAX_SPLITS 31 
+#define MAX_SPLITS 63
+/* Splits of a dimension a point can be binned to from a double coordinate
+ * in [0, 1): past 52 the midpoints of the bisection aren't doubles, and
+ * the boxes stop being the dyadic lattice. */
+#define MAX_POINT_SPLITS 52
 #define LEFT_SPLIT 0
 #define RIGHT_SPLIT 1
 #define BOX_SUCCESS 1
@@ -16,14 +20,17 @@
 
 typedef struct {
   int d;             /* Number of dimensions. */
-  int kmax;          /* Max number of splits in a dimension. */
+  int *kmax;         /* Max number of splits in each dimension. */
   int key_hash_type; /* Indicates the data type used for the key hash. */
 } box_split_info;
 
+/* Bit i of split[j] is the side taken by the i-th split in dimension j,
+ * coarsest first.  A split word holds up to MAX_SPLITS splits; all bit
+ * manipulation is on unsigned long long so that bits past 31 are kept. */
 typedef struct {
-  int *nsplit;          /* Number of splits in each direction. */
-  unsigned int *split;  /* Split in each direction. */
-  int d;                /* Number of dimensions. */
+  int *nsplit;                /* Number of splits in each direction. */
+  unsigned long long *split;  /* Split in each direction. */
+  int d;                      /* Number of dimensions. */
 } box_split;
 
 class BoxSplitKey {
@@ -77,7 +84,15 @@ typedef struct {
 				     this collection. */
 } box_collection;
 
-box_collection *points_to_boxes(double *px, int n, int d, int k_max);
+box_collection *points_to_boxes(double *px, int n, int d, int *k_max);
+box_collection *points_to_boxes_float(const float *px, const double *offset,
+				      const double *scale, int n, int d,
+				      int *k_max);
+box_collection *points_to_boxes_cells(const void *cells, int cell_bytes,
+				      int n, int d, int *k_max);
+void point_to_box(double *px, int d, int *k_max, unsigned long long *pbox);
+unsigned long long point_to_split(double *px, int d, int k_max);
+unsigned long long cell_to_split(unsigned long long cell, int k_max);
 
 /* Functions for working with collections. */
 box_collection *new_box_collection(box_split_info *);
@@ -92,6 +107,7 @@ box **list_boxes(box_collection *src);
 
 int split_to_interval(box_split *split, int dim, double *x1, double *x2);
 int compare_splits(box_split *ps1, box_split *ps2);
+unsigned long long split_mask(int nsplit);
 
 /* Functions for working with box_splits. */
 box_split * copy_box_split(box_split *split);
@@ -101,8 +117,9 @@ void free_box_split(box_split *split);
 box_split *new_box_split(int d);
 
 /* Box split info functions. */
-int box_split_key_hash_type(int d, int kmax);
-box_split_info *new_box_split_info(int d, int kmax);
+int total_splits(int d, const int *kmax);
+int box_split_key_hash_type(int d, const int *kmax);
+box_split_info *new_box_split_info(int d, const int *kmax);
 box_split_info *copy_box_split_info(box_split_info *);
 void free_box_split_info(box_split_info *);
 
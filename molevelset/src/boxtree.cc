@@ -0,0 +1,478 @@
+#include <stdlib.h>
+
+#include <R.h>
+
+#include "boxtree.h"
+
+using std::vector;
+
+static int split_bit(box_split *split, int dim, int pos) {
+  /* Get one split of a box_split.
+   *
+   * Args:
+   *   split: pointer to the split.
+   *   dim: dimension to look at.
+   *   pos: which split, 0 is the coarsest.
+   * Returns:
+   *   LEFT_SPLIT or RIGHT_SPLIT.
+   */
+  return (split->split[dim] >> pos) & 1;
+}
+
+static void child_region(box_split *dst, box_split *parent, int dim,
+			 int side) {
+  /* Compute the region of one half of a parent region.
+   *
+   * Args:
+   *   dst: pointer to box_split, populated by this function.
+   *   parent: pointer to the parent region.
+   *   dim: dimension that is split.
+   *   side: LEFT_SPLIT or RIGHT_SPLIT, which half to take.
+   */
+  copy_box_split2(dst, parent);
+  int pos = dst->nsplit[dim];
+  dst->split[dim] &= ~(1ULL << pos);
+  dst->split[dim] |= ((unsigned long long)side) << pos;
+  dst->nsplit[dim]++;
+}
+
+static box_tree_node *new_box_tree_node(box_split *split) {
+  box_tree_node *p = (box_tree_node *)malloc(sizeof(box_tree_node));
+  p->split       = copy_box_split(split);
+  p->dim         = -1;
+  p->leaf        = -1;
+  p->children[0] = NULL;
+  p->children[1] = NULL;
+  return p;
+}
+
+static void free_box_tree_node(box_tree_node *p) {
+  if (!p) {
+    return;
+  }
+  free_box_tree_node(p->children[0]);
+  free_box_tree_node(p->children[1]);
+  free_box_split(p->split);
+  free(p);
+}
+
+static box_tree_node *build_box_tree_node(box_split *region,
+					  box_split **leaves,
+					  vector<int> &idx, int *ok) {
+  /* Recursively build the tree for the leaves inside a region.
+   *
+   * Args:
+   *   region: pointer to the region covered by the new node.
+   *   leaves: array of all terminal box splits.
+   *   idx: indexes of the leaves inside region.
+   *   ok: set to 0 if the leaves overlap.
+   * Returns:
+   *   pointer to the new node, NULL if idx is empty or on error.
+   */
+  if (idx.empty() || !*ok) {
+    return NULL;
+  }
+
+  /* A region holding a single box with the same splits is a leaf. */
+  if (idx.size() == 1 && compare_splits(region, leaves[idx[0]])) {
+    box_tree_node *p = new_box_tree_node(region);
+    p->leaf = idx[0];
+    return p;
+  }
+
+  /* Otherwise some dimension must be split further by every leaf in the
+   * region.  Because the boxes came from a dyadic tree such a dimension
+   * always exists; if it doesn't the boxes overlap. */
+  int dim = -1;
+  for (int j = 0; j < region->d && dim < 0; j++) {
+    dim = j;
+    for (size_t i = 0; i < idx.size(); i++) {
+      if (leaves[idx[i]]->nsplit[j] <= region->nsplit[j]) {
+	dim = -1;
+	break;
+      }
+    }
+  }
+  if (dim < 0) {
+    *ok = 0;
+    return NULL;
+  }
+
+  vector<int> side_idx[2];
+  for (size_t i = 0; i < idx.size(); i++) {
+    int side = split_bit(leaves[idx[i]], dim, region->nsplit[dim]);
+    side_idx[side].push_back(idx[i]);
+  }
+
+  box_tree_node *p = new_box_tree_node(region);
+  p->dim = dim;
+  box_split *child = new_box_split(region->d);
+  for (int side = LEFT_SPLIT; side <= RIGHT_SPLIT; side++) {
+    child_region(child, region, dim, side);
+    p->children[side] = build_box_tree_node(child, leaves, side_idx[side],
+					    ok);
+  }
+  free_box_split(child);
+
+  return p;
+}
+
+box_tree *new_box_tree(box_split **leaves, int n_leaves, int d) {
+  /* Build a box tree from a set of terminal boxes.
+   *
+   * Args:
+   *   leaves: array of pointers to the splits of the terminal boxes.
+   *   n_leaves: integer, length of leaves.
+   *   d: number of dimensions.
+   * Returns:
+   *   pointer to the new tree, NULL if the boxes overlap.
+   */
+  vector<int> idx;
+  for (int i = 0; i < n_leaves; i++) {
+    if (!leaves[i] || leaves[i]->d != d) {
+      return NULL;
+    }
+    idx.push_back(i);
+  }
+
+  box_split *region = new_box_split(d);
+  for (int j = 0; j < d; j++) {
+    region->nsplit[j] = 0;
+    region->split[j] = 0;
+  }
+
+  int ok = 1;
+  box_tree_node *root = build_box_tree_node(region, leaves, idx, &ok);
+  free_box_split(region);
+  if (!ok) {
+    free_box_tree_node(root);
+    return NULL;
+  }
+
+  box_tree *tree = (box_tree *)malloc(sizeof(box_tree));
+  tree->d        = d;
+  tree->n_leaves = n_leaves;
+  tree->root     = root;
+  return tree;
+}
+
+void free_box_tree(box_tree *tree) {
+  /* Free a box tree and all of its nodes.
+   *
+   * Args:
+   *   tree: pointer to the tree to free.
+   */
+  if (!tree) {
+    return;
+  }
+  free_box_tree_node(tree->root);
+  free(tree);
+}
+
+int box_tree_find(box_tree *tree, double *px) {
+  /* Find the terminal box containing a point.
+   *
+   * Args:
+   *   tree: pointer to the tree.
+   *   px: pointer to the d coordinates of the point, in the unit cube.
+   * Returns:
+   *   index of the terminal box containing px, -1 if px is in empty space.
+   */
+  if (!tree) {
+    return -1;
+  }
+  box_tree_node *p = tree->root;
+  while (p && p->dim >= 0) {
+    double x1, x2;
+    split_to_interval(p->split, p->dim, &x1, &x2);
+    p = p->children[px[p->dim] < (x1 + x2) / 2 ? LEFT_SPLIT : RIGHT_SPLIT];
+  }
+  return p ? p->leaf : -1;
+}
+
+typedef struct {
+  int d;
+  box_tree_face_fn fn;
+  void *data;
+} face_walk;
+
+static void walk_face(face_walk *w, box_tree_node *a, box_split *ra,
+		      box_tree_node *b, box_split *rb, int dim,
+		      double position) {
+  /* Walk both sides of a face down to the terminal boxes touching it.
+   *
+   * Args:
+   *   w: pointer to the walk state.
+   *   a: node below the face, NULL for empty space.
+   *   ra: region of a.
+   *   b: node above the face, NULL for empty space.
+   *   rb: region of b.
+   *   dim: dimension normal to the face.
+   *   position: location of the face in dimension dim.
+   */
+  if (!a && !b) {
+    return;
+  }
+
+  box_split *child = new_box_split(w->d);
+  if (a && a->dim == dim) {
+    /* Only the upper half of a touches the face. */
+    child_region(child, ra, dim, RIGHT_SPLIT);
+    walk_face(w, a->children[RIGHT_SPLIT], child, b, rb, dim, position);
+  } else if (b && b->dim == dim) {
+    /* Only the lower half of b touches the face. */
+    child_region(child, rb, dim, LEFT_SPLIT);
+    walk_face(w, a, ra, b->children[LEFT_SPLIT], child, dim, position);
+  } else if (a && a->dim >= 0) {
+    /* a is split along the face.  If b is already finer in that dimension
+     * only one half of a can touch it. */
+    int m = a->dim;
+    for (int side = LEFT_SPLIT; side <= RIGHT_SPLIT; side++) {
+      if (rb->nsplit[m] > ra->nsplit[m] &&
+	  split_bit(rb, m, ra->nsplit[m]) != side) {
+	continue;
+      }
+      child_region(child, ra, m, side);
+      walk_face(w, a->children[side], child, b, rb, dim, position);
+    }
+  } else if (b && b->dim >= 0) {
+    int m = b->dim;
+    for (int side = LEFT_SPLIT; side <= RIGHT_SPLIT; side++) {
+      if (ra->nsplit[m] > rb->nsplit[m] &&
+	  split_bit(ra, m, rb->nsplit[m]) != side) {
+	continue;
+      }
+      child_region(child, rb, m, side);
+      walk_face(w, a, ra, b->children[side], child, dim, position);
+    }
+  } else {
+    /* Both sides are terminal boxes or empty space.  The shared face is
+     * the finer of the two regions in every other dimension. */
+    for (int j = 0; j < w->d; j++) {
+      box_split *finer = rb->nsplit[j] > ra->nsplit[j] ? rb : ra;
+      child->nsplit[j] = finer->nsplit[j];
+      child->split[j] = finer->split[j];
+    }
+    w->fn(dim, position, child, a ? a->leaf : -1, b ? b->leaf : -1,
+	  w->data);
+  }
+  free_box_split(child);
+}
+
+static void walk_node_faces(face_walk *w, box_tree_node *p) {
+  /* Visit the faces between the children of every internal node.
+   *
+   * Args:
+   *   w: pointer to the walk state.
+   *   p: node to visit.
+   */
+  if (!p || p->dim < 0) {
+    return;
+  }
+
+  double x1, x2;
+  split_to_interval(p->split, p->dim, &x1, &x2);
+
+  box_split *left = new_box_split(w->d);
+  box_split *right = new_box_split(w->d);
+  child_region(left, p->split, p->dim, LEFT_SPLIT);
+  child_region(right, p->split, p->dim, RIGHT_SPLIT);
+  walk_face(w, p->children[LEFT_SPLIT], left, p->children[RIGHT_SPLIT],
+	    right, p->dim, (x1 + x2) / 2);
+  free_box_split(left);
+  free_box_split(right);
+
+  walk_node_faces(w, p->children[LEFT_SPLIT]);
+  walk_node_faces(w, p->children[RIGHT_SPLIT]);
+}
+
+void box_tree_faces(box_tree *tree, box_tree_face_fn fn, void *data) {
+  /* Visit every face between two regions of a box tree, including the
+   * faces on the boundary of the unit cube.
+   *
+   * Args:
+   *   tree: pointer to the tree.
+   *   fn: function called for each face.
+   *   data: pointer passed to fn.
+   */
+  if (!tree || !tree->root) {
+    return;
+  }
+
+  face_walk w;
+  w.d    = tree->d;
+  w.fn   = fn;
+  w.data = data;
+
+  /* Faces on the boundary of the unit cube border empty space. */
+  box_split *root = tree->root->split;
+  for (int dim = 0; dim < tree->d; dim++) {
+    walk_face(&w, NULL, root, tree->root, root, dim, 0.0);
+    walk_face(&w, tree->root, root, NULL, root, dim, 1.0);
+  }
+
+  walk_node_faces(&w, tree->root);
+}
+
+typedef struct {
+  int *labels;
+  box_tree_facets *facets;
+} boundary_walk;
+
+static void add_boundary_facet(int dim, double position, box_split *face,
+			       int low_leaf, int high_leaf, void *data) {
+  /* Record a face if the regions on either side have different labels. */
+  boundary_walk *bw = (boundary_walk *)data;
+  int low = low_leaf < 0 ? -1 : bw->labels[low_leaf];
+  int high = high_leaf < 0 ? -1 : bw->labels[high_leaf];
+  if (low == high) {
+    return;
+  }
+
+  box_tree_facets *f = bw->facets;
+  f->dim->push_back(dim);
+  for (int j = 0; j < f->d; j++) {
+    double x1, x2;
+    if (j == dim) {
+      x1 = x2 = position;
+    } else {
+      split_to_interval(face, j, &x1, &x2);
+    }
+    f->lower->push_back(x1);
+    f->upper->push_back(x2);
+  }
+  f->low_leaf->push_back(low_leaf);
+  f->high_leaf->push_back(high_leaf);
+}
+
+box_tree_facets *find_boundary_facets(box_tree *tree, int *labels) {
+  /* Find the facets where differently labelled regions meet.
+   *
+   * Args:
+   *   tree: pointer to the tree.
+   *   labels: array with one label per terminal box.  Empty space has the
+   *     label -1, so labels should be non-negative.
+   * Returns:
+   *   pointer to the newly allocated facets.
+   */
+  box_tree_facets *f = (box_tree_facets *)malloc(sizeof(box_tree_facets));
+  f->d         = tree ? tree->d : 0;
+  f->dim       = new vector<int>;
+  f->lower     = new vector<double>;
+  f->upper     = new vector<double>;
+  f->low_leaf  = new vector<int>;
+  f->high_leaf = new vector<int>;
+
+  boundary_walk bw;
+  bw.labels = labels;
+  bw.facets = f;
+  box_tree_faces(tree, add_boundary_facet, &bw);
+
+  return f;
+}
+
+void free_box_tree_facets(box_tree_facets *f) {
+  if (!f) {
+    return;
+  }
+  delete f->dim;
+  delete f->lower;
+  delete f->upper;
+  delete f->low_leaf;
+  delete f->high_leaf;
+  free(f);
+}
+
+static int find_root(int *parent, int i) {
+  /* Find the representative of a union-find set, halving the path. */
+  while (parent[i] != i) {
+    parent[i] = parent[parent[i]];
+    i = parent[i];
+  }
+  return i;
+}
+
+typedef struct {
+  int *labels;
+  int label;
+  int *parent;
+  int *rank;
+} component_walk;
+
+static void join_components(int dim, double position, box_split *face,
+			    int low_leaf, int high_leaf, void *data) {
+  /* Join two boxes sharing a face if both have the requested label. */
+  component_walk *cw = (component_walk *)data;
+  if (low_leaf < 0 || high_leaf < 0 || cw->labels[low_leaf] != cw->label ||
+      cw->labels[high_leaf] != cw->label) {
+    return;
+  }
+
+  int a = find_root(cw->parent, low_leaf);
+  int b = find_root(cw->parent, high_leaf);
+  if (a == b) {
+    return;
+  }
+  if (cw->rank[a] < cw->rank[b]) {
+    int tmp = a;
+    a = b;
+    b = tmp;
+  }
+  cw->parent[b] = a;
+  if (cw->rank[a] == cw->rank[b]) {
+    cw->rank[a]++;
+  }
+}
+
+int find_components(box_tree *tree, int *labels, int label, int *component) {
+  /* Label the connected components of the boxes with a given label.  Two
+   * boxes are connected if they share part of a face.
+   *
+   * Args:
+   *   tree: pointer to the tree.
+   *   labels: array with one label per terminal box.
+   *   label: which label to find components for.
+   *   component: array with one entry per terminal box, populated with the
+   *     component of each box (0-relative), -1 for boxes with other labels.
+   *     Components are numbered in order of their first box.
+   * Returns:
+   *   number of components.
+   */
+  int n = tree ? tree->n_leaves : 0;
+  if (!n) {
+    return 0;
+  }
+
+  component_walk cw;
+  cw.labels = labels;
+  cw.label  = label;
+  cw.parent = (int *)malloc(sizeof(int) * n);
+  cw.rank   = (int *)malloc(sizeof(int) * n);
+  for (int i = 0; i < n; i++) {
+    cw.parent[i] = i;
+    cw.rank[i] = 0;
+  }
+
+  box_tree_faces(tree, join_components, &cw);
+
+  /* Number the sets, reusing rank to hold the component of each root. */
+  int n_components = 0;
+  for (int i = 0; i < n; i++) {
+    cw.rank[i] = -1;
+  }
+  for (int i = 0; i < n; i++) {
+    if (labels[i] != label) {
+      component[i] = -1;
+      continue;
+    }
+    int root = find_root(cw.parent, i);
+    if (cw.rank[root] < 0) {
+      cw.rank[root] = n_components++;
+    }
+    component[i] = cw.rank[root];
+  }
+
+  free(cw.parent);
+  free(cw.rank);
+  return n_components;
+}
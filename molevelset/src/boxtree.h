@@ -0,0 +1,65 @@
+#ifndef boxtree_h
+#define boxtree_h
+
+#include "box.h"
+
+/* A box tree recovers the dyadic tree structure of a set of terminal
+ * boxes (for example the inset and non-inset boxes of a levelset
+ * estimate).  Each internal node splits its region in half along one
+ * dimension, leaves are the terminal boxes and NULL children are regions
+ * that contain no terminal box.  The tree is used to find neighbouring
+ * boxes through their split codes. */
+typedef struct box_tree_node {
+  box_split *split;      /* Region covered by this node. */
+  int dim;               /* Dimension split at this node, -1 for leaves. */
+  int leaf;              /* Index of the terminal box for leaves, -1
+			    otherwise. */
+  struct box_tree_node *children[2];
+                         /* Children, indexed by LEFT_SPLIT and
+			    RIGHT_SPLIT.  NULL for empty regions. */
+} box_tree_node;
+
+typedef struct {
+  int d;                 /* Number of dimensions. */
+  int n_leaves;          /* Number of terminal boxes in the tree. */
+  box_tree_node *root;   /* Root of the tree, NULL if there are no
+			    terminal boxes. */
+} box_tree;
+
+/* Called once for every piece of a hyperplane where two regions of the
+ * tree meet.
+ *
+ * Args:
+ *   dim: dimension normal to the face.
+ *   position: location of the face in dimension dim.
+ *   face: extent of the face in every dimension except dim.
+ *   low_leaf: terminal box below the face, -1 for empty space.
+ *   high_leaf: terminal box above the face, -1 for empty space.
+ *   data: pointer passed through from box_tree_faces.
+ */
+typedef void (*box_tree_face_fn)(int dim, double position, box_split *face,
+				 int low_leaf, int high_leaf, void *data);
+
+box_tree *new_box_tree(box_split **leaves, int n_leaves, int d);
+void free_box_tree(box_tree *);
+int box_tree_find(box_tree *, double *px);
+void box_tree_faces(box_tree *, box_tree_face_fn, void *data);
+
+/* Boundary facets of a levelset, stored as flat arrays.  Facet i is normal
+ * to dimension dim[i] and spans lower[i * d + j] to upper[i * d + j] in
+ * dimension j. */
+typedef struct {
+  int d;                       /* Number of dimensions. */
+  std::vector<int> *dim;       /* Normal dimension of each facet. */
+  std::vector<double> *lower;  /* Lower corner of each facet. */
+  std::vector<double> *upper;  /* Upper corner of each facet. */
+  std::vector<int> *low_leaf;  /* Terminal box below each facet, or -1. */
+  std::vector<int> *high_leaf; /* Terminal box above each facet, or -1. */
+} box_tree_facets;
+
+box_tree_facets *find_boundary_facets(box_tree *, int *labels);
+void free_box_tree_facets(box_tree_facets *);
+
+int find_components(box_tree *, int *labels, int label, int *component);
+
+#endif
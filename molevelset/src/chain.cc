@@ -0,0 +1,219 @@
+#include <math.h>
+#include <stdlib.h>
+
+#include "chain.h"
+
+using std::vector;
+
+/* State of the walk down from the root in new_chain_index. */
+typedef struct {
+  chain_index *ci;
+  box **cells;             /* The finest level. */
+  int *order;              /* Cell indexes, each box holds a range. */
+  box_split_info *info;    /* Split info of the levels. */
+  int total;               /* Number of splits of the finest level. */
+} chain_walk;
+
+static int chain_costs_increase(box *cell, int total, levelset_args *la) {
+  /* Check that the cost of a cell's chain grows with every split.
+   *
+   * Args:
+   *   cell: pointer to a box of the finest level.
+   *   total: integer, number of splits of the finest level.
+   *   la: pointer to levelset_args for the run.
+   * Returns:
+   *   1 if a box above the cell holding only its points always costs less
+   *   than one with more splits, 0 otherwise.
+   */
+  int n_points = cell->points->size();
+  double risk = levelset_cost(cell, la).inset_risk;
+  double cost = levelset_cost_from_risk(risk, 0, n_points, la).risk_cost;
+  for (int level = 1; level <= total; level++) {
+    double next = levelset_cost_from_risk(risk, level, n_points,
+					  la).risk_cost;
+    if (!(cost < next)) {
+      return 0;
+    }
+    cost = next;
+  }
+  return 1;
+}
+
+static void add_head(chain_walk *w, box_split *split, int tree_level,
+		     int cell) {
+  /* Record a single cell child of a branch.  A head with several branch
+   * parents is recorded once for each, add_chain_heads adds it once.
+   * Heads in the finest level are the cells themselves. */
+  if (tree_level == w->total) {
+    return;
+  }
+  chain_head head;
+  head.split = copy_box_split(split);
+  head.cell  = cell;
+  w->ci->heads->at(w->total - tree_level).push_back(head);
+}
+
+static void walk_branch(chain_walk *w, box_split *split, int tree_level,
+			int lo, int hi) {
+  /* Find the branches and heads below a branch.
+   *
+   * Each branch is reached once, from the parent that drops its split in
+   * the last dimension it is split in, so a branch only splits further in
+   * that dimension or later ones.  Its single cell children in the earlier
+   * dimensions are heads all the same.
+   *
+   * Args:
+   *   w: pointer to the walk.
+   *   split: pointer to the split of the branch, restored on return.
+   *   tree_level: integer, number of splits of the branch.
+   *   lo, hi: range of w->order holding the cells of the branch.
+   */
+  box_split_info *info = w->info;
+  int d = info->d;
+  int first = 0;
+  for (int j = 0; j < d; j++) {
+    if (split->nsplit[j]) {
+      first = j;
+    }
+  }
+  for (int j = 0; j < d; j++) {
+    int k = split->nsplit[j];
+    if (k >= info->kmax[j]) {
+      continue;
+    }
+    /* Move the cells on the right of the next split to the end. */
+    int mid = lo;
+    for (int i = lo; i < hi; i++) {
+      if (!((w->cells[w->order[i]]->split->split[j] >> k) & 1)) {
+	int tmp = w->order[mid];
+	w->order[mid++] = w->order[i];
+	w->order[i] = tmp;
+      }
+    }
+    int bounds[3] = {lo, mid, hi};
+    split->nsplit[j]++;
+    for (int s = 0; s < 2; s++) {
+      int size = bounds[s + 1] - bounds[s];
+      if (!size) {
+	continue;
+      }
+      split->split[j] |= (unsigned long long)s << k;
+      if (size == 1) {
+	add_head(w, split, tree_level + 1, w->order[bounds[s]]);
+      } else if (j >= first) {
+	walk_branch(w, split, tree_level + 1, bounds[s], bounds[s + 1]);
+      }
+      split->split[j] &= split_mask(k);
+    }
+    split->nsplit[j]--;
+  }
+}
+
+chain_index *new_chain_index(box_collection *finest, levelset_args *la) {
+  /* Find the branches and chain heads above the finest level.
+   *
+   * Args:
+   *   finest: pointer to the finest level, the cells.  It is not changed.
+   *   la: pointer to levelset_args for the run, with A set.
+   * Returns:
+   *   pointer to the new chain index, or NULL if the chains can't be
+   *   collapsed: there are fewer than two cells, the data are too dense,
+   *   or the cost of some chain does not strictly increase with the number
+   *   of splits.
+   */
+  box_split_info *info = finest->info;
+  int d = info->d;
+  int total = total_splits(d, info->kmax);
+  box **boxes = list_boxes(finest);
+  int n_cells = box_collection_size(finest);
+  int ok = n_cells >= 2 &&
+    ldexp(1.0, total) >= (double)CHAIN_MIN_SPARSITY * n_cells;
+  for (int c = 0; ok && c < n_cells; c++) {
+    ok = chain_costs_increase(boxes[c], total, la);
+  }
+  if (!ok) {
+    free(boxes);
+    return NULL;
+  }
+
+  chain_index *ci = (chain_index *)malloc(sizeof(chain_index));
+  ci->heads = new vector<vector<chain_head> >(total + 1);
+  ci->cells = new vector<vector<int> >(n_cells);
+  ci->cell_of_point = new vector<int>(la->n, -1);
+  for (int c = 0; c < n_cells; c++) {
+    ci->cells->at(c) = *boxes[c]->points;
+    for (size_t i = 0; i < boxes[c]->points->size(); i++) {
+      ci->cell_of_point->at(boxes[c]->points->at(i)) = c;
+    }
+  }
+
+  vector<int> order(n_cells);
+  for (int c = 0; c < n_cells; c++) {
+    order[c] = c;
+  }
+  chain_walk w = {ci, boxes, &order[0], info, total};
+  box_split *root = new_box_split(d);
+  for (int j = 0; j < d; j++) {
+    root->nsplit[j] = 0;
+    root->split[j]  = 0;
+  }
+  walk_branch(&w, root, 0, 0, n_cells);
+  free_box_split(root);
+  free(boxes);
+  return ci;
+}
+
+void free_chain_index(chain_index *ci) {
+  /* Free a chain index. */
+  if (!ci) {
+    return;
+  }
+  for (size_t i = 0; i < ci->heads->size(); i++) {
+    for (size_t h = 0; h < ci->heads->at(i).size(); h++) {
+      free_box_split(ci->heads->at(i)[h].split);
+    }
+  }
+  delete ci->heads;
+  delete ci->cells;
+  delete ci->cell_of_point;
+  free(ci);
+}
+
+int is_chain_box(chain_index *ci, box *p) {
+  /* Whether a box holds a single cell, so that its parent in a dimension
+   * where it has no sibling is a chain box too.
+   *
+   * The points of a box are those of its children, the first child's
+   * first, and children hold different cells, so the first and last points
+   * of a box with two or more cells are always in different cells. */
+  const vector<int> *points = p->points;
+  return ci->cell_of_point->at(points->front()) ==
+    ci->cell_of_point->at(points->back());
+}
+
+void add_chain_heads(chain_index *ci, box_collection *pc, int level,
+		     levelset_args *la) {
+  /* Add the heads of a level as terminal boxes.
+   *
+   * Args:
+   *   ci: pointer to the chain index.
+   *   pc: pointer to the level, built from the level below.
+   *   level: integer, index of the level, 0 for the finest.
+   *   la: pointer to levelset_args for the run.
+   */
+  vector<chain_head> *heads = &ci->heads->at(level);
+  for (size_t h = 0; h < heads->size(); h++) {
+    chain_head *head = &heads->at(h);
+    if (find_box(pc, head->split)) {
+      continue;
+    }
+    box *p = new_box(head->split);
+    const vector<int> *points = &ci->cells->at(head->cell);
+    p->points->reserve(points->size());
+    for (size_t i = 0; i < points->size(); i++) {
+      add_point(p, points->at(i));
+    }
+    p->risk = levelset_cost(p, la);
+    add_box(pc, p);
+  }
+}
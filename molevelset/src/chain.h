@@ -0,0 +1,55 @@
+#ifndef chain_h
+#define chain_h
+
+#include <vector>
+
+#include "box.h"
+#include "molevelset.h"
+
+/* Collapses the chains of compute_levelset.
+ *
+ * With sparse data most boxes of the finer levels hold the points of a
+ * single finest box, a cell.  Every ancestor of a cell that holds no other
+ * cell has the same points, and its only child in each dimension is
+ * another such ancestor, so the boxes above a cell form a chain of single
+ * child merges that ends where the cell first shares a box with another.
+ * Along a chain the inset risk is fixed and the complexity penalty grows
+ * with the number of splits, so the optimal tree of a chain box is the box
+ * itself, and only the boxes at the top of each chain, the heads, are ever
+ * the child of a box with two or more cells.
+ *
+ * A chain index lists the heads, found by walking down from the root
+ * through the branches, the boxes with two or more cells.  compute_levelset
+ * then builds only the branches from the level below and adds the heads to
+ * each level as terminal boxes, which gives the same levels (less the
+ * chains), costs and estimate as walking every chain one merge at a time.
+ *
+ * The closed form needs the cost of every chain to strictly increase with
+ * the number of splits, which fails for rho <= 0 or when the penalty is
+ * lost to rounding; new_chain_index checks this and returns NULL then.
+ * It also returns NULL for dense data, with fewer than CHAIN_MIN_SPARSITY
+ * finest boxes per cell, where the chains are a merge or two long and
+ * finding the heads costs more than the merges it saves.  The index
+ * copies the points of every cell, so compute_levelset_control does not
+ * make one when it has a memory budget to keep to. */
+#define CHAIN_MIN_SPARSITY 8
+
+typedef struct {
+  box_split *split;   /* Split of the head. */
+  int cell;           /* Index of the cell it holds. */
+} chain_head;
+
+typedef struct {
+  std::vector<std::vector<chain_head> > *heads;
+                                         /* Heads by level, finest first. */
+  std::vector<std::vector<int> > *cells; /* Points of each cell. */
+  std::vector<int> *cell_of_point;       /* Cell of each point. */
+} chain_index;
+
+chain_index *new_chain_index(box_collection *finest, levelset_args *la);
+void free_chain_index(chain_index *);
+int is_chain_box(chain_index *, box *);
+void add_chain_heads(chain_index *, box_collection *pc, int level,
+		     levelset_args *la);
+
+#endif
@@ -0,0 +1,410 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include <R.h>
+
+#include "checkpoint.h"
+
+using std::vector;
+
+#define LEVEL_START 0x4c56454c
+#define LEVEL_END   0x444e454c
+
+typedef struct {
+  char magic[8];             /* CHECKPOINT_MAGIC. */
+  int version;               /* CHECKPOINT_VERSION. */
+  int d;                     /* Number of dimensions. */
+  int kmax;                  /* Total number of splits, the sum of the
+				per dimension kmax. */
+  int n;                     /* Number of points. */
+  double A;                  /* Bound on |y|. */
+  double gamma;              /* Threshold for the levelset. */
+  double delta;              /* Complexity factor. */
+  double rho;                /* Cost penalty. */
+  unsigned long long hash;   /* Hash of the kmax, x and y values. */
+} checkpoint_header;
+
+static unsigned long long hash_data(levelset_args *la) {
+  /* FNV-1a hash of the per dimension kmax, the points and responses, so a
+   * checkpoint is never resumed with different data.  Single precision
+   * points are hashed with their offset and scale, cell coordinates as
+   * they are. */
+  unsigned long long h = 14695981039346656037ULL;
+  const unsigned char *bytes[5] = {(const unsigned char *)la->kmax,
+				   (const unsigned char *)la->x,
+				   (const unsigned char *)la->y};
+  size_t sizes[5] = {sizeof(int) * la->d, sizeof(double) * la->n * la->d,
+		     sizeof(double) * la->n, 0, 0};
+  if (!la->x && !la->xf) {
+    bytes[1] = (const unsigned char *)la->cells;
+    sizes[1] = (size_t)la->cell_bytes * la->n * la->d;
+  } else if (!la->x) {
+    bytes[1] = (const unsigned char *)la->xf;
+    sizes[1] = sizeof(float) * la->n * la->d;
+    bytes[3] = (const unsigned char *)la->offset;
+    bytes[4] = (const unsigned char *)la->scale;
+    sizes[3] = sizes[4] = sizeof(double) * la->d;
+  }
+  if (!la->y) {
+    bytes[2] = (const unsigned char *)la->yf;
+    sizes[2] = sizeof(float) * la->n;
+  }
+  for (int k = 0; k < 5; k++) {
+    for (size_t i = 0; i < sizes[k]; i++) {
+      h ^= bytes[k][i];
+      h *= 1099511628211ULL;
+    }
+  }
+  return h;
+}
+
+static checkpoint_header make_header(levelset_args *la) {
+  checkpoint_header h;
+  memset(&h, 0, sizeof(h));
+  strncpy(h.magic, CHECKPOINT_MAGIC, sizeof(h.magic));
+  h.version = CHECKPOINT_VERSION;
+  h.d       = la->d;
+  h.kmax    = total_splits(la->d, la->kmax);
+  h.n       = la->n;
+  h.A       = la->A;
+  h.gamma   = la->gamma;
+  h.delta   = la->delta;
+  h.rho     = la->rho;
+  h.hash    = hash_data(la);
+  return h;
+}
+
+static int write_ints(FILE *f, const int *x, int n) {
+  return (int)fwrite(x, sizeof(int), n, f) == n;
+}
+
+static int read_ints(FILE *f, int *x, int n) {
+  return (int)fread(x, sizeof(int), n, f) == n;
+}
+
+static int write_split(FILE *f, box_split *split) {
+  return write_ints(f, split->nsplit, split->d) &&
+    (int)fwrite(split->split, sizeof(unsigned long long), split->d, f) == split->d;
+}
+
+static int read_split(FILE *f, box_split *split) {
+  return read_ints(f, split->nsplit, split->d) &&
+    (int)fread(split->split, sizeof(unsigned long long), split->d, f) == split->d;
+}
+
+static int write_box(FILE *f, box *p) {
+  /* Write one box of a level record.
+   *
+   * Args:
+   *   f: file to write to.
+   *   p: pointer to the box.
+   * Returns:
+   *   BOX_SUCCESS if the box was written, BOX_ERROR otherwise.
+   */
+  double risk[3] = {p->risk.inset_risk, p->risk.cost, p->risk.risk_cost};
+  int flags[2] = {p->terminal_box, p->risk.inset};
+  if (!write_split(f, p->split) || !write_ints(f, flags, 2) ||
+      fwrite(risk, sizeof(double), 3, f) != 3) {
+    return BOX_ERROR;
+  }
+
+  /* Only terminal boxes keep their points, the points of any other box
+   * are the points of the terminal boxes below it. */
+  if (p->terminal_box) {
+    int n_points = p->points->size();
+    if (!write_ints(f, &n_points, 1) ||
+	(n_points && !write_ints(f, &p->points->at(0), n_points))) {
+      return BOX_ERROR;
+    }
+    return BOX_SUCCESS;
+  }
+
+  int n_children = p->children[1] ? 2 : 1;
+  if (!write_ints(f, &n_children, 1)) {
+    return BOX_ERROR;
+  }
+  for (int i = 0; i < n_children; i++) {
+    if (!write_split(f, p->children[i]->split)) {
+      return BOX_ERROR;
+    }
+  }
+  return BOX_SUCCESS;
+}
+
+static box *read_box(FILE *f, int d, box_split **children) {
+  /* Read one box of a level record.
+   *
+   * Args:
+   *   f: file to read from.
+   *   d: integer, number of dimensions.
+   *   children: array of 2 box_splits, populated with the splits of the
+   *     children of a non-terminal box.  A missing second child has d = 0.
+   * Returns:
+   *   pointer to the new box, NULL if the record is incomplete.  The
+   *   children of the box are not set.
+   */
+  box_split *split = new_box_split(d);
+  double risk[3];
+  int flags[2];
+  int count;
+  if (!read_split(f, split) || !read_ints(f, flags, 2) ||
+      fread(risk, sizeof(double), 3, f) != 3 || !read_ints(f, &count, 1) ||
+      count < 0) {
+    free_box_split(split);
+    return NULL;
+  }
+
+  box *p = new_box(split);
+  free_box_split(split);
+  p->terminal_box    = flags[0];
+  p->risk.inset      = flags[1];
+  p->risk.inset_risk = risk[0];
+  p->risk.cost       = risk[1];
+  p->risk.risk_cost  = risk[2];
+  p->risk.calculated = 1;
+  p->children[0]     = NULL;
+  p->children[1]     = NULL;
+
+  int ok = 1;
+  if (p->terminal_box) {
+    p->points->resize(count);
+    ok = !count || read_ints(f, &p->points->at(0), count);
+  } else {
+    ok = count == 1 || count == 2;
+    children[1]->d = count == 2 ? d : 0;
+    for (int i = 0; ok && i < count; i++) {
+      ok = read_split(f, children[i]);
+    }
+  }
+
+  if (!ok) {
+    free_box_but_not_children(p);
+    return NULL;
+  }
+  return p;
+}
+
+int read_checkpoint_level(FILE *f, int level, int d, box_collection *pc,
+			  std::set<BoxSplitKey> *keep,
+			  std::vector<checkpoint_link> *links) {
+  /* Read a level record into a collection.
+   *
+   * Args:
+   *   f: file to read from, positioned at the start of the record.
+   *   level: integer, expected index of the level.
+   *   d: integer, number of dimensions.
+   *   pc: pointer to the collection to add the boxes to.
+   *   keep: set of the boxes to keep, NULL to keep every box.
+   *   links: the children of the boxes that were kept are added to this,
+   *     to be resolved by link_checkpoint_children.
+   * Returns:
+   *   BOX_SUCCESS if the whole record was read, BOX_ERROR otherwise.
+   */
+  int head[3];
+  if (!read_ints(f, head, 3) || head[0] != LEVEL_START || head[1] != level ||
+      head[2] < 0) {
+    return BOX_ERROR;
+  }
+
+  box_split *children[2] = {new_box_split(d), new_box_split(d)};
+  int ok = 1;
+  for (int i = 0; ok && i < head[2]; i++) {
+    box *p = read_box(f, d, children);
+    if (!p) {
+      ok = 0;
+      break;
+    }
+    if (keep && !keep->count(BoxSplitKey(p->split, pc->info))) {
+      free_box_but_not_children(p);
+      continue;
+    }
+    add_box(pc, p);
+    for (int side = 0; !p->terminal_box && side < 2; side++) {
+      if (children[side]->d) {
+	checkpoint_link link = {p, side, copy_box_split(children[side])};
+	links->push_back(link);
+      }
+    }
+  }
+  children[1]->d = d;
+  free_box_split(children[0]);
+  free_box_split(children[1]);
+
+  int tail[2];
+  if (!ok || !read_ints(f, tail, 2) || tail[0] != LEVEL_END ||
+      tail[1] != level) {
+    return BOX_ERROR;
+  }
+  return BOX_SUCCESS;
+}
+
+int link_checkpoint_children(std::vector<checkpoint_link> *links,
+			     box_collection *below) {
+  /* Point boxes at their children, once the level below has been read.
+   *
+   * Args:
+   *   links: children to resolve, emptied by this function.
+   *   below: pointer to the level holding the children.
+   * Returns:
+   *   BOX_SUCCESS if every child was found, BOX_ERROR otherwise.
+   */
+  int ok = 1;
+  for (size_t i = 0; i < links->size(); i++) {
+    checkpoint_link *link = &links->at(i);
+    box *child = below ? find_box(below, link->split) : NULL;
+    ok = ok && child;
+    link->parent->children[link->side] = child;
+    free_box_split(link->split);
+  }
+  links->clear();
+  return ok ? BOX_SUCCESS : BOX_ERROR;
+}
+
+static box_collection *read_level(FILE *f, int level, int d,
+				  box_split_info *info, box_collection *below) {
+  /* Read one level record, NULL if it is incomplete. */
+  box_collection *pc = new_box_collection(info);
+  vector<checkpoint_link> links;
+  int ok = read_checkpoint_level(f, level, d, pc, NULL, &links) ==
+    BOX_SUCCESS;
+  ok = link_checkpoint_children(&links, below) == BOX_SUCCESS && ok;
+  if (!ok) {
+    free_box_collection(pc);
+    return NULL;
+  }
+  return pc;
+}
+
+static void gather_points(box *p, vector<int> *points) {
+  /* Collect the points of the terminal boxes below a box, in the order
+   * combine_boxes would have added them. */
+  if (!p) {
+    return;
+  }
+  if (p->terminal_box) {
+    points->insert(points->end(), p->points->begin(), p->points->end());
+    return;
+  }
+  gather_points(p->children[0], points);
+  gather_points(p->children[1], points);
+}
+
+int read_checkpoint(const char *path, levelset_args *la, box_split_info *info,
+		    box_collection **pc, int max_depth, long *end) {
+  /* Load the completed levels of a checkpoint file.
+   *
+   * Args:
+   *   path: name of the checkpoint file.
+   *   la: pointer to levelset_args, the checkpoint must have been written
+   *     for the same data and parameters.
+   *   info: pointer to the box split info for the levels.
+   *   pc: array of max_depth box collections, populated with the levels
+   *     that were loaded.
+   *   max_depth: integer, number of levels in a full run.
+   *   end: set to the offset just after the last completed level, or 0 if
+   *     no level was loaded.
+   * Returns:
+   *   number of levels loaded, 0 if the file does not exist or was written
+   *   for a different run.
+   */
+  *end = 0;
+  FILE *f = fopen(path, "rb");
+  if (!f) {
+    return 0;
+  }
+
+  checkpoint_header expected = make_header(la);
+  checkpoint_header h;
+  if (fread(&h, sizeof(h), 1, f) != 1 ||
+      memcmp(&h, &expected, sizeof(h))) {
+    fclose(f);
+    return 0;
+  }
+
+  int n_levels = 0;
+  while (n_levels < max_depth) {
+    box_collection *level = read_level(f, n_levels, la->d, info,
+				       n_levels ? pc[n_levels - 1] : NULL);
+    if (!level) {
+      break;
+    }
+    pc[n_levels++] = level;
+    *end = ftell(f);
+  }
+  fclose(f);
+
+  /* The next minimax_step combines the points of the last level. */
+  if (n_levels) {
+    box **boxes = list_boxes(pc[n_levels - 1]);
+    for (int i = 0; boxes[i]; i++) {
+      if (!boxes[i]->terminal_box) {
+	gather_points(boxes[i], boxes[i]->points);
+      }
+    }
+    free(boxes);
+  }
+  return n_levels;
+}
+
+FILE *start_checkpoint(const char *path, levelset_args *la, long end) {
+  /* Open a checkpoint file for writing levels.
+   *
+   * Args:
+   *   path: name of the checkpoint file.
+   *   la: pointer to levelset_args for the run.
+   *   end: offset returned by read_checkpoint.  If positive, the file is
+   *     kept up to that offset and new levels are written after it,
+   *     otherwise the file is started over.
+   * Returns:
+   *   the open file, NULL on failure.
+   */
+  FILE *f;
+  if (end > 0) {
+    f = fopen(path, "r+b");
+    if (f && fseek(f, end, SEEK_SET)) {
+      fclose(f);
+      f = NULL;
+    }
+    return f;
+  }
+
+  f = fopen(path, "wb");
+  if (!f) {
+    return NULL;
+  }
+  checkpoint_header h = make_header(la);
+  if (fwrite(&h, sizeof(h), 1, f) != 1 || fflush(f)) {
+    fclose(f);
+    return NULL;
+  }
+  return f;
+}
+
+int write_checkpoint_level(FILE *f, int level, box_collection *pc) {
+  /* Append a level record to a checkpoint file.
+   *
+   * Args:
+   *   f: file returned by start_checkpoint.
+   *   level: integer, index of the level, 0 for the finest.
+   *   pc: pointer to the boxes in the level.
+   * Returns:
+   *   BOX_SUCCESS if the level was written, BOX_ERROR otherwise.
+   */
+  int head[3] = {LEVEL_START, level, box_collection_size(pc)};
+  if (!write_ints(f, head, 3)) {
+    return BOX_ERROR;
+  }
+
+  box **boxes = list_boxes(pc);
+  int ok = 1;
+  for (int i = 0; ok && boxes[i]; i++) {
+    ok = write_box(f, boxes[i]) == BOX_SUCCESS;
+  }
+  free(boxes);
+
+  int tail[2] = {LEVEL_END, level};
+  if (!ok || !write_ints(f, tail, 2) || fflush(f)) {
+    return BOX_ERROR;
+  }
+  return BOX_SUCCESS;
+}
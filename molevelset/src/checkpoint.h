@@ -0,0 +1,50 @@
+#ifndef checkpoint_h
+#define checkpoint_h
+
+#include <stdio.h>
+
+#include <set>
+#include <vector>
+
+#include "box.h"
+#include "molevelset.h"
+
+/* A checkpoint file records the levels built by compute_levelset so that
+ * an interrupted run can resume from the last completed level.
+ *
+ * The file starts with a header identifying the run (dimensions,
+ * parameters and a hash of the data), followed by one record per level,
+ * finest first.  Each record lists every box in the level with its split,
+ * risk and either its points (terminal boxes) or the splits of its
+ * children in the level below (other boxes).  A record ends with a
+ * trailer, so a record cut short by an interrupted write is ignored.
+ * Resuming reads every level back, the final tree needs them all, and
+ * the caller has already binned the points, so a resume saves the merges
+ * of the completed levels but not the binning or their memory.
+ * Values are written in the native byte order, checkpoints are only
+ * meant to be read back on the machine that wrote them.  Since version 4
+ * the levels leave out the chain boxes that compute_levelset skips (see
+ * chain.h), which a build that walks every chain can't resume from. */
+#define CHECKPOINT_MAGIC "MLSCKPT"
+#define CHECKPOINT_VERSION 4
+
+/* A child of a box read from a level record, resolved once the level
+ * below has been read. */
+typedef struct {
+  box *parent;          /* Box that the child belongs to. */
+  int side;             /* Which child, 0 or 1. */
+  box_split *split;     /* Split of the child. */
+} checkpoint_link;
+
+int read_checkpoint_level(FILE *f, int level, int d, box_collection *pc,
+			  std::set<BoxSplitKey> *keep,
+			  std::vector<checkpoint_link> *links);
+int link_checkpoint_children(std::vector<checkpoint_link> *links,
+			     box_collection *below);
+
+int read_checkpoint(const char *path, levelset_args *la, box_split_info *info,
+		    box_collection **pc, int max_depth, long *end);
+FILE *start_checkpoint(const char *path, levelset_args *la, long end);
+int write_checkpoint_level(FILE *f, int level, box_collection *pc);
+
+#endif
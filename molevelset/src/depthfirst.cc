@@ -0,0 +1,737 @@
+#include <stdlib.h>
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include "depthfirst.h"
+#include "simd.h"
+
+using std::vector;
+
+/* Number of locks the table of solved boxes is split over. */
+#define DEPTH_FIRST_SHARDS 64
+
+typedef std::pair<unsigned long long, unsigned long long> dfs_key;
+
+static unsigned long long hash_key(const dfs_key &key) {
+  unsigned long long h = key.first ^ (key.second * 0x9E3779B97F4A7C15ULL);
+  h ^= h >> 31;
+  h *= 0xBF58476D1CE4E5B9ULL;
+  return h ^ (h >> 29);
+}
+
+struct dfs_box {
+  dfs_key key;                  /* Splits of the box, then the number of
+				   splits in each dimension. */
+  int done;                     /* Set once the box is solved, guarded by
+				   the lock of its shard. */
+  std::atomic<int> pending;     /* Children still to be solved, plus one
+				   while they are being handed out. */
+  std::atomic<int> holds;       /* Parents that haven't let go of the
+				   box, see release_box. */
+  vector<dfs_box *> waiters;    /* Boxes waiting on this one, guarded by
+				   the lock of its shard. */
+  dfs_box **children;           /* Children, d x 2, NULL when empty or
+				   not needed. */
+  int n_points;                 /* Number of points in the box. */
+  double *sum;                  /* Sum of each response over the box. */
+  double *risk_cost;            /* Lowest risk + cost for each response. */
+  int *choice;                  /* Dimension split for each response, -1
+				   for a terminal box. */
+  char *refine;                 /* Can the box be split for each
+				   response. */
+};
+
+typedef struct {
+  dfs_box *node;           /* Box to solve. */
+  vector<int> *cells;      /* Finest boxes in the box, owned by the
+			      task. */
+} dfs_task;
+
+typedef struct {
+  std::mutex lock;
+  std::deque<dfs_task> tasks;
+} dfs_queue;
+
+/* An open addressing table of boxes, with linear probing. */
+typedef struct {
+  std::mutex lock;
+  vector<dfs_key> keys;    /* Key of each slot. */
+  vector<dfs_box *> boxes; /* Box in each slot, NULL for empty slots. */
+  size_t n_boxes;          /* Number of boxes in the table. */
+} dfs_shard;
+
+typedef struct {
+  double *y;                      /* Responses, n x m. */
+  int n;                          /* Number of points. */
+  int d;                          /* Number of dimensions. */
+  int m;                          /* Number of responses. */
+  int *kmax;                      /* Max number of splits in each
+				     dimension. */
+  int total;                      /* Sum of kmax. */
+  double *gamma;                  /* Threshold for each response. */
+  int prune;                      /* Skip provably terminal boxes. */
+  vector<levelset_args> la;       /* Args for each response. */
+  vector<int> offset;             /* Shift of the splits of each dimension
+				     in a key. */
+  vector<int> shape_shift;        /* Shift of the number of splits of each
+				     dimension in a key. */
+  vector<int> shape_width;        /* Bits for the number of splits of each
+				     dimension in a key. */
+  vector<int> points;             /* Points sorted by their finest box. */
+  vector<int> cell_start;         /* Start of each finest box in points,
+				     n_cells + 1 entries. */
+  vector<unsigned long long> cell_z;
+                                  /* Splits of each finest box, as in a
+				     key. */
+  vector<double> cell_sum;        /* Sum of each response over each finest
+				     box, n_cells x m. */
+  int pure_words;                 /* Words of cell_pure per finest box. */
+  vector<unsigned long long> cell_pure;
+                                  /* For pruning, bit 2c of a finest box
+				     is set if none of its responses c are
+				     above gamma[c], bit 2c + 1 if none are
+				     below, n_cells x pure_words. */
+  int n_threads;                  /* Number of workers. */
+  dfs_queue *queues;              /* Task deque of each worker. */
+  dfs_shard *shards;              /* Solved and pending boxes. */
+  dfs_box *root;                  /* The box with no splits. */
+  std::atomic<int> finished;      /* Set once the root is solved. */
+  std::atomic<long> n_queued;     /* Tasks in the deques. */
+  std::atomic<int> n_idle;        /* Workers waiting for a task. */
+  std::mutex idle_lock;           /* Guards the waits on work. */
+  std::condition_variable work;   /* Signalled when a task is queued or
+				     the root is solved. */
+} dfs_state;
+
+static dfs_shard *box_shard(dfs_state *s, const dfs_key &key) {
+  return &s->shards[(hash_key(key) >> 58) % DEPTH_FIRST_SHARDS];
+}
+
+static dfs_box **shard_slot(dfs_shard *shard, const dfs_key &key) {
+  /* Find the slot of a key in a table, the empty slot it would go in if
+   * it isn't there.  The table must have an empty slot. */
+  size_t mask = shard->boxes.size() - 1;
+  for (size_t i = hash_key(key) & mask; ; i = (i + 1) & mask) {
+    if (!shard->boxes[i] || shard->keys[i] == key) {
+      return &shard->boxes[i];
+    }
+  }
+}
+
+static void add_to_shard(dfs_shard *shard, dfs_box *node) {
+  /* Add a box that isn't in a table yet, growing the table to keep it at
+   * most half full. */
+  if (2 * (shard->n_boxes + 1) > shard->boxes.size()) {
+    vector<dfs_box *> boxes(shard->boxes.size() ?
+			    2 * shard->boxes.size() : 1024, NULL);
+    vector<dfs_key> keys(boxes.size());
+    boxes.swap(shard->boxes);
+    keys.swap(shard->keys);
+    shard->n_boxes = 0;
+    for (size_t i = 0; i < boxes.size(); i++) {
+      if (boxes[i]) {
+	add_to_shard(shard, boxes[i]);
+      }
+    }
+  }
+  dfs_box **slot = shard_slot(shard, node->key);
+  shard->keys[slot - &shard->boxes[0]] = node->key;
+  *slot = node;
+  shard->n_boxes++;
+}
+
+static void remove_from_shard(dfs_shard *shard, dfs_box *node) {
+  /* Take a box out of a table, shifting back the boxes after it that
+   * would no longer be found past the emptied slot. */
+  size_t mask = shard->boxes.size() - 1;
+  size_t i = shard_slot(shard, node->key) - &shard->boxes[0];
+  shard->boxes[i] = NULL;
+  for (size_t k = (i + 1) & mask; shard->boxes[k]; k = (k + 1) & mask) {
+    size_t home = hash_key(shard->keys[k]) & mask;
+    /* The box stays unless its home slot is cyclically outside (i, k]. */
+    if (i < k ? home > i && home <= k : home > i || home <= k) {
+      continue;
+    }
+    shard->boxes[i] = shard->boxes[k];
+    shard->keys[i] = shard->keys[k];
+    shard->boxes[k] = NULL;
+    i = k;
+  }
+  shard->n_boxes--;
+}
+
+static int key_nsplit(dfs_state *s, const dfs_key &key, int j) {
+  return (key.second >> s->shape_shift[j]) &
+    ((1ULL << s->shape_width[j]) - 1);
+}
+
+static void key_to_split(dfs_state *s, const dfs_key &key, box_split *split) {
+  /* Recover the split of a box from its key. */
+  for (int j = 0; j < s->d; j++) {
+    split->nsplit[j] = key_nsplit(s, key, j);
+    split->split[j] = split->nsplit[j] ?
+      (key.first >> s->offset[j]) & ((1ULL << split->nsplit[j]) - 1) : 0;
+  }
+}
+
+static dfs_box *new_dfs_box(dfs_state *s, const dfs_key &key) {
+  /* Make an unsolved box, its arrays share one allocation.  It is held
+   * once for each parent it has, one for each dimension it is split in,
+   * and the root once for the run. */
+  int d = s->d, m = s->m;
+  dfs_box *node = new dfs_box;
+  node->key = key;
+  node->done = 0;
+  node->pending = 0;
+  node->holds = 0;
+  for (int j = 0; j < d; j++) {
+    node->holds += key_nsplit(s, key, j) > 0;
+  }
+  if (!node->holds) {
+    node->holds = 1;
+  }
+  node->n_points = 0;
+  char *block = (char *)malloc(sizeof(dfs_box *) * 2 * d +
+			       sizeof(double) * 2 * m + sizeof(int) * m + m);
+  node->children = (dfs_box **)block;
+  node->sum = (double *)(node->children + 2 * d);
+  node->risk_cost = node->sum + m;
+  node->choice = (int *)(node->risk_cost + m);
+  node->refine = (char *)(node->choice + m);
+  for (int k = 0; k < 2 * d; k++) {
+    node->children[k] = NULL;
+  }
+  return node;
+}
+
+static void free_dfs_box(dfs_box *node) {
+  if (!node) {
+    return;
+  }
+  free(node->children);
+  delete node;
+}
+
+static void release_box(dfs_state *s, dfs_box *node) {
+  /* Let go of a box.  Once every parent has, no other box can reach it,
+   * so it is taken out of the table and freed, letting go of the
+   * children its choices kept.  A parent that is never refined never
+   * lets go, its children are freed at the end of the run. */
+  if (--node->holds) {
+    return;
+  }
+  {
+    dfs_shard *shard = box_shard(s, node->key);
+    std::lock_guard<std::mutex> guard(shard->lock);
+    remove_from_shard(shard, node);
+  }
+  for (int k = 0; k < 2 * s->d; k++) {
+    if (node->children[k]) {
+      release_box(s, node->children[k]);
+    }
+  }
+  free_dfs_box(node);
+}
+
+static void push_task(dfs_state *s, int worker, dfs_box *node,
+		      vector<int> *cells) {
+  dfs_task task = {node, cells};
+  {
+    std::lock_guard<std::mutex> guard(s->queues[worker].lock);
+    s->queues[worker].tasks.push_back(task);
+  }
+  /* A worker counts itself idle before it checks n_queued, so one of the
+   * two sees the other. */
+  s->n_queued++;
+  if (s->n_idle) {
+    std::lock_guard<std::mutex> guard(s->idle_lock);
+    s->work.notify_one();
+  }
+}
+
+static int take_task(dfs_state *s, int worker, dfs_task *task) {
+  /* Take the newest task of a worker, or steal the oldest of another.
+   * Returns 1 if a task was found. */
+  for (int k = 0; k < s->n_threads; k++) {
+    dfs_queue *q = &s->queues[(worker + k) % s->n_threads];
+    std::lock_guard<std::mutex> guard(q->lock);
+    if (q->tasks.empty()) {
+      continue;
+    }
+    if (!k) {
+      *task = q->tasks.back();
+      q->tasks.pop_back();
+    } else {
+      *task = q->tasks.front();
+      q->tasks.pop_front();
+    }
+    s->n_queued--;
+    return 1;
+  }
+  return 0;
+}
+
+static void choose_split(dfs_state *s, dfs_box *node);
+
+static void finish_box(dfs_state *s, dfs_box *node) {
+  /* Mark a box solved, and choose the split of every box that was only
+   * waiting on it. */
+  vector<dfs_box *> waiters;
+  {
+    std::lock_guard<std::mutex> guard(box_shard(s, node->key)->lock);
+    node->done = 1;
+    waiters.swap(node->waiters);
+  }
+  if (node == s->root) {
+    std::lock_guard<std::mutex> guard(s->idle_lock);
+    s->finished = 1;
+    s->work.notify_all();
+  }
+  for (size_t i = 0; i < waiters.size(); i++) {
+    if (!--waiters[i]->pending) {
+      choose_split(s, waiters[i]);
+    }
+  }
+}
+
+static int key_level(dfs_state *s, const dfs_key &key) {
+  /* Number of splits of a box, its level in the tree. */
+  int level = 0;
+  for (int j = 0; j < s->d; j++) {
+    level += key_nsplit(s, key, j);
+  }
+  return level;
+}
+
+static void set_terminal_cost(dfs_state *s, dfs_box *node) {
+  /* Find the cost of a box as a terminal box for each response, from its
+   * number of points and sums. */
+  int level = key_level(s, node->key);
+  for (int c = 0; c < s->m; c++) {
+    double risk = inset_risk_from_sum(node->n_points, node->sum[c],
+				      s->gamma[c], s->la[c].A);
+    node->risk_cost[c] = levelset_cost_from_risk(risk, level,
+						node->n_points,
+						&s->la[c]).risk_cost;
+    node->choice[c] = -1;
+  }
+}
+
+static void choose_split(dfs_state *s, dfs_box *node) {
+  /* Find the cost of a box as a terminal box, adding up the two halves
+   * along any dimension it was split in, then split it along whichever
+   * dimension has the lowest total risk + cost for its children, keeping
+   * it as a terminal box only if that is strictly worse than not
+   * splitting, as in solve_box_pyramid.  The children of the dimensions
+   * not chosen for any response are let go. */
+  int d = s->d, m = s->m;
+  for (int j = 0; j < d; j++) {
+    dfs_box **child = &node->children[j * 2];
+    if (!child[0] && !child[1]) {
+      continue;
+    }
+    node->n_points = 0;
+    for (int c = 0; c < m; c++) {
+      node->sum[c] = 0;
+    }
+    for (int k = 0; k < 2; k++) {
+      if (child[k]) {
+	node->n_points += child[k]->n_points;
+	for (int c = 0; c < m; c++) {
+	  node->sum[c] += child[k]->sum[c];
+	}
+      }
+    }
+    break;
+  }
+  set_terminal_cost(s, node);
+
+  for (int c = 0; c < m; c++) {
+    if (!node->refine[c]) {
+      continue;
+    }
+    for (int j = 0; j < d; j++) {
+      dfs_box **child = &node->children[j * 2];
+      if (!child[0] && !child[1]) {
+	continue;
+      }
+      double split_cost = (child[0] ? child[0]->risk_cost[c] : 0) +
+	(child[1] ? child[1]->risk_cost[c] : 0);
+      if (node->choice[c] < 0 ?
+	  !(node->risk_cost[c] < split_cost) :
+	  split_cost < node->risk_cost[c]) {
+	node->risk_cost[c] = split_cost;
+	node->choice[c] = j;
+      }
+    }
+  }
+
+  for (int j = 0; j < d; j++) {
+    int chosen = 0;
+    for (int c = 0; c < m; c++) {
+      chosen = chosen || node->choice[c] == j;
+    }
+    for (int k = 0; k < 2 && !chosen; k++) {
+      if (node->children[j * 2 + k]) {
+	release_box(s, node->children[j * 2 + k]);
+	node->children[j * 2 + k] = NULL;
+      }
+    }
+  }
+  finish_box(s, node);
+}
+
+static void solve_box(dfs_state *s, int worker, dfs_box *node,
+		      vector<int> *cells) {
+  /* Decide which responses a box can be refined for and hand out its
+   * children.  The box only adds up its finest boxes if it isn't refined
+   * at all, otherwise choose_split adds up its children.
+   *
+   * Args:
+   *   s: pointer to the state of the run.
+   *   worker: integer, the worker running the task.
+   *   node: pointer to the box to solve.
+   *   cells: pointer to the finest boxes in the box, freed here.
+   */
+  int d = s->d, m = s->m;
+  int n_cells = cells->size();
+  int level = key_level(s, node->key);
+
+  /* A box is pure for a response if every finest box in it is on the
+   * same side of gamma. */
+  vector<unsigned long long> pure;
+  if (s->prune && level < s->total) {
+    int w = s->pure_words;
+    pure.assign(s->cell_pure.begin() + (size_t)cells->at(0) * w,
+		s->cell_pure.begin() + (size_t)cells->at(0) * w + w);
+    for (int i = 1; i < n_cells; i++) {
+      const unsigned long long *cell_pure =
+	&s->cell_pure[(size_t)cells->at(i) * w];
+      for (int k = 0; k < w; k++) {
+	pure[k] &= cell_pure[k];
+      }
+    }
+  }
+  int any_refine = 0;
+  for (int c = 0; c < m; c++) {
+    node->refine[c] = level < s->total &&
+      !(pure.size() && ((pure[c / 32] >> (2 * (c % 32))) & 3));
+    any_refine = any_refine || node->refine[c];
+  }
+  if (!any_refine) {
+    node->n_points = 0;
+    for (int c = 0; c < m; c++) {
+      node->sum[c] = 0;
+    }
+    for (int i = 0; i < n_cells; i++) {
+      int k = cells->at(i);
+      node->n_points += s->cell_start[k + 1] - s->cell_start[k];
+      for (int c = 0; c < m; c++) {
+	node->sum[c] += s->cell_sum[(size_t)k * m + c];
+      }
+    }
+    set_terminal_cost(s, node);
+    delete cells;
+    finish_box(s, node);
+    return;
+  }
+
+  /* The guard keeps the box from being picked up before every child has
+   * been handed out. */
+  node->pending = 1;
+  vector<int> side[2];
+  for (int j = 0; j < d; j++) {
+    int nsplit = key_nsplit(s, node->key, j);
+    if (nsplit >= s->kmax[j]) {
+      continue;
+    }
+    int bit = s->offset[j] + nsplit;
+    side[0].clear();
+    side[1].clear();
+    for (int i = 0; i < n_cells; i++) {
+      int k = cells->at(i);
+      side[(s->cell_z[k] >> bit) & 1].push_back(k);
+    }
+    for (int k = 0; k < 2; k++) {
+      if (side[k].empty()) {
+	continue;
+      }
+      dfs_key key = node->key;
+      key.first |= (unsigned long long)k << bit;
+      key.second += 1ULL << s->shape_shift[j];
+
+      dfs_box *child;
+      int is_new = 0;
+      {
+	dfs_shard *shard = box_shard(s, key);
+	std::lock_guard<std::mutex> guard(shard->lock);
+	child = shard->boxes.empty() ? NULL : *shard_slot(shard, key);
+	if (!child) {
+	  child = new_dfs_box(s, key);
+	  add_to_shard(shard, child);
+	  is_new = 1;
+	}
+	if (!child->done) {
+	  child->waiters.push_back(node);
+	  node->pending++;
+	}
+      }
+      node->children[j * 2 + k] = child;
+      if (is_new) {
+	vector<int> *child_cells = new vector<int>;
+	child_cells->swap(side[k]);
+	push_task(s, worker, child, child_cells);
+      }
+    }
+  }
+  delete cells;
+  if (!--node->pending) {
+    choose_split(s, node);
+  }
+}
+
+static void depth_first_worker(dfs_state *s, int worker) {
+  /* Run tasks until the root is solved, sleeping while there are none to
+   * take. */
+  dfs_task task;
+  while (!s->finished) {
+    if (take_task(s, worker, &task)) {
+      solve_box(s, worker, task.node, task.cells);
+      continue;
+    }
+    std::unique_lock<std::mutex> guard(s->idle_lock);
+    s->n_idle++;
+    s->work.wait(guard, [s] { return s->n_queued > 0 || s->finished; });
+    s->n_idle--;
+  }
+}
+
+static void get_terminal_boxes(dfs_state *s, dfs_box *node,
+			       vector<int> *cells, int c,
+			       vector<box *> &terminal) {
+  /* Collect the terminal boxes of the optimal tree below a box.
+   *
+   * Args:
+   *   s: pointer to the state of the run.
+   *   node: pointer to the solved box.
+   *   cells: pointer to the finest boxes in the box.
+   *   c: integer, response column.
+   *   terminal: vector of terminal boxes, added to.
+   */
+  int j = node->choice[c];
+  if (j >= 0) {
+    int bit = s->offset[j] + key_nsplit(s, node->key, j);
+    vector<int> side[2];
+    for (size_t i = 0; i < cells->size(); i++) {
+      int k = cells->at(i);
+      side[(s->cell_z[k] >> bit) & 1].push_back(k);
+    }
+    for (int k = 0; k < 2; k++) {
+      if (node->children[j * 2 + k]) {
+	get_terminal_boxes(s, node->children[j * 2 + k], &side[k], c,
+			   terminal);
+      }
+    }
+    return;
+  }
+
+  box_split *split = new_box_split(s->d);
+  key_to_split(s, node->key, split);
+  box *p = new_box(split);
+  free_box_split(split);
+  double sum = 0;
+  for (size_t i = 0; i < cells->size(); i++) {
+    int k = cells->at(i);
+    for (int t = s->cell_start[k]; t < s->cell_start[k + 1]; t++) {
+      add_point(p, s->points[t]);
+    }
+    sum += s->cell_sum[k * s->m + c];
+  }
+  /* The same order binning would have found them in. */
+  std::sort(p->points->begin(), p->points->end());
+  int n_points = p->points->size();
+  double risk = inset_risk_from_sum(n_points, sum, s->gamma[c], s->la[c].A);
+  p->risk = levelset_cost_from_risk(risk, split_tree_level(p->split),
+				    n_points, &s->la[c]);
+  terminal.push_back(p);
+}
+
+void depth_first_levelsets(double *x, double *y, int n, int d, int m,
+			   int *kmax, double *gamma, double delta, double rho,
+			   int prune, int n_threads,
+			   levelset_estimate *estimates) {
+  /* Estimate the levelset of every response with the depth first engine.
+   * Nothing on the worker threads calls R.
+   *
+   * Args:
+   *   x: pointer to points, column centric array, n x d.
+   *   y: pointer to responses, column centric array, n x m.
+   *   n: number of points.
+   *   d: dimension.
+   *   m: number of response columns.
+   *   kmax: array of d integers, max number of splits in each dimension,
+   *     adding up to at most MAX_DEPTH_FIRST_SPLITS.  The estimates point
+   *     to it.
+   *   gamma: array of m thresholds, one per response.
+   *   delta: double, complexity factor.
+   *   rho: double, cost penalty.
+   *   prune: integer, if non-zero, don't refine boxes that are provably
+   *     terminal.  Has no effect unless rho > 0.
+   *   n_threads: integer, number of worker threads, 0 for one per
+   *     hardware thread.
+   *   estimates: array of m estimates, one per response, populated.
+   */
+  dfs_state s;
+  s.y      = y;
+  s.n      = n;
+  s.d      = d;
+  s.m      = m;
+  s.kmax   = kmax;
+  s.total  = total_splits(d, kmax);
+  s.gamma  = gamma;
+  s.prune  = prune && rho > 0;
+  s.la.resize(m);
+  for (int c = 0; c < m; c++) {
+    /* As in compute_levelset, A = 1 + max_i |Y_i| bounds the responses. */
+    levelset_args *la = &s.la[c];
+    la->d     = d;
+    la->kmax  = kmax;
+    la->n     = n;
+    la->x     = x;
+    la->y     = y + c * n;
+    la->A     = max_vector_fabs(y + c * n, n) + 1.0;
+    la->gamma = gamma[c];
+    la->delta = delta;
+    la->rho   = rho;
+  }
+  if (!n) {
+    for (int c = 0; c < m; c++) {
+      estimates[c] = empty_levelset_estimate(s.la[c]);
+    }
+    return;
+  }
+
+  /* Key layout: the splits of each dimension side by side, and the number
+   * of splits of each dimension in as few bits as hold kmax. */
+  s.offset.resize(d);
+  s.shape_shift.resize(d);
+  s.shape_width.resize(d);
+  for (int j = 0, offset = 0, shift = 0; j < d; j++) {
+    s.offset[j] = offset;
+    s.shape_shift[j] = shift;
+    s.shape_width[j] = 0;
+    while (kmax[j] >> s.shape_width[j]) {
+      s.shape_width[j]++;
+    }
+    offset += kmax[j];
+    shift += s.shape_width[j];
+  }
+
+  /* Sort the points by their finest box, each run of equal splits is one
+   * finest box and is aggregated once. */
+  vector<std::pair<unsigned long long, int> > order(n);
+  vector<unsigned long long> splits((size_t)BIN_BLOCK * d);
+  for (int i = 0; i < n; i++) {
+    if (i % BIN_BLOCK == 0) {
+      bin_points(x, n, d, kmax, i, n - i < BIN_BLOCK ? n - i : BIN_BLOCK,
+		 &splits[0]);
+    }
+    order[i].first = 0;
+    for (int j = 0; j < d; j++) {
+      order[i].first |= splits[(size_t)(i % BIN_BLOCK) * d + j] <<
+	s.offset[j];
+    }
+    order[i].second = i;
+  }
+  std::sort(order.begin(), order.end());
+  s.pure_words = s.prune ? (2 * m + 63) / 64 : 0;
+  s.points.resize(n);
+  for (int i = 0; i < n; i++) {
+    s.points[i] = order[i].second;
+    if (!i || order[i].first != order[i - 1].first) {
+      s.cell_start.push_back(i);
+      s.cell_z.push_back(order[i].first);
+      s.cell_sum.resize(s.cell_sum.size() + m, 0.0);
+      s.cell_pure.resize(s.cell_pure.size() + s.pure_words, ~0ULL);
+    }
+    size_t k = s.cell_z.size() - 1;
+    for (int c = 0; c < m; c++) {
+      double yc = y[order[i].second + c * n];
+      s.cell_sum[k * m + c] += yc;
+      if (s.prune) {
+	unsigned long long *word = &s.cell_pure[k * s.pure_words + c / 32];
+	if (yc > gamma[c]) {
+	  *word &= ~(1ULL << (2 * (c % 32)));
+	}
+	if (yc < gamma[c]) {
+	  *word &= ~(2ULL << (2 * (c % 32)));
+	}
+      }
+    }
+  }
+  s.cell_start.push_back(n);
+  int n_cells = s.cell_z.size();
+
+  if (n_threads <= 0) {
+    n_threads = std::thread::hardware_concurrency();
+  }
+  if (n_threads < 1) {
+    n_threads = 1;
+  }
+  s.n_threads = n_threads;
+  s.queues    = new dfs_queue[n_threads];
+  s.shards    = new dfs_shard[DEPTH_FIRST_SHARDS];
+  s.finished  = 0;
+  s.n_queued  = 0;
+  s.n_idle    = 0;
+  for (int k = 0; k < DEPTH_FIRST_SHARDS; k++) {
+    s.shards[k].n_boxes = 0;
+  }
+
+  dfs_key root_key(0, 0);
+  s.root = new_dfs_box(&s, root_key);
+  add_to_shard(box_shard(&s, root_key), s.root);
+  vector<int> *cells = new vector<int>(n_cells);
+  for (int k = 0; k < n_cells; k++) {
+    cells->at(k) = k;
+  }
+  push_task(&s, 0, s.root, cells);
+
+  vector<std::thread> workers;
+  for (int t = 1; t < n_threads; t++) {
+    workers.push_back(std::thread(depth_first_worker, &s, t));
+  }
+  depth_first_worker(&s, 0);
+  for (size_t t = 0; t < workers.size(); t++) {
+    workers[t].join();
+  }
+
+  vector<int> all(n_cells);
+  for (int k = 0; k < n_cells; k++) {
+    all[k] = k;
+  }
+  for (int c = 0; c < m; c++) {
+    vector<box *> terminal;
+    get_terminal_boxes(&s, s.root, &all, c, terminal);
+    estimates[c] = terminal_levelset_estimate(s.la[c], s.root->risk_cost[c],
+					      &terminal[0], terminal.size());
+  }
+
+  /* Freeing the root frees every box its tree kept, only boxes with a
+   * parent that was never refined are left in the table. */
+  release_box(&s, s.root);
+  for (int k = 0; k < DEPTH_FIRST_SHARDS; k++) {
+    for (size_t i = 0; i < s.shards[k].boxes.size(); i++) {
+      free_dfs_box(s.shards[k].boxes[i]);
+    }
+  }
+  delete[] s.shards;
+  delete[] s.queues;
+}
@@ -0,0 +1,41 @@
+#ifndef depthfirst_h
+#define depthfirst_h
+
+#include "molevelset.h"
+
+/* The depth first engine solves the same problem as compute_levelset and
+ * solve_box_pyramid, top down instead of level by level.  Solving a box
+ * means handing its finest boxes down to its children, the two halves
+ * along each dimension it can still be split in, solving each of them,
+ * and keeping the best split.  The number of points and the sums of a
+ * box are added up from two of its children, as for its split costs, so
+ * only boxes that aren't split add up their finest boxes.  A box can be
+ * reached through many parents, so each one is solved once and
+ * remembered, keyed on its splits.
+ *
+ * Boxes are solved as tasks by a pool of worker threads.  Each worker
+ * keeps a deque of tasks, taking its newest task first so that it works
+ * down into one region of the space, and an idle worker steals the oldest
+ * task of another, a box near the top with a large region under it.  A
+ * box doesn't wait for its children: the last of them to finish picks up
+ * the box and chooses its split, so no worker ever blocks on another.  A
+ * worker with nothing to take sleeps until a task is queued.
+ *
+ * A box holds its finest boxes only until its children have been handed
+ * out, and is left with its sums, costs and choices.  It is freed once
+ * every parent it has, one per dimension it is split in, has chosen its
+ * split, unless one of them chose it.  Then it lives as long as that
+ * parent, so only the boxes still being solved and the trees chosen
+ * under them are held.  Boxes that are provably terminal are not refined
+ * when pruning, as for solve_box_pyramid, and the children they would
+ * have shared with other parents are kept to the end of the run.  The
+ * keys hold every split in 64 bits, so kmax can add up to at most
+ * MAX_DEPTH_FIRST_SPLITS. */
+#define MAX_DEPTH_FIRST_SPLITS 64
+
+void depth_first_levelsets(double *x, double *y, int n, int d, int m,
+			   int *kmax, double *gamma, double delta, double rho,
+			   int prune, int n_threads,
+			   levelset_estimate *estimates);
+
+#endif
@@ -1,3 +1,4 @@
+#include <stdio.h>
 #include <stdlib.h>
 #include <math.h>
 
@@ -6,6 +7,9 @@
 
 #include "box.h"
 #include "molevelset.h"
+#include "chain.h"
+#include "checkpoint.h"
+#include "spill.h"
 
 using std::vector;
 
@@ -37,6 +41,37 @@ double max_vector_fabs(double *y, int n) {
   return m;
 }
 
+static double max_response_fabs(levelset_args *la) {
+  /* max_vector_fabs of the responses of la, y or yf. */
+  if (la->y) {
+    return max_vector_fabs(la->y, la->n);
+  }
+  if (la->n <= 0) {
+    return -1;
+  }
+  double m = fabs(levelset_response(la, 0));
+  for (int i = 1; i < la->n; i++) {
+    double tmp = fabs(levelset_response(la, i));
+    if (tmp > m)
+      m = tmp;
+  }
+  return m;
+}
+
+box_collection *levelset_points_to_boxes(levelset_args *la) {
+  /* Bin the points of la, binning xf without widening it first when x is
+   * NULL, and going straight from cells to splits when both are. */
+  if (la->x) {
+    return points_to_boxes(la->x, la->n, la->d, la->kmax);
+  }
+  if (la->xf) {
+    return points_to_boxes_float(la->xf, la->offset, la->scale, la->n,
+				 la->d, la->kmax);
+  }
+  return points_to_boxes_cells(la->cells, la->cell_bytes, la->n, la->d,
+			       la->kmax);
+}
+
 int find_sibling(box *pb, box_split *ps, int dim) {
   /* Find the splits representing a sibling box.
    *
@@ -61,7 +96,7 @@ int find_sibling(box *pb, box_split *ps, int dim) {
    * split position with 1.
    */
   if (ps->nsplit[dim]) {
-    ps->split[dim] ^= 1 << ps->nsplit[dim];
+    ps->split[dim] ^= 1ULL << ps->nsplit[dim];
   }
   
   return BOX_SUCCESS;
@@ -171,9 +206,27 @@ box_risk levelset_cost(box *p, levelset_args *la) {
    * Returns:
    *   populated box_cost struct.
    */
+  return levelset_cost_from_risk(inset_risk(p, la), split_tree_level(p->split),
+				 p->points->size(), la);
+}
+
+box_risk levelset_cost_from_risk(double risk, int tree_level, int n_points,
+				 levelset_args *la) {
+  /* Calculate the inset cost for a box from its inset risk.
+   *
+   * Args:
+   *   risk: double, inset risk of the box.
+   *   tree_level: integer, total number of splits defining the box.
+   *   n_points: integer, number of points in the box.
+   *   la: pointer to levelset_args, contains parameter values for the leveset
+   *     algorithm.
+   * Returns:
+   *   populated box_cost struct.
+   */
   box_risk ret;
-  ret.inset_risk = inset_risk(p, la);
-  ret.cost = la->rho * complexity_penalty(p, la->n, la->delta);
+  ret.inset_risk = risk;
+  ret.cost = la->rho * level_complexity_penalty(tree_level, la->d, n_points,
+						la->n, la->delta);
   ret.inset = ret.inset_risk < 0 ? 1 : 0;
   ret.risk_cost = (ret.inset ? 1 : -1) * ret.inset_risk + ret.cost;
   ret.calculated = 1;
@@ -198,12 +251,41 @@ double inset_risk(box *p, levelset_args *la) {
 
   double risk = 0.0;
   for (int i = 0; i < n_points; i++) {
-    risk += la->gamma - la->y[points->at(i)];
+    risk += la->gamma - levelset_response(la, points->at(i));
   }
   
   return risk / (2 * la->A);
 }
 
+double inset_risk_from_sum(int n_points, double sum_y, double gamma, 
+			   double A) {
+  /* Calculate the inset risk for a box from the sum of its responses.
+   *
+   * Args:
+   *   n_points: integer, number of points in the box.
+   *   sum_y: double, sum of the responses of the points in the box.
+   *   gamma: double, threshold for the levelset.
+   *   A: double, bound on the absolute value of the responses.
+   * Returns:
+   *   double, risk of the box if it is in the set.
+   */
+  if (!n_points) {
+    return 0.0;
+  }
+  return (n_points * gamma - sum_y) / (2 * A);
+}
+
+int split_tree_level(box_split *split) {
+  /* The level of the tree is defined as the sum of the number of splits in
+   * each dimension. 
+   */
+  int tree_level = 0; 
+  for (int j = 0; j < split->d; j++) {
+    tree_level += split->nsplit[j];
+  }
+  return tree_level;
+}
+
 double complexity_penalty(box *p, int n, double delta) {
   /* Compute the complexity penalty for a box.
    *
@@ -214,28 +296,45 @@ double complexity_penalty(box *p, int n, double delta) {
    * Returns:
    *   double, complexity penalty for this box.
    */
-  /* The level of the tree is defined as the sum of the number of splits in
-   * each dimension. 
+  return level_complexity_penalty(split_tree_level(p->split), p->split->d,
+				  p->points->size(), n, delta);
+}
+
+double level_complexity_penalty(int tree_level, int d, int n_points, int n,
+				double delta) {
+  /* Compute the complexity penalty for a box from its level in the tree.
+   *
+   * Args:
+   *   tree_level: integer, total number of splits defining the box.
+   *   d: integer, number of dimensions.
+   *   n_points: integer, number of points in the box.
+   *   n: integer, total number of points.
+   *   delta: double, complexity factor.
+   * Returns:
+   *   double, complexity penalty for this box.
    */
-  int tree_level = 0; 
-  for (int j = 0; j < p->split->d; j++) {
-    tree_level += p->split->nsplit[j];
-  }
-  double L = tree_level * (log2(p->split->d) + 2) + 1;
+  double L = tree_level * (log2(d) + 2) + 1;
 
-  double phat = ((double) p->points->size()) / n;
+  double phat = ((double) n_points) / n;
   double pl = (L * log(2) + log(1 / delta)) / n;
   pl = 4 * (pl > phat ? pl : phat);
   
   return sqrt((8 * (log(2 / delta) + L * log(2)) * pl) / n);
 }
 
-box_collection *minimax_step(box_collection *src, levelset_args *la) {
+box_collection *minimax_step(box_collection *src, levelset_args *la,
+			     chain_index *chains,
+			     levelset_progress *progress) {
   /* Perform one step of the algorithm.
    *
    * Args:
    *   src: pointer to box collection.
    *   la: pointer to levelset_args, parameters for the algorithm.
+   *   chains: pointer to chain_index, the chain boxes are skipped and left
+   *     to add_chain_heads.  May be NULL, to build every box.
+   *   progress: pointer to levelset_progress, counts the boxes processed
+   *     and stops the step early when progress->cancel is set.  May be
+   *     NULL.
    * Returns:
    *   pointer to new box_collection, contains boxes found by collapsing this
    *   level of the box_collection.
@@ -254,6 +353,12 @@ box_collection *minimax_step(box_collection *src, levelset_args *la) {
   }
   
   for (int i = 0; i < collection_size; i++) {
+    if (progress) {
+      progress->boxes++;
+      if (progress->cancel) {
+	break;
+      }
+    }
     box * cur = arr[i];
     for (int dim = 0; dim < cur->split->d; dim++) {
       /* Skip if this split has already been checked by a sibling box. */
@@ -270,6 +375,9 @@ box_collection *minimax_step(box_collection *src, levelset_args *la) {
       box *sib = find_box_sibling(src, cur->split, dim);
       if (sib != NULL) {
 	sib->checked[dim] = 1;
+      } else if (chains && is_chain_box(chains, cur)) {
+	/* The parent holds the same single cell, a chain box. */
+	continue;
       }
       box *new_parent = combine_boxes(cur, sib, dim, la, src->info);
       
@@ -307,35 +415,256 @@ levelset_estimate compute_levelset(box_collection *pinitial, levelset_args la) {
    * Returns:
    *   levelset_estimate struct.
    */
+  levelset_control control;
+  init_levelset_control(&control);
+  return compute_levelset_control(pinitial, la, &control);
+}
+
+void init_levelset_control(levelset_control *control) {
+  /* Set the default options: no checkpoint and no memory budget. */
+  control->checkpoint_path = NULL;
+  control->memory_budget   = 0;
+  control->scratch_path    = NULL;
+  control->progress        = NULL;
+  control->warn            = NULL;
+  control->warn_data       = NULL;
+  control->status          = LEVELSET_DONE;
+}
+
+levelset_estimate empty_levelset_estimate(levelset_args la) {
+  /* Make a levelset estimate with no boxes.
+   *
+   * Args:
+   *   la: levelset args used to compute the levelset estimate.
+   * Returns:
+   *   levelset_estimate struct, with empty (NULL terminated) box arrays.
+   */
+  levelset_estimate le;
+  le.total_cost = 0;
+  le.la = la;
+  le.num_inset = 0;
+  le.num_non_inset = 0;
+  le.inset_boxes = (box **)malloc(sizeof(box *));
+  le.non_inset_boxes = (box **)malloc(sizeof(box *));
+  le.inset_boxes[0] = NULL;
+  le.non_inset_boxes[0] = NULL;
+  return le;
+}
+
+levelset_estimate terminal_levelset_estimate(levelset_args la,
+					     double total_cost,
+					     box **terminal, int n_terminal) {
+  /* Make a levelset estimate from the terminal boxes of a tree.
+   *
+   * Args:
+   *   la: levelset args used to compute the levelset estimate.
+   *   total_cost: double, total cost of the tree.
+   *   terminal: array of n_terminal boxes with their risk calculated, the
+   *     estimate takes them over.
+   *   n_terminal: integer, number of terminal boxes.
+   * Returns:
+   *   levelset_estimate struct.
+   */
+  levelset_estimate le;
+  le.total_cost = total_cost;
+  le.la = la;
+  le.num_inset = 0;
+  le.num_non_inset = 0;
+  for (int i = 0; i < n_terminal; i++) {
+    if (terminal[i]->risk.inset)
+      le.num_inset++;
+    else
+      le.num_non_inset++;
+  }
+
+  le.inset_boxes = (box **)malloc(sizeof(box *) * (le.num_inset + 1));
+  le.non_inset_boxes = (box **)malloc(sizeof(box *) * (le.num_non_inset + 1));
+  int i_inset = 0;
+  int i_non_inset = 0;
+  for (int i = 0; i < n_terminal; i++) {
+    if (terminal[i]->risk.inset)
+      le.inset_boxes[i_inset++] = terminal[i];
+    else
+      le.non_inset_boxes[i_non_inset++] = terminal[i];
+  }
+  le.inset_boxes[i_inset] = NULL;
+  le.non_inset_boxes[i_non_inset] = NULL;
+  return le;
+}
+
+void free_levelset_estimate(levelset_estimate *le) {
+  /* Free the boxes of a levelset estimate.
+   *
+   * Args:
+   *   le: pointer to the levelset estimate.
+   */
+  for (int i = 0; i < le->num_inset; i++) {
+    /* By definition, these boxes do not have children. */
+    free_box_but_not_children(le->inset_boxes[i]);
+  }
+  free(le->inset_boxes);
+  
+  for (int i = 0; i < le->num_non_inset; i++) {
+    /* By definition, these boxes do not have children. */
+    free_box_but_not_children(le->non_inset_boxes[i]);
+  }
+  free(le->non_inset_boxes);
+  le->inset_boxes = NULL;
+  le->non_inset_boxes = NULL;
+  le->num_inset = 0;
+  le->num_non_inset = 0;
+}
+
+static void levelset_warning(levelset_control *control, const char *format,
+			     const char *arg) {
+  /* Report a warning through control->warn, or to R if it isn't set. */
+  char message[1024];
+  snprintf(message, sizeof(message), format, arg);
+  if (control->warn) {
+    control->warn(message, control->warn_data);
+  } else {
+    warning("%s", message);
+  }
+}
+
+levelset_estimate compute_levelset_control(box_collection *pinitial,
+					   levelset_args la,
+					   levelset_control *control) {
+  /* Compute the levelset for the boxes contained in *pinitial.
+   *
+   * Args:
+   *   pinitial: pointer to box collection.  The collection and the 
+   *     contained boxes will be freed.
+   *   la: levelset_args, the parameter values for the levelset algorithm.
+   *   control: pointer to levelset_control, options for this run.  If
+   *     control->checkpoint_path is set, each level is recorded in the
+   *     checkpoint file as it is completed, and if the file holds levels
+   *     from an earlier run with the same data and parameters, the run
+   *     resumes after the last of them.  A resume still takes the binned
+   *     pinitial, which it frees unused, and loads every completed level,
+   *     so it only saves their merges.  If control->memory_budget is set,
+   *     finished levels are spilled to a scratch file to stay within it.
+   *     control->status is set when the run ends.  This function does not
+   *     call R unless control->warn is NULL.
+   * Returns:
+   *   levelset_estimate struct.
+   */
+  const char *checkpoint_path = control->checkpoint_path;
+  levelset_progress *progress = control->progress;
+  control->status = LEVELSET_DONE;
+
   /* Note that la.A serves the role of bounding Y in he interval [-A, A].
    * This bound is still true if we set A = 1 + max_i |Y_i|, and we avoid
    * division by 0 errors. */
-  la.A = max_vector_fabs(la.y, la.n) + 1.0;
+  la.A = max_response_fabs(&la) + 1.0;
 
-  /* Maximum depth of the tree, up to kmax splits in each of the d
-     dimensions, plus 1 for no splits. */
-  int max_depth = la.d * la.kmax + 1;
+  /* Maximum depth of the tree, up to kmax[j] splits in dimension j, plus
+     1 for no splits. */
+  int max_depth = total_splits(la.d, la.kmax) + 1;
 
   box_collection *pc[max_depth];
-  pc[0] = pinitial;
+  for (int i = 0; i < max_depth; i++) 
+    pc[i] = NULL;
+  int n_levels = 0;
+  long checkpoint_end = 0;
+  if (checkpoint_path) {
+    n_levels = read_checkpoint(checkpoint_path, &la, pinitial->info, pc,
+			       max_depth, &checkpoint_end);
+  }
 
-  /* Calculate all of the costs for the initial boxes. */
-  box **boxes = list_boxes(pc[0]);
-  int boxPos = 0;
-  while (boxes[boxPos]) {
-    boxes[boxPos]->risk = levelset_cost(boxes[boxPos], &la);
-    boxPos++;
+  if (n_levels) {
+    free_box_collection(pinitial);
+  } else {
+    pc[0] = pinitial;
+
+    /* Calculate all of the costs for the initial boxes. */
+    box **boxes = list_boxes(pc[0]);
+    int boxPos = 0;
+    while (boxes[boxPos]) {
+      boxes[boxPos]->risk = levelset_cost(boxes[boxPos], &la);
+      boxPos++;
+    }
+    free(boxes);
+  }
+  if (progress) {
+    progress->n_levels = max_depth - 1;
+    progress->level = n_levels ? n_levels - 1 : 0;
+  }
+
+  /* Chains of single cell boxes are skipped, see chain.h.  The index
+   * holds a copy of every cell's points for the whole run, so with a
+   * memory budget every box is built instead. */
+  chain_index *chains = control->memory_budget > 0 ? NULL :
+    new_chain_index(pc[0], &la);
+
+  FILE *checkpoint = NULL;
+  if (checkpoint_path) {
+    checkpoint = start_checkpoint(checkpoint_path, &la, checkpoint_end);
+    if (!checkpoint) {
+      levelset_warning(control, "unable to write checkpoint file %s.",
+		       checkpoint_path);
+    }
+  }
+  if (checkpoint && !n_levels &&
+      write_checkpoint_level(checkpoint, 0, pc[0]) != BOX_SUCCESS) {
+    levelset_warning(control, "unable to write checkpoint file %s.",
+		     checkpoint_path);
+    fclose(checkpoint);
+    checkpoint = NULL;
   }
-  free(boxes);
   
+  level_spill *spill = NULL;
+  if (control->memory_budget > 0) {
+    spill = new_level_spill(control->memory_budget, control->scratch_path);
+  }
+  for (int i = 0; spill && i < (n_levels ? n_levels : 1); i++) {
+    if (spill_levels(spill, pc, i) != BOX_SUCCESS) {
+      levelset_warning(control, "%s", "unable to write to the scratch file, "
+		       "memory budget exceeded.");
+    }
+  }
+
   /* Collapse levels, one at a time, bottom (most splits) to top (no
      splits). */
-  for (int i = 1; i < max_depth; i++) {
-    pc[i] = minimax_step(pc[i - 1], &la);
+  for (int i = n_levels ? n_levels : 1; i < max_depth; i++) {
+    pc[i] = minimax_step(pc[i - 1], &la, chains, progress);
+    if (progress && progress->cancel) {
+      control->status = LEVELSET_CANCELLED;
+      break;
+    }
+    if (chains) {
+      add_chain_heads(chains, pc[i], i, &la);
+    }
+    if (checkpoint &&
+	write_checkpoint_level(checkpoint, i, pc[i]) != BOX_SUCCESS) {
+      levelset_warning(control, "unable to write checkpoint file %s.",
+		       checkpoint_path);
+      fclose(checkpoint);
+      checkpoint = NULL;
+    }
+    if (spill && spill_levels(spill, pc, i) != BOX_SUCCESS) {
+      levelset_warning(control, "%s", "unable to write to the scratch file, "
+		       "memory budget exceeded.");
+    }
+    if (progress) {
+      progress->level = i;
+    }
+  }
+  free_chain_index(chains);
+  if (checkpoint) {
+    fclose(checkpoint);
+  }
+  if (spill) {
+    if (control->status == LEVELSET_DONE &&
+	restore_levels(spill, pc, max_depth) != BOX_SUCCESS) {
+      control->status = LEVELSET_FAILED;
+    }
+    free_level_spill(spill);
   }
   
-  levelset_estimate le  = initialize_levelset_estimate(get_first_box(pc[max_depth - 1]),
-						       la);
+  levelset_estimate le = control->status == LEVELSET_DONE ?
+    initialize_levelset_estimate(get_first_box(pc[max_depth - 1]), la) :
+    empty_levelset_estimate(la);
   
   /* Cleanup.  Because we've copied the terminal nodes from the final tree
    * into an array, cleanup is very simple.  Each node still in memory is
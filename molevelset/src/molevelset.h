@@ -1,14 +1,26 @@
 #ifndef MOLEVELSET_H
 #define MOLEVELSET_H
 
+#include <atomic>
+
 #include "box.h"
 
 typedef struct {
   int d;        /* Dimension of X points. */
-  int kmax;     /* Max number of splits in a single dimension. */
+  int *kmax;    /* Max number of splits in each of the d dimensions. */
   int n;        /* Number of points. */
   double *x;    /* X points, locations. */
   double *y;    /* Response value of points. */
+  const float *xf;      /* X points in single precision, when x is NULL.
+			   They are in their original coordinates. */
+  const float *yf;      /* Responses in single precision, when y is
+			   NULL. */
+  const double *offset; /* With xf, point j of dimension i is at */
+  const double *scale;  /* (xf[j] - offset[i]) / scale[i] in the unit
+			   cube. */
+  const void *cells;    /* Cell coordinates of the points, when x and xf
+			   are NULL, see points_to_boxes_cells. */
+  int cell_bytes;       /* Size of a cell coordinate, 1, 2 or 4. */
   double A;     /* Maximum absolute value of points in y. */
   double gamma; /* Threshold for the levelset. */
   double delta; /* Probability bound for the levelset calculation. */
@@ -27,6 +39,15 @@ typedef struct {
 /* Compute the max value in a vector. */
 double max_vector_fabs(double *y, int n);
 
+/* Response i of la, y or yf, always summed in double. */
+inline double levelset_response(const levelset_args *la, int i) {
+  return la->y ? la->y[i] : (double)la->yf[i];
+}
+
+/* The finest boxes of the points of la, x, xf or cells, see
+ * points_to_boxes. */
+box_collection *levelset_points_to_boxes(levelset_args *la);
+
 /* levelset_cost calculates the box_cost for the given box.  This box_cost
  * is based on a complexity penalty (a function of delta, the number of
  * points and the splits representing this box), and the risk of the box (a
@@ -35,6 +56,16 @@ double max_vector_fabs(double *y, int n);
  */
 box_risk levelset_cost(box *, levelset_args *);
 
+/* The pieces of levelset_cost, for callers that keep aggregates (the
+ * number of points and the sum of their responses) instead of points. */
+box_risk levelset_cost_from_risk(double risk, int tree_level, int n_points,
+				 levelset_args *);
+double inset_risk_from_sum(int n_points, double sum_y, double gamma,
+			   double A);
+double level_complexity_penalty(int tree_level, int d, int n_points, int n,
+				double delta);
+int split_tree_level(box_split *);
+
 /* Computes the levelset for a box collection.  
  *
  * Args:
@@ -44,4 +75,53 @@ box_risk levelset_cost(box *, levelset_args *);
  *   A populated levelset_estimate struct.
  */
 levelset_estimate compute_levelset(box_collection *pinitial, levelset_args);
+
+/* Progress of a run of compute_levelset_control.  The run may be on
+ * another thread, so the counters are atomic. */
+typedef struct {
+  std::atomic<int> level;   /* Number of levels collapsed so far. */
+  std::atomic<int> n_levels;/* Number of levels to collapse, the sum of
+			       kmax. */
+  std::atomic<long> boxes;  /* Number of boxes processed so far. */
+  std::atomic<int> cancel;  /* Set to stop the run early. */
+} levelset_progress;
+
+/* Called with the text of a warning when a run has one. */
+typedef void (*levelset_warning_fn)(const char *message, void *data);
+
+#define LEVELSET_DONE      0
+#define LEVELSET_CANCELLED 1
+#define LEVELSET_FAILED    2
+
+/* Options for a single run of compute_levelset_control. */
+typedef struct {
+  const char *checkpoint_path; /* Checkpoint file to record each completed
+				  level in and to resume from, or NULL.  See
+				  checkpoint.h. */
+  double memory_budget;        /* Memory budget for the levels in bytes, 0
+				  for no limit.  See spill.h. */
+  const char *scratch_path;    /* Scratch file for levels spilled to disk,
+				  or NULL for a temporary file. */
+  levelset_progress *progress; /* Progress of the run, or NULL. */
+  levelset_warning_fn warn;    /* Called for warnings, NULL to pass them
+				  straight to R.  Runs off the main thread
+				  must set this, R can't be called there. */
+  void *warn_data;             /* Passed through to warn. */
+  int status;                  /* Set by the run: LEVELSET_DONE,
+				  LEVELSET_CANCELLED, or LEVELSET_FAILED when
+				  spilled levels could not be read back.  The
+				  estimate is empty unless LEVELSET_DONE. */
+} levelset_control;
+
+void init_levelset_control(levelset_control *);
+
+/* As compute_levelset, with the options in *control. */
+levelset_estimate compute_levelset_control(box_collection *pinitial,
+					   levelset_args,
+					   levelset_control *control);
+
+levelset_estimate empty_levelset_estimate(levelset_args);
+levelset_estimate terminal_levelset_estimate(levelset_args, double total_cost,
+					     box **terminal, int n_terminal);
+void free_levelset_estimate(levelset_estimate *);
 #endif
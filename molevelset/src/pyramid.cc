@@ -0,0 +1,827 @@
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#include <algorithm>
+#include <utility>
+
+#include <R.h>
+
+#include "pyramid.h"
+#include "simd.h"
+
+using std::vector;
+
+static bool morton_key_less(const morton_key &a, const morton_key &b) {
+  return a.z < b.z || (a.z == b.z && a.shape < b.shape);
+}
+
+static void init_pyramid_level(pyramid_level *level) {
+  level->n_boxes  = 0;
+  level->nsplit   = new vector<int>;
+  level->split    = new vector<unsigned long long>;
+  level->n_points = new vector<int>;
+  level->sum_y    = new vector<double>;
+  level->min_y    = new vector<double>;
+  level->max_y    = new vector<double>;
+  level->children = new vector<int>;
+}
+
+static void free_pyramid_level(pyramid_level *level) {
+  delete level->nsplit;
+  delete level->split;
+  delete level->n_points;
+  delete level->sum_y;
+  delete level->min_y;
+  delete level->max_y;
+  delete level->children;
+}
+
+static int add_pyramid_box(box_pyramid *pyr, pyramid_level *level,
+			   box_split *split) {
+  /* Append an empty box to a level.
+   *
+   * Args:
+   *   pyr: pointer to the pyramid.
+   *   level: pointer to the level to add to.
+   *   split: pointer to the split of the new box.
+   * Returns:
+   *   index of the new box.
+   */
+  for (int j = 0; j < pyr->d; j++) {
+    level->nsplit->push_back(split->nsplit[j]);
+    level->split->push_back(split->split[j]);
+  }
+  level->n_points->push_back(0);
+  level->sum_y->resize(level->sum_y->size() + pyr->m, 0.0);
+  level->min_y->resize(level->min_y->size() + pyr->m, HUGE_VAL);
+  level->max_y->resize(level->max_y->size() + pyr->m, -HUGE_VAL);
+  level->children->resize(level->children->size() + 2 * pyr->d, -1);
+  return level->n_boxes++;
+}
+
+void pyramid_box_split(box_pyramid *pyr, int level, int i, box_split *view) {
+  /* Point a box_split at the split of a box in the pyramid.  No memory is
+   * copied, the view is only valid until the level changes.
+   *
+   * Args:
+   *   pyr: pointer to the pyramid.
+   *   level: integer, level of the box.
+   *   i: integer, index of the box in the level.
+   *   view: pointer to the box_split to populate.
+   */
+  view->d      = pyr->d;
+  view->nsplit = &pyr->levels[level].nsplit->at(i * pyr->d);
+  view->split  = &pyr->levels[level].split->at(i * pyr->d);
+}
+
+typedef struct {
+  vector<int> z_bit;        /* Bit of z holding split i of dimension j, at
+			       i * d + j. */
+  vector<int> shape_shift;  /* Shift of the number of splits of each
+			       dimension in shape. */
+  int z_bits;               /* Number of bits used in z. */
+  int shape_bits;           /* Number of bits used in shape. */
+} morton_layout;
+
+/* A box, or anything else to be put in Morton order, and its key. */
+typedef struct {
+  morton_key key;
+  int index;
+} morton_item;
+
+static void get_morton_layout(box_pyramid *pyr, morton_layout *layout) {
+  /* Find where each split goes in the keys of a pyramid.  The splits are
+   * interleaved coarsest first, one bit per dimension that can still be
+   * split at that depth, so z is the Morton code of the box's lower
+   * corner. */
+  int d = pyr->d, depth = 0, total = total_splits(d, pyr->kmax);
+  for (int j = 0; j < d; j++) {
+    depth = pyr->kmax[j] > depth ? pyr->kmax[j] : depth;
+  }
+  layout->z_bits = total;
+  layout->z_bit.assign((size_t)depth * d, -1);
+  for (int i = 0, bit = total; i < depth; i++) {
+    for (int j = 0; j < d; j++) {
+      if (i < pyr->kmax[j]) {
+	layout->z_bit[i * d + j] = --bit;
+      }
+    }
+  }
+  layout->shape_shift.assign(d, 0);
+  int shift = 0;
+  for (int j = d - 1; j >= 0; j--) {
+    layout->shape_shift[j] = shift;
+    while (pyr->kmax[j] >> (shift - layout->shape_shift[j])) {
+      shift++;
+    }
+  }
+  layout->shape_bits = shift;
+}
+
+template <class T>
+static void sort_by_morton_key(vector<T> *items, morton_layout *layout) {
+  /* Sort items on their keys, a stable radix sort a byte at a time, shape
+   * first since z is the major key.  Only the bytes the layout uses are
+   * sorted on, so a level costs a few linear passes. */
+  vector<T> buffer(items->size());
+  int passes[2] = {(layout->shape_bits + 7) / 8, (layout->z_bits + 7) / 8};
+  for (int part = 0; part < 2; part++) {
+    for (int pass = 0; pass < passes[part]; pass++) {
+      size_t count[257] = {0};
+      int shift = 8 * pass;
+      for (size_t i = 0; i < items->size(); i++) {
+	morton_key &key = (*items)[i].key;
+	count[(((part ? key.z : key.shape) >> shift) & 0xff) + 1]++;
+      }
+      for (int b = 0; b < 256; b++) {
+	count[b + 1] += count[b];
+      }
+      for (size_t i = 0; i < items->size(); i++) {
+	morton_key &key = (*items)[i].key;
+	buffer[count[((part ? key.z : key.shape) >> shift) & 0xff]++] =
+	  (*items)[i];
+      }
+      items->swap(buffer);
+    }
+  }
+}
+
+static morton_key layout_morton_key(box_pyramid *pyr, morton_layout *layout,
+				    box_split *split) {
+  morton_key key = {0, 0};
+  for (int j = 0; j < pyr->d; j++) {
+    for (int i = 0; i < split->nsplit[j]; i++) {
+      key.z |= (unsigned long long)((split->split[j] >> i) & 1) <<
+	layout->z_bit[i * pyr->d + j];
+    }
+    key.shape |= (unsigned long long)split->nsplit[j] <<
+      layout->shape_shift[j];
+  }
+  return key;
+}
+
+morton_key pyramid_morton_key(box_pyramid *pyr, box_split *split) {
+  /* Find the sort key of a box.
+   *
+   * Args:
+   *   pyr: pointer to the pyramid, for kmax.
+   *   split: pointer to the split of the box.
+   * Returns:
+   *   the key, z holds the splits interleaved coarsest first, one bit per
+   *   dimension that can still be split at that depth, with 0 for splits
+   *   the box doesn't have.  This is the Morton code of the box's lower
+   *   corner.  shape holds the number of splits in each dimension.
+   */
+  morton_layout layout;
+  get_morton_layout(pyr, &layout);
+  return layout_morton_key(pyr, &layout, split);
+}
+
+typedef struct {
+  morton_key key;  /* Key of the parent. */
+  int child;       /* Index of the child in the level below. */
+  int dim;         /* Dimension the child was split from the parent in. */
+  int side;        /* Side of the parent the child is on. */
+} parent_link;
+
+static void build_pyramid_level(box_pyramid *pyr, int l) {
+  /* Build level l from the boxes in level l - 1.  Every box names one
+   * parent per dimension it is split in.  The links are sorted by the key
+   * of the parent, so each run of equal keys is one parent box, and the
+   * parents come out in Morton order.
+   *
+   * Args:
+   *   pyr: pointer to the pyramid.
+   *   l: integer, level to build.
+   */
+  pyramid_level *src = &pyr->levels[l - 1];
+  pyramid_level *dst = &pyr->levels[l];
+  init_pyramid_level(dst);
+
+  int d = pyr->d;
+  morton_layout layout;
+  get_morton_layout(pyr, &layout);
+  vector<parent_link> links;
+  links.reserve((size_t)src->n_boxes * d);
+  box_split view;
+  box_split *parent = new_box_split(d);
+  for (int i = 0; i < src->n_boxes; i++) {
+    pyramid_box_split(pyr, l - 1, i, &view);
+    morton_key key = layout_morton_key(pyr, &layout, &view);
+    for (int j = 0; j < d; j++) {
+      if (!view.nsplit[j]) {
+	continue;
+      }
+
+      /* The parent comes from removing the last split in this dimension,
+       * which also says which side of the parent this box is on.  Its key
+       * loses that split's bit and one from the count of splits. */
+      int last = view.nsplit[j] - 1;
+      parent_link link;
+      link.side = (view.split[j] >> last) & 1;
+      link.child = i;
+      link.dim = j;
+      link.key.z = key.z & ~(1ULL << layout.z_bit[last * d + j]);
+      link.key.shape = key.shape - (1ULL << layout.shape_shift[j]);
+      links.push_back(link);
+    }
+  }
+  sort_by_morton_key(&links, &layout);
+
+  for (size_t k = 0; k < links.size(); ) {
+    pyramid_box_split(pyr, l - 1, links[k].child, &view);
+    copy_box_split2(parent, &view);
+    remove_split(parent, links[k].dim);
+    int p = add_pyramid_box(pyr, dst, parent);
+    size_t first = k;
+    for (; k < links.size() &&
+	   !morton_key_less(links[first].key, links[k].key); k++) {
+      dst->children->at((p * d + links[k].dim) * 2 + links[k].side) =
+	links[k].child;
+    }
+  }
+  free_box_split(parent);
+
+  /* Any one dimension with children partitions the box, use the first. */
+  for (int p = 0; p < dst->n_boxes; p++) {
+    for (int j = 0; j < d; j++) {
+      int *child = &dst->children->at((p * d + j) * 2);
+      if (child[0] < 0 && child[1] < 0) {
+	continue;
+      }
+      for (int side = 0; side < 2; side++) {
+	if (child[side] < 0) {
+	  continue;
+	}
+	dst->n_points->at(p) += src->n_points->at(child[side]);
+	for (int c = 0; c < pyr->m; c++) {
+	  int k = child[side] * pyr->m + c;
+	  dst->sum_y->at(p * pyr->m + c) += src->sum_y->at(k);
+	  dst->min_y->at(p * pyr->m + c) = fmin(dst->min_y->at(p * pyr->m + c),
+						src->min_y->at(k));
+	  dst->max_y->at(p * pyr->m + c) = fmax(dst->max_y->at(p * pyr->m + c),
+						src->max_y->at(k));
+	}
+      }
+      break;
+    }
+  }
+}
+
+static box_pyramid *alloc_box_pyramid(int n, int d, int m,
+				      const int *kmax) {
+  /* Allocate a pyramid with room for its levels, none initialized. */
+  box_pyramid *pyr = (box_pyramid *)malloc(sizeof(box_pyramid));
+  pyr->d           = d;
+  pyr->kmax        = (int *)malloc(sizeof(int) * d + 1);
+  pyr->n           = n;
+  pyr->n_rows      = n;
+  pyr->weight      = 1;
+  pyr->m           = m;
+  pyr->n_levels    = total_splits(d, kmax) + 1;
+  pyr->levels      = (pyramid_level *)malloc(sizeof(pyramid_level) *
+					     pyr->n_levels);
+  pyr->A           = new vector<double>(m);
+  pyr->points      = new vector<int>;
+  pyr->point_start = new vector<int>;
+  pyr->y           = new vector<double>;
+  memcpy(pyr->kmax, kmax, sizeof(int) * d);
+  return pyr;
+}
+
+box_pyramid *new_box_pyramid(double *x, double *y, int n, int d, int m,
+			     int *kmax) {
+  /* Bin points into the finest boxes and build every level above them.
+   *
+   * Args:
+   *   x: pointer to points, column centric array, n x d.
+   *   y: pointer to responses, column centric array, n x m.
+   *   n: number of points.
+   *   d: dimension.
+   *   m: number of response columns.
+   *   kmax: array of d integers, max number of splits in each dimension.
+   * Returns:
+   *   pointer to the new pyramid.
+   */
+  box_pyramid *pyr = alloc_box_pyramid(n, d, m, kmax);
+
+  /* As in compute_levelset, A = 1 + max_i |Y_i| bounds the responses. */
+  for (int c = 0; c < m; c++) {
+    pyr->A->at(c) = max_vector_fabs(y + c * n, n) + 1.0;
+  }
+
+  /* Level 0 comes from sorting the points by their finest box, so each
+   * box owns the range of points between two entries of point_start, and
+   * its responses are a contiguous run of y. */
+  morton_layout layout;
+  get_morton_layout(pyr, &layout);
+  box_split *split = new_box_split(d);
+  for (int j = 0; j < d; j++) {
+    split->nsplit[j] = kmax[j];
+  }
+  vector<double> point(d);
+  vector<morton_item> order(n);
+  vector<unsigned long long> splits((size_t)BIN_BLOCK * d);
+  for (int i = 0; i < n; i++) {
+    if (i % BIN_BLOCK == 0) {
+      bin_points(x, n, d, kmax, i, n - i < BIN_BLOCK ? n - i : BIN_BLOCK,
+		 &splits[0]);
+    }
+    for (int j = 0; j < d; j++) {
+      split->split[j] = splits[(size_t)(i % BIN_BLOCK) * d + j];
+    }
+    order[i].key = layout_morton_key(pyr, &layout, split);
+    order[i].index = i;
+  }
+  /* The sort is stable, so the points of a box stay in index order. */
+  sort_by_morton_key(&order, &layout);
+  pyr->points->resize(n);
+  pyr->y->resize((size_t)n * m);
+  for (int k = 0; k < n; k++) {
+    pyr->points->at(k) = order[k].index;
+    for (int c = 0; c < m; c++) {
+      pyr->y->at(c * n + k) = y[order[k].index + c * n];
+    }
+  }
+
+  pyramid_level *level = &pyr->levels[0];
+  init_pyramid_level(level);
+  for (int k = 0; k < n; ) {
+    int start = k;
+    for (k++; k < n && !morton_key_less(order[start].key, order[k].key);
+	 k++);
+    for (int j = 0; j < d; j++) {
+      point[j] = x[order[start].index + j * n];
+    }
+    point_to_box(&point[0], d, kmax, split->split);
+    int b = add_pyramid_box(pyr, level, split);
+    level->n_points->at(b) = k - start;
+    pyr->point_start->push_back(start);
+    for (int c = 0; c < m; c++) {
+      const double *yc = &pyr->y->at(c * n);
+      double sum = 0, lo = HUGE_VAL, hi = -HUGE_VAL;
+      for (int i = start; i < k; i++) {
+	sum += yc[i];
+	lo = fmin(lo, yc[i]);
+	hi = fmax(hi, yc[i]);
+      }
+      level->sum_y->at(b * m + c) = sum;
+      level->min_y->at(b * m + c) = lo;
+      level->max_y->at(b * m + c) = hi;
+    }
+  }
+  pyr->point_start->push_back(n);
+  free_box_split(split);
+
+  for (int l = 1; l < pyr->n_levels; l++) {
+    build_pyramid_level(pyr, l);
+  }
+
+  return pyr;
+}
+
+box_pyramid *coarsen_box_pyramid(box_pyramid *src, const int *kmax) {
+  /* Build the pyramid for a coarser lattice from the finest boxes of
+   * another pyramid, without going back to the points.  A point's split
+   * with kmax[j] splits is its split with src->kmax[j] splits cut down to
+   * the first kmax[j] bits, so each coarse box is the union of the fine
+   * boxes that agree on those bits.
+   *
+   * Args:
+   *   src: pointer to the finer pyramid.
+   *   kmax: array of src->d integers, max number of splits in each
+   *     dimension, no more than src->kmax.
+   * Returns:
+   *   pointer to the new pyramid, NULL if kmax is finer than src->kmax.
+   */
+  int d = src->d, m = src->m;
+  for (int j = 0; j < d; j++) {
+    if (kmax[j] < 0 || kmax[j] > src->kmax[j]) {
+      return NULL;
+    }
+  }
+  box_pyramid *pyr = alloc_box_pyramid(src->n, d, m, kmax);
+  pyr->n_rows = src->n_rows;
+  pyr->weight = src->weight;
+  *pyr->A = *src->A;
+
+  /* Sort the fine boxes by the key of their truncated splits, each run of
+   * equal keys is one coarse box. */
+  box_split view;
+  box_split *split = new_box_split(d);
+  morton_layout layout;
+  get_morton_layout(pyr, &layout);
+  vector<morton_item> order;
+  for (int i = 0; i < src->levels[0].n_boxes; i++) {
+    pyramid_box_split(src, 0, i, &view);
+    for (int j = 0; j < d; j++) {
+      split->nsplit[j] = kmax[j];
+      split->split[j] = view.split[j] & split_mask(kmax[j]);
+    }
+    morton_item item = {layout_morton_key(pyr, &layout, split), i};
+    order.push_back(item);
+  }
+  sort_by_morton_key(&order, &layout);
+
+  pyramid_level *fine = &src->levels[0];
+  pyramid_level *level = &pyr->levels[0];
+  init_pyramid_level(level);
+  vector<int> positions;
+  for (size_t k = 0; k < order.size(); ) {
+    pyramid_box_split(src, 0, order[k].index, &view);
+    for (int j = 0; j < d; j++) {
+      split->nsplit[j] = kmax[j];
+      split->split[j] = view.split[j] & split_mask(kmax[j]);
+    }
+    int b = add_pyramid_box(pyr, level, split);
+    pyr->point_start->push_back(pyr->points->size());
+    /* Each point and where it sits in src. */
+    vector<std::pair<int, int> > members;
+    size_t first = k;
+    for (; k < order.size() &&
+	   !morton_key_less(order[first].key, order[k].key); k++) {
+      int i = order[k].index;
+      level->n_points->at(b) += fine->n_points->at(i);
+      for (int s = src->point_start->at(i); s < src->point_start->at(i + 1);
+	   s++) {
+	members.push_back(std::make_pair(src->points->at(s), s));
+      }
+      for (int c = 0; c < m; c++) {
+	level->sum_y->at(b * m + c) += fine->sum_y->at(i * m + c);
+	level->min_y->at(b * m + c) = fmin(level->min_y->at(b * m + c),
+					   fine->min_y->at(i * m + c));
+	level->max_y->at(b * m + c) = fmax(level->max_y->at(b * m + c),
+					   fine->max_y->at(i * m + c));
+      }
+    }
+    /* Keep the points in the order binning would have found them. */
+    std::sort(members.begin(), members.end());
+    for (size_t t = 0; t < members.size(); t++) {
+      pyr->points->push_back(members[t].first);
+      positions.push_back(members[t].second);
+    }
+  }
+  pyr->point_start->push_back(pyr->points->size());
+  free_box_split(split);
+
+  /* The responses follow the points. */
+  int n = src->n;
+  pyr->y->resize((size_t)n * m);
+  for (int c = 0; c < m; c++) {
+    for (int k = 0; k < n; k++) {
+      pyr->y->at(c * n + k) = src->y->at(c * n + positions[k]);
+    }
+  }
+
+  for (int l = 1; l < pyr->n_levels; l++) {
+    build_pyramid_level(pyr, l);
+  }
+
+  return pyr;
+}
+
+void sample_box_pyramid(box_pyramid *pyr, const int *rows, int n_rows,
+			const double *A) {
+  /* Make a pyramid built from a sample of the rows of the data stand for
+   * all of them.
+   *
+   * Args:
+   *   pyr: pointer to a pyramid made by new_box_pyramid from the sampled
+   *     rows.
+   *   rows: array of pyr->n integers, the row (0-relative) of each point
+   *     in the data, which becomes its index in the boxes.
+   *   n_rows: number of rows in the data.
+   *   A: array of pyr->m doubles, bound on |y| over every row, for each
+   *     response.
+   */
+  set_pyramid_rows(pyr, rows, n_rows, (double)n_rows / pyr->n, A);
+}
+
+void set_pyramid_rows(box_pyramid *pyr, const int *rows, int n_rows,
+		      double weight, const double *A) {
+  /* Make a pyramid built from some of the rows of the data cost its boxes
+   * as part of all of them: the complexity penalty is that of n_rows
+   * points and A bounds every row.
+   *
+   * Args:
+   *   pyr: pointer to a pyramid made by new_box_pyramid from the rows.
+   *   rows: array of pyr->n integers, the row (0-relative) of each point
+   *     in the data, which becomes its index in the boxes.
+   *   n_rows: number of rows in the data.
+   *   weight: number of rows each point stands for, n_rows / pyr->n for a
+   *     uniform sample, 1 when the points are all of the rows in their
+   *     boxes.
+   *   A: array of pyr->m doubles, bound on |y| over every row, for each
+   *     response.
+   */
+  pyr->n_rows = n_rows;
+  pyr->weight = weight;
+  for (int k = 0; k < pyr->n; k++) {
+    pyr->points->at(k) = rows[pyr->points->at(k)];
+  }
+  for (int c = 0; c < pyr->m; c++) {
+    pyr->A->at(c) = A[c];
+  }
+}
+
+void free_box_pyramid(box_pyramid *pyr) {
+  /* Free a pyramid and all of its levels.
+   *
+   * Args:
+   *   pyr: pointer to the pyramid to free.
+   */
+  if (!pyr) {
+    return;
+  }
+  for (int l = 0; l < pyr->n_levels; l++) {
+    free_pyramid_level(&pyr->levels[l]);
+  }
+  free(pyr->levels);
+  free(pyr->kmax);
+  delete pyr->A;
+  delete pyr->points;
+  delete pyr->point_start;
+  delete pyr->y;
+  free(pyr);
+}
+
+static levelset_args pyramid_levelset_args(box_pyramid *pyr, double gamma,
+					   double A, double delta,
+					   double rho) {
+  /* Make the levelset_args for one response of a pyramid. */
+  levelset_args la;
+  la.d     = pyr->d;
+  la.kmax  = pyr->kmax;
+  la.n     = pyr->n_rows;
+  la.x     = NULL;
+  la.y     = NULL;
+  la.xf    = NULL;
+  la.yf    = NULL;
+  la.cells = NULL;
+  la.A     = A;
+  la.gamma = gamma;
+  la.delta = delta;
+  la.rho   = rho;
+  return la;
+}
+
+static box_risk pyramid_box_cost(box_pyramid *pyr, int l, int i, int c,
+				 levelset_args *la) {
+  /* Compute the cost of a pyramid box as a terminal box.  The aggregates
+   * of a sampled pyramid are scaled up to all of the rows. */
+  pyramid_level *level = &pyr->levels[l];
+  int n_points = level->n_points->at(i);
+  double risk = inset_risk_from_sum(n_points, level->sum_y->at(i * pyr->m + c),
+				    la->gamma, la->A);
+  if (pyr->weight != 1) {
+    risk *= pyr->weight;
+    n_points = (int)(n_points * pyr->weight + 0.5);
+  }
+  return levelset_cost_from_risk(risk, pyr->n_levels - 1 - l, n_points, la);
+}
+
+static int pyramid_box_pure(box_pyramid *pyr, int l, int i, int c,
+			    double gamma) {
+  /* Check if every response in a box is on the same side of gamma. */
+  pyramid_level *level = &pyr->levels[l];
+  return level->max_y->at(i * pyr->m + c) <= gamma ||
+    level->min_y->at(i * pyr->m + c) >= gamma;
+}
+
+static vector<vector<char> > *find_needed_boxes(box_pyramid *pyr,
+						double *gamma, int prune) {
+  /* Mark the boxes whose solution can affect the optimal trees.
+   *
+   * Args:
+   *   pyr: pointer to the pyramid.
+   *   gamma: array of m thresholds, one per response.
+   *   prune: integer, if 0 every box is needed.
+   * Returns:
+   *   pointer to a new vector, per level, 1 for needed boxes.
+   */
+  vector<vector<char> > *needed = new vector<vector<char> >(pyr->n_levels);
+  for (int l = 0; l < pyr->n_levels; l++) {
+    needed->at(l).assign(pyr->levels[l].n_boxes, prune ? 0 : 1);
+  }
+  if (!prune) {
+    return needed;
+  }
+
+  /* Top down, the children of a box are only needed if the box could be
+   * refined for some response. */
+  int top = pyr->n_levels - 1;
+  needed->at(top).assign(pyr->levels[top].n_boxes, 1);
+  for (int l = top; l > 0; l--) {
+    pyramid_level *level = &pyr->levels[l];
+    for (int i = 0; i < level->n_boxes; i++) {
+      if (!needed->at(l)[i]) {
+	continue;
+      }
+      int pure = 1;
+      for (int c = 0; c < pyr->m && pure; c++) {
+	pure = pyramid_box_pure(pyr, l, i, c, gamma[c]);
+      }
+      if (pure) {
+	continue;
+      }
+      for (int k = 0; k < 2 * pyr->d; k++) {
+	int child = level->children->at(i * 2 * pyr->d + k);
+	if (child >= 0) {
+	  needed->at(l - 1)[child] = 1;
+	}
+      }
+    }
+  }
+  return needed;
+}
+
+pyramid_solution *solve_box_pyramid(box_pyramid *pyr, double *gamma,
+				    double delta, double rho, int prune) {
+  /* Find the optimal tree for every response in one pass over the pyramid.
+   *
+   * Args:
+   *   pyr: pointer to the pyramid.
+   *   gamma: array of m thresholds, one per response.
+   *   delta: double, complexity factor.
+   *   rho: double, cost penalty.
+   *   prune: integer, if non-zero, skip boxes below boxes that are provably
+   *     terminal.  Has no effect unless rho > 0.  The skipped boxes are
+   *     still in pyr, only their costs are never found, so this saves
+   *     time but not memory.
+   * Returns:
+   *   pointer to the new solution.
+   */
+  int d = pyr->d;
+  int m = pyr->m;
+  prune = prune && rho > 0;
+  pyramid_solution *sol = (pyramid_solution *)malloc(sizeof(pyramid_solution));
+  sol->m         = m;
+  sol->gamma     = new vector<double>(gamma, gamma + m);
+  sol->risk_cost = new vector<vector<double> >(pyr->n_levels);
+  sol->choice    = new vector<vector<int> >(pyr->n_levels);
+  sol->n_solved  = 0;
+
+  vector<levelset_args> la(m);
+  for (int c = 0; c < m; c++) {
+    la[c] = pyramid_levelset_args(pyr, gamma[c], pyr->A->at(c), delta, rho);
+  }
+  vector<vector<char> > *needed = find_needed_boxes(pyr, gamma, prune);
+  vector<char> refine(m);
+
+  /* Bottom (most splits) to top (no splits), as in compute_levelset.  A box
+   * is split along whichever dimension has the lowest total risk + cost
+   * for its children, and is kept as a terminal box only if that is
+   * strictly worse than not splitting. */
+  for (int l = 0; l < pyr->n_levels; l++) {
+    pyramid_level *level = &pyr->levels[l];
+    vector<double> &risk_cost = sol->risk_cost->at(l);
+    vector<int> &choice = sol->choice->at(l);
+    risk_cost.resize(level->n_boxes * m);
+    choice.resize(level->n_boxes * m);
+
+    for (int i = 0; i < level->n_boxes; i++) {
+      if (!needed->at(l)[i]) {
+	continue;
+      }
+      sol->n_solved++;
+      for (int c = 0; c < m; c++) {
+	risk_cost[i * m + c] = pyramid_box_cost(pyr, l, i, c, &la[c]).risk_cost;
+	choice[i * m + c] = -1;
+	refine[c] = l && !(prune && pyramid_box_pure(pyr, l, i, c, gamma[c]));
+      }
+
+      vector<double> &below = sol->risk_cost->at(l ? l - 1 : 0);
+      for (int j = 0; j < d && l; j++) {
+	int *child = &level->children->at((i * d + j) * 2);
+	if (child[0] < 0 && child[1] < 0) {
+	  continue;
+	}
+	for (int c = 0; c < m; c++) {
+	  if (!refine[c]) {
+	    continue;
+	  }
+	  double split_cost =
+	    (child[0] < 0 ? 0 : below[child[0] * m + c]) +
+	    (child[1] < 0 ? 0 : below[child[1] * m + c]);
+	  if (choice[i * m + c] < 0 ?
+	      !(risk_cost[i * m + c] < split_cost) :
+	      split_cost < risk_cost[i * m + c]) {
+	    risk_cost[i * m + c] = split_cost;
+	    choice[i * m + c] = j;
+	  }
+	}
+      }
+    }
+  }
+  delete needed;
+
+  return sol;
+}
+
+void free_pyramid_solution(pyramid_solution *sol) {
+  if (!sol) {
+    return;
+  }
+  delete sol->gamma;
+  delete sol->risk_cost;
+  delete sol->choice;
+  free(sol);
+}
+
+static void add_pyramid_points(box_pyramid *pyr, int l, int i, box *p) {
+  /* Add the points of a pyramid box, and all of its descendants, to a box.
+   *
+   * Args:
+   *   pyr: pointer to the pyramid.
+   *   l: integer, level of the pyramid box.
+   *   i: integer, index of the pyramid box.
+   *   p: pointer to the box to add points to.
+   */
+  if (!l) {
+    for (int k = pyr->point_start->at(i); k < pyr->point_start->at(i + 1);
+	 k++) {
+      add_point(p, pyr->points->at(k));
+    }
+    return;
+  }
+
+  /* The children along any one dimension cover the box exactly once. */
+  pyramid_level *level = &pyr->levels[l];
+  for (int j = 0; j < pyr->d; j++) {
+    int *child = &level->children->at((i * pyr->d + j) * 2);
+    if (child[0] < 0 && child[1] < 0) {
+      continue;
+    }
+    for (int side = 0; side < 2; side++) {
+      if (child[side] >= 0) {
+	add_pyramid_points(pyr, l - 1, child[side], p);
+      }
+    }
+    return;
+  }
+}
+
+static void get_pyramid_terminal_boxes(box_pyramid *pyr,
+				       pyramid_solution *sol, int c, int l,
+				       int i, levelset_args *la,
+				       vector<box *> &terminal) {
+  /* Collect the terminal boxes of the optimal tree below a pyramid box.
+   *
+   * Args:
+   *   pyr: pointer to the pyramid.
+   *   sol: pointer to the solution.
+   *   c: integer, response column.
+   *   l: integer, level of the pyramid box.
+   *   i: integer, index of the pyramid box.
+   *   la: pointer to the levelset_args for response c.
+   *   terminal: vector of terminal boxes, added to.
+   */
+  int j = sol->choice->at(l)[i * sol->m + c];
+  if (j >= 0) {
+    int *child = &pyr->levels[l].children->at((i * pyr->d + j) * 2);
+    for (int side = 0; side < 2; side++) {
+      if (child[side] >= 0) {
+	get_pyramid_terminal_boxes(pyr, sol, c, l - 1, child[side], la,
+				   terminal);
+      }
+    }
+    return;
+  }
+
+  box_split view;
+  pyramid_box_split(pyr, l, i, &view);
+  box *p = new_box(&view);
+  add_pyramid_points(pyr, l, i, p);
+  p->risk = pyramid_box_cost(pyr, l, i, c, la);
+  terminal.push_back(p);
+}
+
+levelset_estimate pyramid_levelset_estimate(box_pyramid *pyr,
+					    pyramid_solution *sol, int column,
+					    double delta, double rho) {
+  /* Convert the optimal tree for one response into a levelset estimate.
+   *
+   * Args:
+   *   pyr: pointer to the pyramid.
+   *   sol: pointer to the solution.
+   *   column: integer, which response to convert.
+   *   delta: double, complexity factor used for the solution.
+   *   rho: double, cost penalty used for the solution.
+   * Returns:
+   *   levelset_estimate struct, the boxes are newly allocated.
+   */
+  levelset_args la = pyramid_levelset_args(pyr, sol->gamma->at(column),
+					   pyr->A->at(column), delta, rho);
+
+  vector<box *> terminal;
+  int top = pyr->n_levels - 1;
+  double total_cost = 0;
+  if (pyr->levels[top].n_boxes) {
+    total_cost = sol->risk_cost->at(top)[column];
+    get_pyramid_terminal_boxes(pyr, sol, column, top, 0, &la, terminal);
+  }
+  return terminal_levelset_estimate(la, total_cost,
+				    terminal.empty() ? NULL : &terminal[0],
+				    terminal.size());
+}
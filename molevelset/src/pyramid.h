@@ -0,0 +1,141 @@
+#ifndef pyramid_h
+#define pyramid_h
+
+#include <vector>
+
+#include "box.h"
+#include "molevelset.h"
+
+/* A box pyramid holds every occupied box of the dyadic lattice, level by
+ * level, along with the aggregates needed to compute its cost: the number
+ * of points and the sum of the responses.  Only the finest boxes keep
+ * their points.  Because the aggregates can hold several response columns,
+ * one binning of X and one pass over the pyramid serve every response.
+ *
+ * The points are sorted once by their finest box, with the responses in
+ * the same order, so each finest box owns a contiguous range of both and
+ * its aggregates are sums over a run of memory.  A coarser box is not one
+ * range in general, boxes split in different dimensions first can't all
+ * be contiguous in one order, so its points are the ranges of its finest
+ * descendants.
+ *
+ * Level 0 holds the finest boxes, with kmax[j] splits in dimension j, and
+ * level l holds the boxes with sum(kmax) - l splits in total, the same
+ * numbering used by compute_levelset.
+ *
+ * The boxes of each level are stored in Morton order, see morton_key, so
+ * boxes that are close in space are close in memory and a pass over a
+ * level walks its children and parents mostly in order.  Each level is
+ * built from the one below by sorting, never by hashing.  The keys hold
+ * every split of a box in 64 bits, so the pyramid is limited to
+ * MAX_PYRAMID_SPLITS splits in total. */
+#define MAX_PYRAMID_SPLITS 64
+
+/* Sort key of a pyramid box. */
+typedef struct {
+  unsigned long long z;      /* Splits interleaved coarsest first, the
+				Morton code of the lower corner. */
+  unsigned long long shape;  /* Number of splits in each dimension. */
+} morton_key;
+
+typedef struct {
+  int n_boxes;                      /* Number of boxes in this level. */
+  std::vector<int> *nsplit;         /* Number of splits, n_boxes x d. */
+  std::vector<unsigned long long> *split;
+                                    /* Splits, n_boxes x d. */
+  std::vector<int> *n_points;       /* Number of points in each box. */
+  std::vector<double> *sum_y;       /* Sum of each response over each box,
+				       n_boxes x m. */
+  std::vector<double> *min_y;       /* Smallest response in each box,
+				       n_boxes x m. */
+  std::vector<double> *max_y;       /* Largest response in each box,
+				       n_boxes x m. */
+  std::vector<int> *children;       /* Index of the children of each box in
+				       the level below, n_boxes x d x 2,
+				       -1 for empty children. */
+} pyramid_level;
+
+typedef struct {
+  int d;                          /* Number of dimensions. */
+  int *kmax;                      /* Max number of splits in each
+				     dimension. */
+  int n;                          /* Number of points. */
+  int n_rows;                     /* Number of rows of the data the points
+				     were taken from, n unless set by
+				     set_pyramid_rows. */
+  double weight;                  /* Number of rows each point stands for,
+				     1 unless the points are a sample. */
+  int m;                          /* Number of response columns. */
+  std::vector<double> *A;         /* Bound on |y| for each response. */
+  int n_levels;                   /* Number of levels, sum(kmax) + 1. */
+  pyramid_level *levels;          /* Levels, finest first. */
+  std::vector<int> *points;       /* Points in the finest boxes, box by
+				     box, so each finest box owns the range
+				     [point_start[i], point_start[i + 1]). */
+  std::vector<int> *point_start;  /* Start of each finest box in points,
+				     n_boxes + 1 entries. */
+  std::vector<double> *y;         /* Responses in the order of points,
+				     n x m, column centric. */
+} box_pyramid;
+
+/* A pyramid can be built from a uniform sample, without replacement, of s
+ * of the N rows of the data, for a first look at data too large to bin
+ * in full.  Each sampled point then stands for N / s rows: the number of
+ * points and the sum of the responses of every box are scaled by N / s
+ * before its cost is computed, and the complexity penalty is that of N
+ * points.  The box points are the sampled rows only.
+ *
+ * Row i adds z_i = (gamma - y_i) / (2 A) to the inset risk of its box, and
+ * |y_i| < A for every row, so z_i 1{i in box} lies in an interval of width
+ * w = max(0, (gamma + A) / (2 A)) - min(0, (gamma - A) / (2 A)).  By
+ * Hoeffding's inequality for sampling without replacement, with Serfling's
+ * correction, the scaled inset risk of any one box is within
+ *
+ *   N w sqrt((1 - (s - 1) / N) log(2 / alpha) / (2 s))
+ *
+ * of its inset risk over all N rows with probability at least 1 - alpha,
+ * see molevelset.approx.  The bound shrinks as 1 / sqrt(s) of the
+ * total N w, so it is meant for the large boxes a first look is about. */
+
+/* The optimal tree for each response, found by solve_box_pyramid.  For
+ * every box and response it holds the lowest risk + cost of any tree
+ * inside the box, and the dimension of the split that achieves it, -1
+ * when the box is best left as a terminal box.
+ *
+ * When pruning, boxes that are not reachable from the top of the tree are
+ * skipped and their entries are left unset.  A box whose responses all lie
+ * on one side of gamma is provably best left as a terminal box when rho >
+ * 0: every tree inside it has the same risk, -sum |gamma - y| / (2 A), and
+ * the complexity penalty of its leaves adds up to more than that of the
+ * box itself (more splits, and sqrt is concave in the point counts).  So
+ * such a box is never refined and nothing below it needs to be solved. */
+typedef struct {
+  int m;                                 /* Number of response columns. */
+  std::vector<double> *gamma;            /* Levelset threshold for each
+					    response. */
+  std::vector<std::vector<double> > *risk_cost;
+                                         /* Per level, n_boxes x m. */
+  std::vector<std::vector<int> > *choice;
+                                         /* Per level, n_boxes x m. */
+  int n_solved;                          /* Number of boxes solved. */
+} pyramid_solution;
+
+box_pyramid *new_box_pyramid(double *x, double *y, int n, int d, int m,
+			     int *kmax);
+box_pyramid *coarsen_box_pyramid(box_pyramid *, const int *kmax);
+void sample_box_pyramid(box_pyramid *, const int *rows, int n_rows,
+			const double *A);
+void set_pyramid_rows(box_pyramid *, const int *rows, int n_rows,
+		      double weight, const double *A);
+void free_box_pyramid(box_pyramid *);
+void pyramid_box_split(box_pyramid *, int level, int i, box_split *view);
+morton_key pyramid_morton_key(box_pyramid *, box_split *);
+
+pyramid_solution *solve_box_pyramid(box_pyramid *, double *gamma,
+				    double delta, double rho, int prune);
+void free_pyramid_solution(pyramid_solution *);
+levelset_estimate pyramid_levelset_estimate(box_pyramid *,
+					    pyramid_solution *, int column,
+					    double delta, double rho);
+
+#endif
@@ -1,13 +1,485 @@
+#include <limits.h>
+#include <string.h>
+
+#include <algorithm>
+
 #include <R.h>
 #include <Rinternals.h>
+#include <R_ext/Rdynload.h>
 
 #include "box.h"
+#include "boxtree.h"
+#include "async.h"
+#include "depthfirst.h"
 #include "molevelset.h"
+#include "pyramid.h"
+#include "raster.h"
+#include "shard.h"
+#include "simd.h"
+#include "sweep.h"
 
 using std::vector;
 
+#define POINT_INDICES_FULL 0  /* Copy the indexes into R vectors. */
+#define POINT_INDICES_NONE 1  /* Leave the indexes out. */
+
 extern "C" {
-  SEXP box_to_list(box *p);
+  typedef struct {
+    int columnar;          /* Return the boxes as columns, not lists. */
+    const double *offset;  /* Transform of each dimension of X into the */
+    const double *scale;   /* unit cube, for columnar boxes. */
+    int points;            /* POINT_INDICES_FULL or _NONE. */
+  } r_output;
+
+  SEXP box_to_list(box *p, int points);
+  SEXP levelset_estimate_to_list(levelset_estimate *le, const r_output *out);
+
+  void R_init_molevelset(DllInfo *dll) {
+    init_simd();
+  }
+
+  SEXP get_list_element(SEXP list, const char *name) {
+    /* Find an element of an R list by name.
+     *
+     * Args:
+     *   list: R list.
+     *   name: name of the element.
+     * Returns:
+     *   the element, R_NilValue if it isn't found.
+     */
+    SEXP names = Rf_getAttrib(list, R_NamesSymbol);
+    if (names == R_NilValue) {
+      return R_NilValue;
+    }
+    for (int i = 0; i < LENGTH(list); i++) {
+      if (!strcmp(CHAR(STRING_ELT(names, i)), name)) {
+	return VECTOR_ELT(list, i);
+      }
+    }
+    return R_NilValue;
+  }
+
+  void check_k_max(SEXP k_max, int d) {
+    /* Make sure that k_max holds a number of splits for each of the d
+     * dimensions, at most MAX_POINT_SPLITS so that points are binned
+     * exactly. */
+    if (TYPEOF(k_max) != INTSXP || LENGTH(k_max) != d) {
+      error("k_max must be an integer vector with one value per dimension.");
+    }
+    for (int j = 0; j < d; j++) {
+      if (INTEGER(k_max)[j] < 0 || INTEGER(k_max)[j] > MAX_POINT_SPLITS) {
+	error("k_max must be between 0 and %d.", MAX_POINT_SPLITS);
+      }
+    }
+  }
+
+  void check_box_lists(SEXP boxes) {
+    /* Make sure that every R box in a list can be converted by
+     * list_to_box_split.  Callers check before they allocate anything, so
+     * an error leaks nothing. */
+    for (int i = 0; i < LENGTH(boxes); i++) {
+      SEXP splits = get_list_element(VECTOR_ELT(boxes, i), "splits");
+      if (TYPEOF(splits) != VECSXP) {
+	error("box must have a list of splits.");
+      }
+      for (int j = 0; j < LENGTH(splits); j++) {
+	SEXP tmp_splits = VECTOR_ELT(splits, j);
+	if (TYPEOF(tmp_splits) != INTSXP ||
+	    LENGTH(tmp_splits) > MAX_SPLITS) {
+	  error("box splits must be integer vectors.");
+	}
+      }
+    }
+  }
+
+  box_split *list_to_box_split(SEXP box_list) {
+    /* Convert the splits of an R box, as made by box_to_list, back to a
+     * box_split.
+     *
+     * Args:
+     *   box_list: R list with a 'splits' element, checked by
+     *     check_box_lists.
+     * Returns:
+     *   pointer to a newly allocated box_split.
+     */
+    SEXP splits = get_list_element(box_list, "splits");
+    int d = LENGTH(splits);
+    box_split *p = new_box_split(d);
+    for (int j = 0; j < d; j++) {
+      SEXP tmp_splits = VECTOR_ELT(splits, j);
+      p->nsplit[j] = LENGTH(tmp_splits);
+      p->split[j] = 0;
+      for (int i = 0; i < p->nsplit[j]; i++) {
+	unsigned long long bit = INTEGER(tmp_splits)[i] == 1 ? LEFT_SPLIT : 
+	  RIGHT_SPLIT;
+	p->split[j] |= bit << i;
+      }
+    }
+    return p;
+  }
+
+  box_tree *boxes_to_tree(SEXP inset_boxes, SEXP non_inset_boxes, int d,
+			  int *labels) {
+    /* Build a box tree from the R box lists of a levelset estimate.
+     *
+     * Args:
+     *   inset_boxes: list of inset boxes, checked by check_box_lists.
+     *   non_inset_boxes: list of non-inset boxes, checked likewise.
+     *   d: integer, number of dimensions.
+     *   labels: array of length(inset_boxes) + length(non_inset_boxes),
+     *     populated with 1 for inset boxes and 0 otherwise.
+     * Returns:
+     *   pointer to the new tree, or NULL if the boxes overlap or have the
+     *   wrong dimension.  The inset boxes come first in the leaf
+     *   numbering.
+     */
+    int n_inset = LENGTH(inset_boxes);
+    int n_leaves = n_inset + LENGTH(non_inset_boxes);
+    box_split **leaves = (box_split **)malloc(sizeof(box_split *) * 
+					      (n_leaves + 1));
+    for (int i = 0; i < n_leaves; i++) {
+      labels[i] = i < n_inset;
+      leaves[i] = list_to_box_split(i < n_inset ? 
+				    VECTOR_ELT(inset_boxes, i) :
+				    VECTOR_ELT(non_inset_boxes, i - n_inset));
+    }
+
+    box_tree *tree = new_box_tree(leaves, n_leaves, d);
+
+    for (int i = 0; i < n_leaves; i++) {
+      free_box_split(leaves[i]);
+    }
+    free(leaves);
+    return tree;
+  }
+
+  SEXP levelset_boundary(SEXP inset_boxes, SEXP non_inset_boxes, SEXP d) {
+    /* Find the boundary facets of a levelset estimate.
+     *
+     * Args:
+     *   inset_boxes: list of inset boxes, as returned by estimate_levelset.
+     *   non_inset_boxes: list of non-inset boxes.
+     *   d: integer, number of dimensions.
+     * Returns:
+     *   list containing:
+     *     'dim' - dimension normal to each facet (1-relative).
+     *     'lower' - matrix, lower corner of each facet, one row per facet.
+     *     'upper' - matrix, upper corner of each facet.
+     *     'low' - logical, is the region below the facet inset.  NA for
+     *        empty space.
+     *     'high' - logical, is the region above the facet inset.
+     */
+    if (TYPEOF(inset_boxes) != VECSXP || TYPEOF(non_inset_boxes) != VECSXP) {
+      error("inset_boxes and non_inset_boxes must be lists.");
+    }
+    if (LENGTH(d) != 1 || TYPEOF(d) != INTSXP) {
+      error("d must be a single integer value.");
+    }
+
+    check_box_lists(inset_boxes);
+    check_box_lists(non_inset_boxes);
+
+    int n_leaves = LENGTH(inset_boxes) + LENGTH(non_inset_boxes);
+    int n_dim = INTEGER(d)[0];
+    int *labels = (int *)malloc(sizeof(int) * (n_leaves + 1));
+    box_tree *tree = boxes_to_tree(inset_boxes, non_inset_boxes, n_dim, 
+				   labels);
+    if (!tree) {
+      free(labels);
+      error("levelset boxes overlap or have the wrong dimension.");
+    }
+    box_tree_facets *f = find_boundary_facets(tree, labels);
+    free_box_tree(tree);
+
+    int n_facets = f->dim->size();
+    SEXP ret, ret_names, facet_dim, lower, upper, low, high;
+    PROTECT(ret = allocVector(VECSXP, 5));
+    PROTECT(ret_names = allocVector(STRSXP, 5));
+    SET_STRING_ELT(ret_names, 0, mkChar("dim"));
+    SET_STRING_ELT(ret_names, 1, mkChar("lower"));
+    SET_STRING_ELT(ret_names, 2, mkChar("upper"));
+    SET_STRING_ELT(ret_names, 3, mkChar("low"));
+    SET_STRING_ELT(ret_names, 4, mkChar("high"));
+    Rf_namesgets(ret, ret_names);
+    UNPROTECT(1);
+
+    PROTECT(facet_dim = allocVector(INTSXP, n_facets));
+    PROTECT(lower = allocMatrix(REALSXP, n_facets, n_dim));
+    PROTECT(upper = allocMatrix(REALSXP, n_facets, n_dim));
+    PROTECT(low = allocVector(LGLSXP, n_facets));
+    PROTECT(high = allocVector(LGLSXP, n_facets));
+    for (int i = 0; i < n_facets; i++) {
+      INTEGER(facet_dim)[i] = f->dim->at(i) + 1;
+      for (int j = 0; j < n_dim; j++) {
+	REAL(lower)[i + j * n_facets] = f->lower->at(i * n_dim + j);
+	REAL(upper)[i + j * n_facets] = f->upper->at(i * n_dim + j);
+      }
+      int low_leaf = f->low_leaf->at(i);
+      int high_leaf = f->high_leaf->at(i);
+      LOGICAL(low)[i] = low_leaf < 0 ? NA_LOGICAL : labels[low_leaf];
+      LOGICAL(high)[i] = high_leaf < 0 ? NA_LOGICAL : labels[high_leaf];
+    }
+    SET_VECTOR_ELT(ret, 0, facet_dim);
+    SET_VECTOR_ELT(ret, 1, lower);
+    SET_VECTOR_ELT(ret, 2, upper);
+    SET_VECTOR_ELT(ret, 3, low);
+    SET_VECTOR_ELT(ret, 4, high);
+    UNPROTECT(5);
+
+    free_box_tree_facets(f);
+    free(labels);
+
+    UNPROTECT(1);
+    return ret;
+  }
+
+  SEXP levelset_components(SEXP inset_boxes, SEXP non_inset_boxes, SEXP d,
+			   SEXP inset) {
+    /* Find the connected components of the inset (or non-inset) region of
+     * a levelset estimate.
+     *
+     * Args:
+     *   inset_boxes: list of inset boxes, as returned by estimate_levelset.
+     *   non_inset_boxes: list of non-inset boxes.
+     *   d: integer, number of dimensions.
+     *   inset: logical, find components of the inset boxes if TRUE, of the
+     *     non-inset boxes otherwise.
+     * Returns:
+     *   list containing:
+     *     'component' - component of each box in the requested list
+     *        (1-relative).
+     *     'n_boxes' - number of boxes in each component.
+     *     'n_points' - number of points in each component, NA when its
+     *        boxes were made without their point indexes.
+     *     'volume' - volume of each component.
+     *     'lower' - matrix, lower corner of the bounding box of each
+     *        component, one row per component.
+     *     'upper' - matrix, upper corner of the bounding box of each
+     *        component.
+     */
+    if (TYPEOF(inset_boxes) != VECSXP || TYPEOF(non_inset_boxes) != VECSXP) {
+      error("inset_boxes and non_inset_boxes must be lists.");
+    }
+    if (LENGTH(d) != 1 || TYPEOF(d) != INTSXP) {
+      error("d must be a single integer value.");
+    }
+    if (LENGTH(inset) != 1 || TYPEOF(inset) != LGLSXP) {
+      error("inset must be a single logical value.");
+    }
+
+    int n_inset = LENGTH(inset_boxes);
+    int n_leaves = n_inset + LENGTH(non_inset_boxes);
+    int n_dim = INTEGER(d)[0];
+    int label = LOGICAL(inset)[0] ? 1 : 0;
+    /* The requested boxes are either the first n_inset leaves or the rest
+     * of them. */
+    SEXP boxes = label ? inset_boxes : non_inset_boxes;
+    int offset = label ? 0 : n_inset;
+    int n_boxes = LENGTH(boxes);
+
+    /* Everything is checked before the arrays are allocated, error() would
+     * leak them. */
+    check_box_lists(inset_boxes);
+    check_box_lists(non_inset_boxes);
+    for (int i = 0; i < n_boxes; i++) {
+      SEXP box_matrix = get_list_element(VECTOR_ELT(boxes, i), "box");
+      if (TYPEOF(box_matrix) != REALSXP || LENGTH(box_matrix) != 2 * n_dim) {
+	error("box must be a 2 x d numeric matrix.");
+      }
+    }
+
+    int *labels = (int *)malloc(sizeof(int) * (n_leaves + 1));
+    int *component = (int *)malloc(sizeof(int) * (n_leaves + 1));
+    box_tree *tree = boxes_to_tree(inset_boxes, non_inset_boxes, n_dim, 
+				   labels);
+    if (!tree) {
+      free(labels);
+      free(component);
+      error("levelset boxes overlap or have the wrong dimension.");
+    }
+    int n_components = find_components(tree, labels, label, component);
+    free_box_tree(tree);
+
+    SEXP ret, ret_names, box_component, size, n_points, volume, lower, 
+      upper;
+    PROTECT(ret = allocVector(VECSXP, 6));
+    PROTECT(ret_names = allocVector(STRSXP, 6));
+    SET_STRING_ELT(ret_names, 0, mkChar("component"));
+    SET_STRING_ELT(ret_names, 1, mkChar("n_boxes"));
+    SET_STRING_ELT(ret_names, 2, mkChar("n_points"));
+    SET_STRING_ELT(ret_names, 3, mkChar("volume"));
+    SET_STRING_ELT(ret_names, 4, mkChar("lower"));
+    SET_STRING_ELT(ret_names, 5, mkChar("upper"));
+    Rf_namesgets(ret, ret_names);
+    UNPROTECT(1);
+
+    PROTECT(box_component = allocVector(INTSXP, n_boxes));
+    PROTECT(size = allocVector(INTSXP, n_components));
+    PROTECT(n_points = allocVector(INTSXP, n_components));
+    PROTECT(volume = allocVector(REALSXP, n_components));
+    PROTECT(lower = allocMatrix(REALSXP, n_components, n_dim));
+    PROTECT(upper = allocMatrix(REALSXP, n_components, n_dim));
+    for (int c = 0; c < n_components; c++) {
+      INTEGER(size)[c] = 0;
+      INTEGER(n_points)[c] = 0;
+      REAL(volume)[c] = 0;
+    }
+
+    /* Summaries use the box corners, which are already in the original
+     * coordinates of the points. */
+    for (int i = 0; i < n_boxes; i++) {
+      int c = component[i + offset];
+      SEXP box_list = VECTOR_ELT(boxes, i);
+      SEXP box_matrix = get_list_element(box_list, "box");
+      INTEGER(box_component)[i] = c + 1;
+      INTEGER(size)[c]++;
+      /* Boxes made with point.indices="none" don't say how many points
+       * they hold. */
+      SEXP box_i = get_list_element(box_list, "i");
+      if (TYPEOF(box_i) != INTSXP) {
+	INTEGER(n_points)[c] = NA_INTEGER;
+      } else if (INTEGER(n_points)[c] != NA_INTEGER) {
+	INTEGER(n_points)[c] += LENGTH(box_i);
+      }
+
+      double box_volume = 1;
+      for (int j = 0; j < n_dim; j++) {
+	double x1 = REAL(box_matrix)[j * 2];
+	double x2 = REAL(box_matrix)[j * 2 + 1];
+	box_volume *= x2 - x1;
+	if (INTEGER(size)[c] == 1 || x1 < REAL(lower)[c + j * n_components]) {
+	  REAL(lower)[c + j * n_components] = x1;
+	}
+	if (INTEGER(size)[c] == 1 || x2 > REAL(upper)[c + j * n_components]) {
+	  REAL(upper)[c + j * n_components] = x2;
+	}
+      }
+      REAL(volume)[c] += box_volume;
+    }
+    SET_VECTOR_ELT(ret, 0, box_component);
+    SET_VECTOR_ELT(ret, 1, size);
+    SET_VECTOR_ELT(ret, 2, n_points);
+    SET_VECTOR_ELT(ret, 3, volume);
+    SET_VECTOR_ELT(ret, 4, lower);
+    SET_VECTOR_ELT(ret, 5, upper);
+    UNPROTECT(6);
+
+    free(labels);
+    free(component);
+
+    UNPROTECT(1);
+    return ret;
+  }
+
+  SEXP levelset_raster(SEXP inset_boxes, SEXP non_inset_boxes, SEXP k_max,
+		       SEXP cell_lo, SEXP cell_hi, SEXP res, SEXP type) {
+    /* Rasterize a levelset estimate onto the finest dyadic lattice.
+     *
+     * Args:
+     *   inset_boxes: list of inset boxes, as returned by estimate_levelset.
+     *   non_inset_boxes: list of non-inset boxes.
+     *   k_max: integer vector, number of splits in the finest lattice in
+     *     each dimension.
+     *   cell_lo: integer vector, first lattice cell of the window in each
+     *     dimension (0-relative).
+     *   cell_hi: integer vector, one past the last cell of the window.
+     *   res: integer vector, number of pixels along each dimension.
+     *   type: integer, 0 for labels (0 empty, 1 non-inset, 2 inset), 1 for
+     *     the inset risk of each pixel (NA for empty space) and 2 for a
+     *     bitmap of the inset pixels.
+     * Returns:
+     *   array with dim res of labels (raw) or risks (numeric), or for
+     *   bitmaps a raw vector with one bit per pixel.
+     */
+    if (TYPEOF(inset_boxes) != VECSXP || TYPEOF(non_inset_boxes) != VECSXP) {
+      error("inset_boxes and non_inset_boxes must be lists.");
+    }
+    int d = LENGTH(res);
+    check_k_max(k_max, d);
+    for (int j = 0; j < d; j++) {
+      if (INTEGER(k_max)[j] > MAX_RASTER_SPLITS) {
+	error("k_max can be at most %d to rasterize.", MAX_RASTER_SPLITS);
+      }
+    }
+    if (TYPEOF(cell_lo) != INTSXP || TYPEOF(cell_hi) != INTSXP ||
+	TYPEOF(res) != INTSXP || LENGTH(cell_lo) != d || 
+	LENGTH(cell_hi) != d) {
+      error("cell_lo, cell_hi and res must be integer vectors of length d.");
+    }
+    if (LENGTH(type) != 1 || TYPEOF(type) != INTSXP) {
+      error("type must be a single integer value.");
+    }
+    check_box_lists(inset_boxes);
+    check_box_lists(non_inset_boxes);
+
+    raster_window *w = new_raster_window(d, INTEGER(k_max));
+    for (int j = 0; j < d; j++) {
+      w->cell_lo[j] = INTEGER(cell_lo)[j];
+      w->cell_hi[j] = INTEGER(cell_hi)[j];
+      w->res[j] = INTEGER(res)[j];
+      if (w->cell_lo[j] < 0 || w->cell_hi[j] <= w->cell_lo[j] || 
+	  w->cell_hi[j] > 1 << w->kmax[j] || w->res[j] <= 0) {
+	free_raster_window(w);
+	error("raster window is outside of the lattice.");
+      }
+    }
+
+    int n_inset = LENGTH(inset_boxes);
+    int n_boxes = n_inset + LENGTH(non_inset_boxes);
+    box_split **boxes = (box_split **)malloc(sizeof(box_split *) * 
+					     (n_boxes + 1));
+    unsigned char *labels = (unsigned char *)malloc(n_boxes + 1);
+    double *risks = (double *)malloc(sizeof(double) * (n_boxes + 1));
+    for (int i = 0; i < n_boxes; i++) {
+      SEXP box_list = i < n_inset ? VECTOR_ELT(inset_boxes, i) :
+	VECTOR_ELT(non_inset_boxes, i - n_inset);
+      boxes[i] = list_to_box_split(box_list);
+      labels[i] = i < n_inset ? 2 : 1;
+      SEXP risk = get_list_element(box_list, "risk");
+      risks[i] = TYPEOF(risk) == REALSXP && LENGTH(risk) == 1 ? 
+	REAL(risk)[0] : NA_REAL;
+    }
+
+    long n_pixels = raster_size(w);
+    SEXP ret, ret_dim;
+    if (INTEGER(type)[0] == 1) {
+      PROTECT(ret = allocVector(REALSXP, n_pixels));
+      for (long i = 0; i < n_pixels; i++) {
+	REAL(ret)[i] = NA_REAL;
+      }
+      rasterize_values(w, boxes, n_boxes, risks, REAL(ret));
+    } else {
+      unsigned char *grid = (unsigned char *)malloc(n_pixels);
+      memset(grid, 0, n_pixels);
+      rasterize_labels(w, boxes, n_boxes, labels, grid);
+      if (INTEGER(type)[0] == 2) {
+	PROTECT(ret = allocVector(RAWSXP, (n_pixels + 7) / 8));
+	pack_raster_bits(grid, n_pixels, 2, RAW(ret));
+      } else {
+	PROTECT(ret = allocVector(RAWSXP, n_pixels));
+	memcpy(RAW(ret), grid, n_pixels);
+      }
+      free(grid);
+    }
+
+    if (INTEGER(type)[0] != 2) {
+      PROTECT(ret_dim = allocVector(INTSXP, d));
+      memcpy(INTEGER(ret_dim), w->res, sizeof(int) * d);
+      Rf_setAttrib(ret, R_DimSymbol, ret_dim);
+      UNPROTECT(1);
+    }
+
+    for (int i = 0; i < n_boxes; i++) {
+      free_box_split(boxes[i]);
+    }
+    free(boxes);
+    free(labels);
+    free(risks);
+    free_raster_window(w);
+
+    UNPROTECT(1);
+    return ret;
+  }
 
   SEXP get_boxes(SEXP X, SEXP k_max) {
     SEXP ans, dim;
@@ -18,19 +490,17 @@ extern "C" {
       error("X must be a 2 dimensional matrix.");
     }
   
-    if (LENGTH(k_max) != 1 || TYPEOF(k_max) != INTSXP) {
-      error("k_max must be an integer of length 1.");
-    }
+    check_k_max(k_max, INTEGER(dim)[1]);
   
     pc = points_to_boxes(REAL(X), INTEGER(dim)[0], INTEGER(dim)[1], 
-			 INTEGER(k_max)[0]);
+			 INTEGER(k_max));
   
     /* Copy boxes out to a list. */
     int boxCount = box_collection_size(pc);
     PROTECT(ans = allocVector(VECSXP, boxCount));
     box **boxes = list_boxes(pc);
     for (int i = 0; i < boxCount; i++) {
-      SET_VECTOR_ELT(ans, i, box_to_list(boxes[i]));
+      SET_VECTOR_ELT(ans, i, box_to_list(boxes[i], POINT_INDICES_FULL));
     }
     free(boxes);
   
@@ -42,34 +512,44 @@ extern "C" {
   }
 
 
-  SEXP box_to_list(box *p) {
+  SEXP box_to_list(box *p, int points) {
     /* Convert a box to an R list.
      * 
      * Args:
      *   p: pointer to box to convert.
+     *   points: POINT_INDICES_FULL to copy the indexes of the points, or
+     *     POINT_INDICES_NONE to leave them out.
      * Returns:
      *   list containing: 
-     *     'i' - indexes of points in the box (1-relative).
+     *     'i' - indexes of points in the box (1-relative), NULL for
+     *        POINT_INDICES_NONE.
+     *     'splits' - splits in each dimension, 1 for left and 2 for right.
      *     'box' - coordinates of the corners of the box.
+     *     'risk' - inset risk of the box.
      */
     SEXP box_list, box_list_names, box_i, box_X, box_splits, tmp_splits, 
       box_matrix;
 
-    PROTECT(box_list = allocVector(VECSXP, 3));
+    PROTECT(box_list = allocVector(VECSXP, 4));
 
-    PROTECT(box_list_names = allocVector(STRSXP, 3));
+    PROTECT(box_list_names = allocVector(STRSXP, 4));
     SET_STRING_ELT(box_list_names, 0, mkChar("i"));
     SET_STRING_ELT(box_list_names, 1, mkChar("splits"));
     SET_STRING_ELT(box_list_names, 2, mkChar("box"));
+    SET_STRING_ELT(box_list_names, 3, mkChar("risk"));
     Rf_namesgets(box_list, box_list_names);
     UNPROTECT(1);
 
     /* Copy the indexes of the points in this box to box$i. */
     int n_points = p->points->size();
-    PROTECT(box_i = allocVector(INTSXP, n_points));
-    for (int i = 0; i < n_points; i++) {
-      /* Convert points to 1-relative for R. */
-      INTEGER(box_i)[i] = p->points->at(i) + 1;
+    if (points == POINT_INDICES_FULL) {
+      PROTECT(box_i = allocVector(INTSXP, n_points));
+      for (int i = 0; i < n_points; i++) {
+	/* Convert points to 1-relative for R. */
+	INTEGER(box_i)[i] = p->points->at(i) + 1;
+      }
+    } else {
+      PROTECT(box_i = R_NilValue);
     }
     SET_VECTOR_ELT(box_list, 0, box_i);
     UNPROTECT(1);
@@ -101,16 +581,19 @@ extern "C" {
     SET_VECTOR_ELT(box_list, 2, box_matrix);
     UNPROTECT(1);
 
+    SET_VECTOR_ELT(box_list, 3, ScalarReal(p->risk.inset_risk));
+
     UNPROTECT(1);
     return box_list;
   }
 
-  SEXP get_boxes_list(box **p, int n) {
+  SEXP get_boxes_list(box **p, int n, int points) {
     /* Convert an array of boxes into an R list of Boxes. 
      *
      * Args:
      *   p: array of box pointers.
      *   n: integer, length of array.
+     *   points: as for box_to_list.
      * Returns:
      *   R list containing the converted boxes.
      */
@@ -118,31 +601,290 @@ extern "C" {
     PROTECT(box_list = allocVector(VECSXP, n));
   
     for (int i = 0; i < n; i++) {
-      SET_VECTOR_ELT(box_list, i, box_to_list(p[i]));
+      SET_VECTOR_ELT(box_list, i, box_to_list(p[i], points));
     }
   
     UNPROTECT(1);
     return box_list;
   }
 
-  SEXP estimate_levelset(SEXP X, SEXP Y, SEXP k_max, SEXP gamma, SEXP delta,
-			 SEXP rho) {
-    /* Compute a levelset estimation. 
+  SEXP levelset_estimate_to_list(levelset_estimate *le, const r_output *out) {
+    /* Convert a levelset estimate to an R list and free its boxes.
      *
      * Args:
-     *   X: matrix of the X points, each row contains one point.  Columns 
-     *      represent the different dimensions.
-     *   Y: vector of the response variables.
-     *   k_max: integer, maximum number of splits to consider.
-     *   gamma: double, level of the level set.
-     *   delta: double, complexity factor.
-     *   rho: double, cost penalty.
-     * Returns: levelset estimate.
+     *   le: pointer to the levelset estimate.
+     *   out: pointer to the output options, for the point indexes.
+     * Returns:
+     *   list with the total cost, the number of boxes, a list of inset boxes
+     *   and a list of non-inset boxes.
+     */
+    /* Make return list, has total cost, number of boxes left, a list for inset boxes, and a 
+     * list for non-inset boxes. */
+    SEXP ret, ret_names;
+    PROTECT(ret = allocVector(VECSXP, 4));
+    PROTECT(ret_names = allocVector(STRSXP, 4));
+
+    SET_STRING_ELT(ret_names, 0, mkChar("total_cost"));
+    SEXP total_cost;
+    PROTECT(total_cost = Rf_allocVector(REALSXP, 1));
+    REAL(total_cost)[0] = le->total_cost;
+    SET_VECTOR_ELT(ret, 0, total_cost);
+    UNPROTECT(1);
+  
+    SET_STRING_ELT(ret_names, 1, mkChar("num_boxes"));
+    SEXP num_boxes;
+    PROTECT(num_boxes = Rf_allocVector(REALSXP, 1));
+    REAL(num_boxes)[0] = le->num_inset + le->num_non_inset;
+    SET_VECTOR_ELT(ret, 1, num_boxes);
+    UNPROTECT(1);
+  
+    SET_STRING_ELT(ret_names, 2, mkChar("inset_boxes"));
+    SEXP inset_boxes;
+    PROTECT(inset_boxes = get_boxes_list(le->inset_boxes, le->num_inset,
+					 out->points));
+    SET_VECTOR_ELT(ret, 2, inset_boxes);
+    UNPROTECT(1);
+  
+    SET_STRING_ELT(ret_names, 3, mkChar("non_inset_boxes"));
+    SEXP non_inset_boxes;
+    PROTECT(non_inset_boxes = get_boxes_list(le->non_inset_boxes,
+					     le->num_non_inset, out->points));
+    SET_VECTOR_ELT(ret, 3, non_inset_boxes);
+    UNPROTECT(1);
+  
+    Rf_namesgets(ret, ret_names);
+    UNPROTECT(2);
+
+    free_levelset_estimate(le);
+    return ret;
+  }
+
+  r_output output_from_r(SEXP output, int d) {
+    /* Check the output options of an estimation.
+     *
+     * Args:
+     *   output: list containing:
+     *     'columns' - NULL for box lists, or the transform returned by
+     *        transform.X, a list with the 'offset' and 'scale' of each of
+     *        the d dimensions, for columnar boxes in the coordinates of X.
+     *     'points' - integer, POINT_INDICES_FULL or POINT_INDICES_NONE,
+     *        whether to return the indexes of the points of each box.
+     *   d: integer, number of dimensions.
+     * Returns:
+     *   r_output, its pointers point into output.
+     */
+    r_output out = {0, NULL, NULL, POINT_INDICES_FULL};
+    SEXP columns = TYPEOF(output) == VECSXP ?
+      get_list_element(output, "columns") : R_NilValue;
+    SEXP points = TYPEOF(output) == VECSXP ?
+      get_list_element(output, "points") : R_NilValue;
+    if (TYPEOF(points) != INTSXP || LENGTH(points) != 1 ||
+	INTEGER(points)[0] < POINT_INDICES_FULL ||
+	INTEGER(points)[0] > POINT_INDICES_NONE) {
+      error("output must be a list with the point index mode in 'points'.");
+    }
+    out.points = INTEGER(points)[0];
+    if (columns == R_NilValue) {
+      return out;
+    }
+    SEXP offset = TYPEOF(columns) == VECSXP ?
+      get_list_element(columns, "offset") : R_NilValue;
+    SEXP scale = TYPEOF(columns) == VECSXP ?
+      get_list_element(columns, "scale") : R_NilValue;
+    if (TYPEOF(offset) != REALSXP || LENGTH(offset) != d ||
+	TYPEOF(scale) != REALSXP || LENGTH(scale) != d) {
+      error("output columns must be NULL or a transform with one offset "
+	    "and scale per dimension.");
+    }
+    out.columnar = 1;
+    out.offset = REAL(offset);
+    out.scale = REAL(scale);
+    return out;
+  }
+
+  SEXP levelset_estimate_to_columns(levelset_estimate *le,
+				    const r_output *out) {
+    /* Convert a levelset estimate to an R list with its boxes as columns
+     * and free its boxes.  Building one list per box costs more than the
+     * estimate itself once there are many boxes.
+     *
+     * Args:
+     *   le: pointer to the levelset estimate.
+     *   out: pointer to the output options, with the transform of X.
+     * Returns:
+     *   list with the total cost, the number of boxes and 'boxes', a list
+     *   containing, for the inset boxes and then the non-inset boxes:
+     *     'bounds' - n_boxes x 2d matrix, the lower corner of each box
+     *        then its upper corner, in the coordinates of X.
+     *     'nsplit' - n_boxes x d integer matrix, number of splits in each
+     *        dimension.
+     *     'split' - n_boxes x 2d matrix, the low 32 bits of the split of
+     *        each dimension then its high 32 bits, as doubles.  Bit i is
+     *        set when split i of the dimension, coarsest first, is to the
+     *        right.
+     *     'inset' - logical, is each box inset.
+     *     'risk' - inset risk of each box.
+     *     'cost' - complexity cost of each box.
+     *     'point_start' - integer, the points of box i are
+     *        points[point_start[i] + 1:point_start[i + 1]], n_boxes + 1
+     *        long.
+     *     'points' - integer, indexes of the points of every box
+     *        (1-relative), NULL for POINT_INDICES_NONE.
+     *   The caller must check the estimate with columnar_fits first.
      */
-    /* Make sure that k_max, gamma, delta and rho are scalars. */
-    if (LENGTH(k_max) != 1 || TYPEOF(k_max) != INTSXP) {
-      error("k_max must be a single integer value.");
+    int d = le->la.d;
+    int n_boxes = le->num_inset + le->num_non_inset;
+    long n_points = 0;
+    for (int i = 0; i < n_boxes; i++) {
+      box *p = i < le->num_inset ? le->inset_boxes[i] :
+	le->non_inset_boxes[i - le->num_inset];
+      n_points += p->points->size();
+    }
+
+    SEXP ret, ret_names, boxes, boxes_names, bounds, nsplit, split, inset,
+      risk, cost, point_start, points;
+    PROTECT(ret = allocVector(VECSXP, 3));
+    PROTECT(ret_names = allocVector(STRSXP, 3));
+    SET_STRING_ELT(ret_names, 0, mkChar("total_cost"));
+    SET_STRING_ELT(ret_names, 1, mkChar("num_boxes"));
+    SET_STRING_ELT(ret_names, 2, mkChar("boxes"));
+    Rf_namesgets(ret, ret_names);
+    UNPROTECT(1);
+    SET_VECTOR_ELT(ret, 0, ScalarReal(le->total_cost));
+    SET_VECTOR_ELT(ret, 1, ScalarReal(n_boxes));
+
+    PROTECT(boxes = allocVector(VECSXP, 8));
+    PROTECT(boxes_names = allocVector(STRSXP, 8));
+    SET_STRING_ELT(boxes_names, 0, mkChar("bounds"));
+    SET_STRING_ELT(boxes_names, 1, mkChar("nsplit"));
+    SET_STRING_ELT(boxes_names, 2, mkChar("split"));
+    SET_STRING_ELT(boxes_names, 3, mkChar("inset"));
+    SET_STRING_ELT(boxes_names, 4, mkChar("risk"));
+    SET_STRING_ELT(boxes_names, 5, mkChar("cost"));
+    SET_STRING_ELT(boxes_names, 6, mkChar("point_start"));
+    SET_STRING_ELT(boxes_names, 7, mkChar("points"));
+    Rf_namesgets(boxes, boxes_names);
+    UNPROTECT(1);
+    SET_VECTOR_ELT(ret, 2, boxes);
+
+    PROTECT(bounds = allocMatrix(REALSXP, n_boxes, 2 * d));
+    PROTECT(nsplit = allocMatrix(INTSXP, n_boxes, d));
+    PROTECT(split = allocMatrix(REALSXP, n_boxes, 2 * d));
+    PROTECT(inset = allocVector(LGLSXP, n_boxes));
+    PROTECT(risk = allocVector(REALSXP, n_boxes));
+    PROTECT(cost = allocVector(REALSXP, n_boxes));
+    PROTECT(point_start = allocVector(INTSXP, n_boxes + 1));
+    if (out->points == POINT_INDICES_FULL) {
+      PROTECT(points = allocVector(INTSXP, n_points));
+    } else {
+      PROTECT(points = R_NilValue);
+    }
+    int at = 0;
+    for (int i = 0; i < n_boxes; i++) {
+      box *p = i < le->num_inset ? le->inset_boxes[i] :
+	le->non_inset_boxes[i - le->num_inset];
+      for (int j = 0; j < d; j++) {
+	double x1, x2;
+	split_to_interval(p->split, j, &x1, &x2);
+	/* The same arithmetic as inverse.transform.X. */
+	REAL(bounds)[i + j * n_boxes] = x1 * out->scale[j] + out->offset[j];
+	REAL(bounds)[i + (d + j) * n_boxes] = x2 * out->scale[j] +
+	  out->offset[j];
+	INTEGER(nsplit)[i + j * n_boxes] = p->split->nsplit[j];
+	/* R has no 64 bit integers, each half is exact in a double. */
+	REAL(split)[i + j * n_boxes] =
+	  (double)(p->split->split[j] & 0xffffffffULL);
+	REAL(split)[i + (d + j) * n_boxes] =
+	  (double)(p->split->split[j] >> 32);
+      }
+      LOGICAL(inset)[i] = i < le->num_inset;
+      REAL(risk)[i] = p->risk.inset_risk;
+      REAL(cost)[i] = p->risk.cost;
+      INTEGER(point_start)[i] = at;
+      if (out->points == POINT_INDICES_FULL) {
+	for (size_t k = 0; k < p->points->size(); k++) {
+	  INTEGER(points)[at + k] = p->points->at(k) + 1;
+	}
+      }
+      at += p->points->size();
     }
+    INTEGER(point_start)[n_boxes] = at;
+    SET_VECTOR_ELT(boxes, 0, bounds);
+    SET_VECTOR_ELT(boxes, 1, nsplit);
+    SET_VECTOR_ELT(boxes, 2, split);
+    SET_VECTOR_ELT(boxes, 3, inset);
+    SET_VECTOR_ELT(boxes, 4, risk);
+    SET_VECTOR_ELT(boxes, 5, cost);
+    SET_VECTOR_ELT(boxes, 6, point_start);
+    SET_VECTOR_ELT(boxes, 7, points);
+    UNPROTECT(10);
+
+    free_levelset_estimate(le);
+    return ret;
+  }
+
+  int columnar_fits(levelset_estimate *les, int n, const r_output *out) {
+    /* Whether n estimates can be converted as out asks: columnar boxes
+     * index their points with R integers, so each estimate can have at
+     * most INT_MAX of them.  Callers check every estimate before
+     * converting any, so they can free them all before an error. */
+    for (int k = 0; k < n && out->columnar; k++) {
+      long n_points = 0;
+      for (int i = 0; i < les[k].num_inset + les[k].num_non_inset; i++) {
+	box *p = i < les[k].num_inset ? les[k].inset_boxes[i] :
+	  les[k].non_inset_boxes[i - les[k].num_inset];
+	n_points += p->points->size();
+      }
+      if (n_points > INT_MAX) {
+	return 0;
+      }
+    }
+    return 1;
+  }
+
+  SEXP levelset_estimate_to_r(levelset_estimate *le, const r_output *out) {
+    /* Convert a levelset estimate to box lists or columns, as out asks,
+     * and free its boxes. */
+    return out->columnar ? levelset_estimate_to_columns(le, out) :
+      levelset_estimate_to_list(le, out);
+  }
+
+  void check_estimates_fit(vector<levelset_estimate> &les,
+			   const r_output *out) {
+    /* Signal an error if the estimates can't be converted as out asks,
+     * after freeing them all and the vector's storage. */
+    if (!columnar_fits(les.empty() ? NULL : &les[0], les.size(), out)) {
+      for (size_t k = 0; k < les.size(); k++) {
+	free_levelset_estimate(&les[k]);
+      }
+      vector<levelset_estimate>().swap(les);
+      error("too many points for columnar boxes.");
+    }
+  }
+
+  SEXP estimates_to_r(vector<levelset_estimate> &les, const r_output *out) {
+    /* Convert estimates to an R list of them, as out asks, freeing their
+     * boxes. */
+    check_estimates_fit(les, out);
+    SEXP ret;
+    PROTECT(ret = allocVector(VECSXP, les.size()));
+    for (size_t k = 0; k < les.size(); k++) {
+      SET_VECTOR_ELT(ret, k, levelset_estimate_to_r(&les[k], out));
+    }
+    UNPROTECT(1);
+    return ret;
+  }
+
+  /* Kinds of X for args_from_r. */
+#define X_DOUBLE 0  /* Double matrix of points in the unit cube. */
+#define X_FLOAT  1  /* Data slot of a float32 matrix. */
+#define X_CELLS  2  /* Integer or raw matrix of cell coordinates. */
+
+  static levelset_args args_from_r(SEXP X, SEXP Y, SEXP k_max, SEXP gamma,
+				   SEXP delta, SEXP rho, int x_kind) {
+    /* The body of levelset_args_from_r and its variants for the other
+     * kinds of X, Y may hold floats unless X is X_DOUBLE. */
+    /* Make sure that gamma, delta and rho are scalars. */
     if (LENGTH(gamma) != 1 || TYPEOF(gamma) != REALSXP) {
       error("gamma must be a single numeric value.");
     }
@@ -165,71 +907,810 @@ extern "C" {
     la.d = INTEGER(dim)[1];
     UNPROTECT(1);
   
-    if (TYPEOF(Y) != REALSXP || LENGTH(Y) != la.n) {
+    if ((TYPEOF(Y) != REALSXP &&
+	 (x_kind == X_DOUBLE || TYPEOF(Y) != INTSXP)) ||
+	LENGTH(Y) != la.n) {
       error("Y must be a vector with length(Y) == dim(X)[1]");
     }
+    if (x_kind == X_FLOAT && TYPEOF(X) != INTSXP) {
+      error("X must be the Data slot of a float32 matrix.");
+    }
+    if (x_kind == X_CELLS && TYPEOF(X) != INTSXP && TYPEOF(X) != RAWSXP) {
+      error("X must be an integer or raw matrix.");
+    }
+    check_k_max(k_max, la.d);
   
-    /* Compute the levelset. */
-    la.kmax  = INTEGER(k_max)[0];
-    la.x     = REAL(X);
-    la.y     = REAL(Y);
+    la.kmax  = INTEGER(k_max);
+    la.x     = x_kind == X_DOUBLE ? REAL(X) : NULL;
+    la.y     = TYPEOF(Y) == REALSXP ? REAL(Y) : NULL;
+    la.xf    = x_kind == X_FLOAT ? (const float *)INTEGER(X) : NULL;
+    la.yf    = la.y ? NULL : (const float *)INTEGER(Y);
+    la.cells = NULL;
+    if (x_kind == X_CELLS) {
+      la.cells = TYPEOF(X) == RAWSXP ? (const void *)RAW(X) :
+	(const void *)INTEGER(X);
+      la.cell_bytes = TYPEOF(X) == RAWSXP ? 1 : sizeof(int);
+    }
     la.gamma = REAL(gamma)[0];
     la.delta = REAL(delta)[0];
     la.rho   = REAL(rho)[0];
+    return la;
+  }
 
-    /* Bucket everything up into a box collection. */
-    levelset_estimate le = compute_levelset(points_to_boxes(la.x, la.n, la.d, 
-							    la.kmax),
-					    la);
+  levelset_args levelset_args_from_r(SEXP X, SEXP Y, SEXP k_max, SEXP gamma,
+				     SEXP delta, SEXP rho) {
+    /* Check the arguments of a levelset estimation and convert them to
+     * levelset_args.  The kmax, x and y pointers point into k_max, X and
+     * Y. */
+    return args_from_r(X, Y, k_max, gamma, delta, rho, X_DOUBLE);
+  }
 
-    /* Make return list, has total cost, number of boxes left, a list for inset boxes, and a 
-     * list for non-inset boxes. */
+  levelset_args float_levelset_args_from_r(SEXP X, SEXP Y, SEXP offset,
+					   SEXP scale, SEXP k_max,
+					   SEXP gamma, SEXP delta, SEXP rho) {
+    /* levelset_args_from_r for single precision points.  X is the integer
+     * Data slot of a float32 matrix from the float package, which holds
+     * the bits of the floats, in the original coordinates of the points;
+     * offset and scale map them into the unit cube.  Y is a double vector
+     * or the Data slot of a float32 vector.  The pointers point into the
+     * arguments. */
+    levelset_args la = args_from_r(X, Y, k_max, gamma, delta, rho, X_FLOAT);
+    if (TYPEOF(offset) != REALSXP || LENGTH(offset) != la.d ||
+	TYPEOF(scale) != REALSXP || LENGTH(scale) != la.d) {
+      error("offset and scale must be numeric vectors with one value per "
+	    "column of X.");
+    }
+    la.offset = REAL(offset);
+    la.scale  = REAL(scale);
+    return la;
+  }
+
+  levelset_args cells_levelset_args_from_r(SEXP X, SEXP Y, SEXP k_max,
+					   SEXP gamma, SEXP delta, SEXP rho) {
+    /* levelset_args_from_r for points given by their finest boxes.  X is an
+     * integer or raw matrix of cell coordinates, see points_to_boxes_cells,
+     * Y is as for float_levelset_args_from_r.  Every coordinate is checked
+     * against k_max. */
+    levelset_args la = args_from_r(X, Y, k_max, gamma, delta, rho, X_CELLS);
+    for (int j = 0; j < la.d; j++) {
+      /* Raw cells are below 2^8, integer cells below 2^31 unless NA. */
+      int k = la.kmax[j];
+      if (TYPEOF(X) == RAWSXP && k >= 8) {
+	continue;
+      }
+      long long limit = k >= 31 ? INT_MAX : (1LL << k) - 1;
+      for (int i = 0; i < la.n; i++) {
+	long long cell = TYPEOF(X) == RAWSXP ?
+	  (long long)RAW(X)[(size_t)j * la.n + i] :
+	  (long long)INTEGER(X)[(size_t)j * la.n + i];
+	if (cell < 0 || cell > limit) {
+	  error("cell coordinates of column %d must be between 0 and "
+		"2^k_max - 1 = %lld.", j + 1, limit);
+	}
+      }
+    }
+    return la;
+  }
+
+  void levelset_control_from_r(levelset_control *control, SEXP checkpoint,
+			       SEXP memory_budget, SEXP scratch) {
+    /* Check the run options of a levelset estimation and convert them to
+     * a levelset_control.  The paths point into the R strings. */
+    if (checkpoint != R_NilValue &&
+	(LENGTH(checkpoint) != 1 || TYPEOF(checkpoint) != STRSXP)) {
+      error("checkpoint must be NULL or a single file name.");
+    }
+    if (LENGTH(memory_budget) != 1 || TYPEOF(memory_budget) != REALSXP) {
+      error("memory_budget must be a single numeric value.");
+    }
+    if (scratch != R_NilValue &&
+	(LENGTH(scratch) != 1 || TYPEOF(scratch) != STRSXP)) {
+      error("scratch must be NULL or a single file name.");
+    }
+
+    init_levelset_control(control);
+    control->memory_budget = REAL(memory_budget)[0];
+    if (checkpoint != R_NilValue) {
+      control->checkpoint_path = CHAR(STRING_ELT(checkpoint, 0));
+    }
+    if (scratch != R_NilValue) {
+      control->scratch_path = CHAR(STRING_ELT(scratch, 0));
+    }
+  }
+
+  static void check_interrupt(void *) {
+    R_CheckUserInterrupt();
+  }
+
+  int pending_interrupt() {
+    /* Check for a user interrupt without jumping out of the caller.  The
+     * interrupt is used up, the caller has to signal its own error. */
+    return !R_ToplevelExec(check_interrupt, NULL);
+  }
+
+  SEXP collect_levelset_job(levelset_job *job, const r_output *out) {
+    /* Convert the estimate of a finished job to an R list, as out asks,
+     * passing on its warnings, and free the job.  Signals an error if the
+     * job did not finish its run.  The job is freed before any warning,
+     * which options(warn=2) turns into an error. */
+    int status;
+    vector<std::string> warnings;
+    levelset_estimate *le = levelset_job_estimate(job, &status, &warnings);
+    SEXP ret = R_NilValue;
+    if (status == LEVELSET_DONE && columnar_fits(le, 1, out)) {
+      ret = levelset_estimate_to_r(le, out);
+    }
+    PROTECT(ret);
+    free_levelset_job(job);
+    /* The warnings move to R memory, which an error does not leak. */
+    SEXP messages;
+    PROTECT(messages = allocVector(STRSXP, warnings.size()));
+    for (size_t i = 0; i < warnings.size(); i++) {
+      SET_STRING_ELT(messages, i, mkChar(warnings[i].c_str()));
+    }
+    vector<std::string>().swap(warnings);
+    for (int i = 0; i < LENGTH(messages); i++) {
+      warning("%s", CHAR(STRING_ELT(messages, i)));
+    }
+    if (status == LEVELSET_CANCELLED) {
+      error("the levelset estimation was cancelled.");
+    } else if (status != LEVELSET_DONE) {
+      error("unable to read levels back from the scratch file.");
+    } else if (ret == R_NilValue) {
+      error("too many points for columnar boxes.");
+    }
+    UNPROTECT(2);
+    return ret;
+  }
+
+  static SEXP run_levelset_r(levelset_args la, SEXP checkpoint,
+			     SEXP memory_budget, SEXP scratch, SEXP output) {
+    /* The run of estimate_levelset and estimate_levelset_float. */
+    levelset_control control;
+    levelset_control_from_r(&control, checkpoint, memory_budget, scratch);
+    r_output out = output_from_r(output, la.d);
+
+    /* The estimate runs on a worker thread so that this thread can keep
+     * checking for user interrupts.  On an interrupt the run is cancelled
+     * and cleaned up before R unwinds. */
+    levelset_job *job = start_levelset_job(la, &control, 0);
+    while (!wait_levelset_job(job, 100)) {
+      if (pending_interrupt()) {
+	free_levelset_job(job);
+	error("the levelset estimation was interrupted.");
+      }
+    }
+    return collect_levelset_job(job, &out);
+  }
+
+  SEXP estimate_levelset(SEXP X, SEXP Y, SEXP k_max, SEXP gamma, SEXP delta,
+			 SEXP rho, SEXP checkpoint, SEXP memory_budget,
+			 SEXP scratch, SEXP output) {
+    /* Compute a levelset estimation. 
+     *
+     * Args:
+     *   X: matrix of the X points, each row contains one point.  Columns 
+     *      represent the different dimensions.
+     *   Y: vector of the response variables.
+     *   k_max: integer vector, maximum number of splits to consider in each
+     *     dimension.
+     *   gamma: double, level of the level set.
+     *   delta: double, complexity factor.
+     *   rho: double, cost penalty.
+     *   checkpoint: NULL, or name of a checkpoint file to record completed
+     *     levels in and to resume from.
+     *   memory_budget: double, memory budget for the levels in bytes, 0 for
+     *     no limit.
+     *   scratch: NULL, or name of the scratch file for levels spilled to
+     *     disk.
+     *   output: list of output options, see output_from_r.
+     * Returns: levelset estimate.
+     */
+    levelset_args la = levelset_args_from_r(X, Y, k_max, gamma, delta, rho);
+    return run_levelset_r(la, checkpoint, memory_budget, scratch, output);
+  }
+
+  SEXP estimate_levelset_float(SEXP X, SEXP Y, SEXP offset, SEXP scale,
+			       SEXP k_max, SEXP gamma, SEXP delta, SEXP rho,
+			       SEXP checkpoint, SEXP memory_budget,
+			       SEXP scratch, SEXP output) {
+    /* Compute a levelset estimation from single precision data, without
+     * widening it to double.  The points are binned a block at a time and
+     * the responses are summed in double, the estimate is the one
+     * estimate_levelset gives for the same values in double.
+     *
+     * Args:
+     *   X: the Data slot of a float32 matrix, see
+     *     float_levelset_args_from_r.
+     *   Y: double vector, or the Data slot of a float32 vector.
+     *   offset, scale: double vectors, the transform of each column of X
+     *     into the unit cube.
+     *   the rest as for estimate_levelset.
+     * Returns: levelset estimate.
+     */
+    levelset_args la = float_levelset_args_from_r(X, Y, offset, scale, k_max,
+						  gamma, delta, rho);
+    return run_levelset_r(la, checkpoint, memory_budget, scratch, output);
+  }
+
+  SEXP estimate_levelset_cells(SEXP X, SEXP Y, SEXP k_max, SEXP gamma,
+			       SEXP delta, SEXP rho, SEXP checkpoint,
+			       SEXP memory_budget, SEXP scratch,
+			       SEXP output) {
+    /* Compute a levelset estimation from points given by their finest
+     * boxes.  The splits of each point come from the bits of its cell
+     * coordinates, nothing is converted to double or transformed.
+     *
+     * Args:
+     *   X: integer or raw matrix of cell coordinates, see
+     *     cells_levelset_args_from_r.
+     *   Y: double vector, or the Data slot of a float32 vector.
+     *   the rest as for estimate_levelset.
+     * Returns: levelset estimate.
+     */
+    levelset_args la = cells_levelset_args_from_r(X, Y, k_max, gamma, delta,
+						  rho);
+    return run_levelset_r(la, checkpoint, memory_budget, scratch, output);
+  }
+
+  SEXP float_column_ranges(SEXP X) {
+    /* The smallest and largest value of each column of a float32 matrix,
+     * for its transform into the unit cube.
+     *
+     * Args:
+     *   X: the Data slot of a float32 matrix.
+     * Returns:
+     *   2 x d double matrix, the minimum then the maximum of each column,
+     *   NaN for a column holding NaN.
+     */
+    SEXP dim = Rf_getAttrib(X, R_DimSymbol);
+    if (TYPEOF(X) != INTSXP || LENGTH(dim) != 2) {
+      error("X must be the Data slot of a float32 matrix.");
+    }
+    int n = INTEGER(dim)[0], d = INTEGER(dim)[1];
+    const float *x = (const float *)INTEGER(X);
+    SEXP ret;
+    PROTECT(ret = allocMatrix(REALSXP, 2, d));
+    for (int j = 0; j < d; j++) {
+      const float *xj = x + (size_t)j * n;
+      double lo = n ? xj[0] : R_NaN, hi = lo;
+      for (int i = 0; i < n; i++) {
+	if (xj[i] != xj[i]) {
+	  lo = hi = R_NaN;
+	  break;
+	}
+	lo = xj[i] < lo ? xj[i] : lo;
+	hi = xj[i] > hi ? xj[i] : hi;
+      }
+      REAL(ret)[2 * j] = lo;
+      REAL(ret)[2 * j + 1] = hi;
+    }
+    UNPROTECT(1);
+    return ret;
+  }
+
+  static void finalize_levelset_job(SEXP handle) {
+    free_levelset_job((levelset_job *)R_ExternalPtrAddr(handle));
+    R_ClearExternalPtr(handle);
+  }
+
+  levelset_job *get_levelset_job(SEXP handle) {
+    if (TYPEOF(handle) != EXTPTRSXP || !R_ExternalPtrAddr(handle)) {
+      error("handle is not a running levelset estimation.");
+    }
+    return (levelset_job *)R_ExternalPtrAddr(handle);
+  }
+
+  SEXP levelset_start(SEXP X, SEXP Y, SEXP k_max, SEXP gamma, SEXP delta,
+		      SEXP rho, SEXP checkpoint, SEXP memory_budget,
+		      SEXP scratch) {
+    /* Start a levelset estimation in the background.
+     *
+     * Args:
+     *   as for estimate_levelset.
+     * Returns:
+     *   external pointer to the running estimation, for levelset_progress,
+     *   levelset_cancel and levelset_collect.
+     */
+    levelset_args la = levelset_args_from_r(X, Y, k_max, gamma, delta, rho);
+    levelset_control control;
+    levelset_control_from_r(&control, checkpoint, memory_budget, scratch);
+
+    SEXP handle;
+    PROTECT(handle = R_MakeExternalPtr(start_levelset_job(la, &control, 1),
+				       R_NilValue, R_NilValue));
+    R_RegisterCFinalizerEx(handle, finalize_levelset_job, TRUE);
+    UNPROTECT(1);
+    return handle;
+  }
+
+  SEXP levelset_progress_r(SEXP handle) {
+    /* Report the progress of a background estimation.
+     *
+     * Args:
+     *   handle: external pointer returned by levelset_start.
+     * Returns:
+     *   list containing:
+     *     'level' - number of levels collapsed so far.
+     *     'n_levels' - number of levels to collapse, sum(k_max).
+     *     'boxes' - number of boxes processed so far.
+     *     'done' - logical, has the estimation finished.
+     */
+    levelset_job *job = get_levelset_job(handle);
+    levelset_progress *progress = levelset_job_progress(job);
     SEXP ret, ret_names;
     PROTECT(ret = allocVector(VECSXP, 4));
     PROTECT(ret_names = allocVector(STRSXP, 4));
+    SET_STRING_ELT(ret_names, 0, mkChar("level"));
+    SET_STRING_ELT(ret_names, 1, mkChar("n_levels"));
+    SET_STRING_ELT(ret_names, 2, mkChar("boxes"));
+    SET_STRING_ELT(ret_names, 3, mkChar("done"));
+    Rf_namesgets(ret, ret_names);
+    SET_VECTOR_ELT(ret, 0, Rf_ScalarInteger(progress->level));
+    SET_VECTOR_ELT(ret, 1, Rf_ScalarInteger(progress->n_levels));
+    SET_VECTOR_ELT(ret, 2, Rf_ScalarReal((double)progress->boxes));
+    SET_VECTOR_ELT(ret, 3, Rf_ScalarLogical(wait_levelset_job(job, 0)));
+    UNPROTECT(2);
+    return ret;
+  }
 
-    SET_STRING_ELT(ret_names, 0, mkChar("total_cost"));
-    SEXP total_cost;
-    PROTECT(total_cost = Rf_allocVector(REALSXP, 1));
-    REAL(total_cost)[0] = le.total_cost;
-    SET_VECTOR_ELT(ret, 0, total_cost);
+  SEXP levelset_cancel(SEXP handle) {
+    /* Cancel a background estimation and wait for it to stop.
+     *
+     * Args:
+     *   handle: external pointer returned by levelset_start.
+     * Returns:
+     *   NULL.
+     */
+    free_levelset_job(get_levelset_job(handle));
+    R_ClearExternalPtr(handle);
+    return R_NilValue;
+  }
+
+  SEXP levelset_collect(SEXP handle, SEXP wait) {
+    /* Collect the result of a background estimation.
+     *
+     * Args:
+     *   handle: external pointer returned by levelset_start.
+     *   wait: logical, wait for the estimation to finish.  An interrupt
+     *     while waiting leaves the estimation running.
+     * Returns:
+     *   levelset estimate, as returned by estimate_levelset, or NULL if
+     *   wait is FALSE and the estimation is still running.
+     */
+    if (LENGTH(wait) != 1 || TYPEOF(wait) != LGLSXP) {
+      error("wait must be a single logical value.");
+    }
+    levelset_job *job = get_levelset_job(handle);
+    while (!wait_levelset_job(job, LOGICAL(wait)[0] ? 100 : 0)) {
+      if (!LOGICAL(wait)[0]) {
+	return R_NilValue;
+      }
+      R_CheckUserInterrupt();
+    }
+
+    /* Background estimates always come back as box lists, with their point
+     * indexes. */
+    R_ClearExternalPtr(handle);
+    r_output out = {0, NULL, NULL, POINT_INDICES_FULL};
+    return collect_levelset_job(job, &out);
+  }
+
+  void pyramid_dims_from_r(SEXP X, SEXP Y, SEXP k_max, int *n, int *d,
+			   int *m) {
+    /* Check the data for a box pyramid and find its dimensions. */
+    SEXP dim;
+    PROTECT(dim = Rf_getAttrib(X, R_DimSymbol));
+    if (LENGTH(dim) != 2 || TYPEOF(X) != REALSXP) {
+      error("X must be a 2 dimensional matrix.");
+    }
+    *n = INTEGER(dim)[0];
+    *d = INTEGER(dim)[1];
     UNPROTECT(1);
-  
-    SET_STRING_ELT(ret_names, 1, mkChar("num_boxes"));
-    SEXP num_boxes;
-    PROTECT(num_boxes = Rf_allocVector(REALSXP, 1));
-    REAL(num_boxes)[0] = le.num_inset + le.num_non_inset;
-    SET_VECTOR_ELT(ret, 1, num_boxes);
+    check_k_max(k_max, *d);
+    if (total_splits(*d, INTEGER(k_max)) > MAX_PYRAMID_SPLITS) {
+      error("k_max can add up to at most %d.", MAX_PYRAMID_SPLITS);
+    }
+
+    if (TYPEOF(Y) != REALSXP || LENGTH(Y) % (*n ? *n : 1)) {
+      error("Y must be a matrix with nrow(Y) == dim(X)[1]");
+    }
+    *m = *n ? LENGTH(Y) / *n : 0;
+  }
+
+  void check_solve_args(int m, SEXP gamma, SEXP delta, SEXP rho,
+			SEXP prune) {
+    /* Make sure the parameters for solving a box pyramid with m responses
+     * are valid. */
+    if (LENGTH(delta) != 1 || TYPEOF(delta) != REALSXP) {
+      error("delta must be a single numeric value.");
+    }
+    if (LENGTH(rho) != 1 || TYPEOF(rho) != REALSXP) {
+      error("rho must be a single numeric value.");
+    }
+    if (LENGTH(prune) != 1 || TYPEOF(prune) != LGLSXP) {
+      error("prune must be a single logical value.");
+    }
+    if (TYPEOF(gamma) != REALSXP || LENGTH(gamma) != m) {
+      error("gamma must be a numeric vector with one value per column of Y.");
+    }
+  }
+
+  SEXP solve_pyramid_to_list(box_pyramid *pyr, SEXP gamma, SEXP delta,
+			     SEXP rho, SEXP prune, const r_output *out) {
+    /* Solve every response of a box pyramid and convert the estimates to
+     * an R list, one per response, as out asks.  The pyramid is left as it
+     * is. */
+    pyramid_solution *sol = solve_box_pyramid(pyr, REAL(gamma),
+					      REAL(delta)[0], REAL(rho)[0],
+					      LOGICAL(prune)[0]);
+
+    vector<levelset_estimate> estimates(pyr->m);
+    for (int c = 0; c < pyr->m; c++) {
+      estimates[c] = pyramid_levelset_estimate(pyr, sol, c, REAL(delta)[0],
+					       REAL(rho)[0]);
+    }
+    free_pyramid_solution(sol);
+    return estimates_to_r(estimates, out);
+  }
+
+  SEXP estimate_levelsets(SEXP X, SEXP Y, SEXP k_max, SEXP gamma,
+			  SEXP delta, SEXP rho, SEXP prune, SEXP output) {
+    /* Compute a levelset estimation for several responses, binning X once
+     * and solving every response in one pass over the boxes.
+     *
+     * Args:
+     *   X: matrix of the X points, each row contains one point.  Columns 
+     *      represent the different dimensions.
+     *   Y: matrix of the response variables, one column per response.
+     *   k_max: integer vector, maximum number of splits to consider in
+     *     each dimension.
+     *   gamma: numeric vector, level of the level set for each response.
+     *   delta: double, complexity factor.
+     *   rho: double, cost penalty.
+     *   prune: logical, skip boxes below boxes that are provably terminal.
+     *     The estimates are the same either way.
+     *   output: list of output options, see output_from_r.
+     * Returns: list of levelset estimates, one per column of Y.
+     */
+    int n, d, m;
+    pyramid_dims_from_r(X, Y, k_max, &n, &d, &m);
+    check_solve_args(m, gamma, delta, rho, prune);
+    r_output out = output_from_r(output, d);
+
+    box_pyramid *pyr = new_box_pyramid(REAL(X), REAL(Y), n, d, m,
+				       INTEGER(k_max));
+    SEXP ret;
+    PROTECT(ret = solve_pyramid_to_list(pyr, gamma, delta, rho, prune,
+					&out));
+    free_box_pyramid(pyr);
     UNPROTECT(1);
-  
-    SET_STRING_ELT(ret_names, 2, mkChar("inset_boxes"));
-    SEXP inset_boxes;
-    PROTECT(inset_boxes = get_boxes_list(le.inset_boxes, le.num_inset));
-    SET_VECTOR_ELT(ret, 2, inset_boxes);
+    return ret;
+  }
+
+  SEXP estimate_levelsets_sampled(SEXP X, SEXP Y, SEXP rows, SEXP n_rows,
+				  SEXP A, SEXP k_max, SEXP gamma, SEXP delta,
+				  SEXP rho, SEXP prune, SEXP output) {
+    /* Compute approximate levelset estimates from a uniform sample of the
+     * rows of the data, see sample_box_pyramid.
+     *
+     * Args:
+     *   X: matrix of the sampled X points, one row per sampled row.
+     *   Y: matrix of the sampled responses, one column per response.
+     *   rows: integer vector, the row of the data (1-relative) each point
+     *     was sampled from.
+     *   n_rows: integer, number of rows in the data.
+     *   A: numeric vector, 1 + max |y| over every row, for each response.
+     *   k_max: integer vector, maximum number of splits to consider in
+     *     each dimension.
+     *   gamma: numeric vector, level of the level set for each response.
+     *   delta: double, complexity factor.
+     *   rho: double, cost penalty.
+     *   prune: logical, skip boxes below boxes that are provably terminal.
+     *   output: list of output options, see output_from_r.
+     * Returns: list of levelset estimates, one per column of Y, with box
+     *   points indexing the rows of the data.
+     */
+    int n, d, m;
+    pyramid_dims_from_r(X, Y, k_max, &n, &d, &m);
+    check_solve_args(m, gamma, delta, rho, prune);
+    if (LENGTH(n_rows) != 1 || TYPEOF(n_rows) != INTSXP ||
+	INTEGER(n_rows)[0] < n) {
+      error("n_rows must be a single integer value, at least nrow(X).");
+    }
+    if (TYPEOF(rows) != INTSXP || LENGTH(rows) != n) {
+      error("rows must be an integer vector with one value per row of X.");
+    }
+    if (TYPEOF(A) != REALSXP || LENGTH(A) != m) {
+      error("A must be a numeric vector with one value per column of Y.");
+    }
+    for (int i = 0; i < n; i++) {
+      if (INTEGER(rows)[i] < 1 || INTEGER(rows)[i] > INTEGER(n_rows)[0]) {
+	error("rows must be between 1 and n_rows.");
+      }
+    }
+    for (int c = 0; c < m; c++) {
+      if (max_vector_fabs(REAL(Y) + (size_t)c * n, n) >= REAL(A)[c]) {
+	error("A must be larger than every |y|.");
+      }
+    }
+    r_output out = output_from_r(output, d);
+
+    vector<int> row_index(n);
+    for (int i = 0; i < n; i++) {
+      row_index[i] = INTEGER(rows)[i] - 1;
+    }
+
+    box_pyramid *pyr = new_box_pyramid(REAL(X), REAL(Y), n, d, m,
+				       INTEGER(k_max));
+    sample_box_pyramid(pyr, n ? &row_index[0] : NULL, INTEGER(n_rows)[0],
+		       REAL(A));
+    SEXP ret;
+    PROTECT(ret = solve_pyramid_to_list(pyr, gamma, delta, rho, prune,
+					&out));
+    free_box_pyramid(pyr);
     UNPROTECT(1);
-  
-    SET_STRING_ELT(ret_names, 3, mkChar("non_inset_boxes"));
-    SEXP non_inset_boxes;
-    PROTECT(non_inset_boxes = get_boxes_list(le.non_inset_boxes, le.num_non_inset));
-    SET_VECTOR_ELT(ret, 3, non_inset_boxes);
+    return ret;
+  }
+
+  SEXP estimate_levelsets_sharded(SEXP X, SEXP Y, SEXP k_max, SEXP gamma,
+				  SEXP delta, SEXP rho, SEXP shard_splits,
+				  SEXP n_workers, SEXP scratch, SEXP output) {
+    /* Compute a levelset estimation for several responses, solving the
+     * points of each shard in a worker process, see shard.h.
+     *
+     * Args:
+     *   X: matrix of the X points, each row contains one point.
+     *   Y: matrix of the response variables, one column per response.
+     *   k_max: integer vector, maximum number of splits to consider in
+     *     each dimension.
+     *   gamma: numeric vector, level of the level set for each response.
+     *   delta: double, complexity factor.
+     *   rho: double, cost penalty.
+     *   shard_splits: integer, number of splits that define the shards,
+     *     there are 2^shard_splits of them.
+     *   n_workers: integer, most worker processes to run at once, 0 for
+     *     one per core.
+     *   scratch: string, prefix of the names of the files the workers
+     *     hand their shards back in.
+     *   output: list of output options, see output_from_r.
+     * Returns: list of levelset estimates, one per column of Y.
+     */
+    int n, d, m;
+    pyramid_dims_from_r(X, Y, k_max, &n, &d, &m);
+    check_solve_args(m, gamma, delta, rho, ScalarLogical(FALSE));
+    if (LENGTH(shard_splits) != 1 || TYPEOF(shard_splits) != INTSXP ||
+	INTEGER(shard_splits)[0] < 1 ||
+	INTEGER(shard_splits)[0] > MAX_SHARD_SPLITS ||
+	INTEGER(shard_splits)[0] > total_splits(d, INTEGER(k_max))) {
+      error("shard_splits must be a single integer value between 1 and "
+	    "min(sum(k_max), %d).", MAX_SHARD_SPLITS);
+    }
+    if (LENGTH(n_workers) != 1 || TYPEOF(n_workers) != INTSXP) {
+      error("n_workers must be a single integer value.");
+    }
+    if (LENGTH(scratch) != 1 || TYPEOF(scratch) != STRSXP) {
+      error("scratch must be a single string.");
+    }
+    r_output out = output_from_r(output, d);
+
+    vector<levelset_estimate> estimates(m);
+    const char *message = NULL;
+    if (m && !sharded_levelsets(REAL(X), REAL(Y), n, d, m, INTEGER(k_max),
+				REAL(gamma), REAL(delta)[0], REAL(rho)[0],
+				INTEGER(shard_splits)[0],
+				INTEGER(n_workers)[0],
+				CHAR(STRING_ELT(scratch, 0)),
+				pending_interrupt, &estimates[0], &message)) {
+      vector<levelset_estimate>().swap(estimates);
+      error("Sharded estimation failed: %s.", message);
+    }
+
+    return estimates_to_r(estimates, &out);
+  }
+
+  SEXP estimate_levelsets_depth_first(SEXP X, SEXP Y, SEXP k_max,
+				      SEXP gamma, SEXP delta, SEXP rho,
+				      SEXP prune, SEXP n_threads,
+				      SEXP output) {
+    /* Compute a levelset estimation for several responses with the depth
+     * first engine, see depthfirst.h.
+     *
+     * Args:
+     *   X: matrix of the X points, each row contains one point.
+     *   Y: matrix of the response variables, one column per response.
+     *   k_max: integer vector, maximum number of splits to consider in
+     *     each dimension.
+     *   gamma: numeric vector, level of the level set for each response.
+     *   delta: double, complexity factor.
+     *   rho: double, cost penalty.
+     *   prune: logical, skip boxes below boxes that are provably terminal.
+     *   n_threads: integer, number of threads to use, 0 for one per core.
+     *   output: list of output options, see output_from_r.
+     * Returns: list of levelset estimates, one per column of Y.
+     */
+    int n, d, m;
+    pyramid_dims_from_r(X, Y, k_max, &n, &d, &m);
+    check_solve_args(m, gamma, delta, rho, prune);
+    if (LENGTH(n_threads) != 1 || TYPEOF(n_threads) != INTSXP) {
+      error("n_threads must be a single integer value.");
+    }
+    r_output out = output_from_r(output, d);
+
+    vector<levelset_estimate> estimates(m);
+    if (m) {
+      depth_first_levelsets(REAL(X), REAL(Y), n, d, m, INTEGER(k_max),
+			    REAL(gamma), REAL(delta)[0], REAL(rho)[0],
+			    LOGICAL(prune)[0], INTEGER(n_threads)[0],
+			    &estimates[0]);
+    }
+
+    return estimates_to_r(estimates, &out);
+  }
+
+  static void finalize_prepared(SEXP handle) {
+    free_box_pyramid((box_pyramid *)R_ExternalPtrAddr(handle));
+    R_ClearExternalPtr(handle);
+  }
+
+  SEXP levelset_prepare(SEXP X, SEXP Y, SEXP k_max) {
+    /* Bin the points and build the box pyramid once, for any number of
+     * later estimates with different parameters.
+     *
+     * Args:
+     *   X: matrix of the X points, each row contains one point.
+     *   Y: matrix of the response variables, one column per response.
+     *   k_max: integer vector, maximum number of splits to consider in
+     *     each dimension.
+     * Returns:
+     *   external pointer to the box pyramid, for estimate_prepared.
+     */
+    int n, d, m;
+    pyramid_dims_from_r(X, Y, k_max, &n, &d, &m);
+
+    box_pyramid *pyr = new_box_pyramid(REAL(X), REAL(Y), n, d, m,
+				       INTEGER(k_max));
+    SEXP handle;
+    PROTECT(handle = R_MakeExternalPtr(pyr, R_NilValue, R_NilValue));
+    R_RegisterCFinalizerEx(handle, finalize_prepared, TRUE);
     UNPROTECT(1);
-  
-    Rf_namesgets(ret, ret_names);
-    UNPROTECT(2);
+    return handle;
+  }
 
-    /* Cleanup. */
-    for (int i = 0; i < le.num_inset; i++) {
-      /* By definition, these boxes do not have children. */
-      free_box_but_not_children(le.inset_boxes[i]);
+  SEXP estimate_prepared(SEXP handle, SEXP gamma, SEXP delta, SEXP rho,
+			 SEXP prune, SEXP output) {
+    /* Compute levelset estimations from a box pyramid made by
+     * levelset_prepare.  Only the optimal trees are solved for, the
+     * binning is reused.
+     *
+     * Args:
+     *   handle: external pointer returned by levelset_prepare.
+     *   gamma: numeric vector, level of the level set for each response.
+     *   delta: double, complexity factor.
+     *   rho: double, cost penalty.
+     *   prune: logical, skip boxes below boxes that are provably terminal.
+     *   output: list of output options, see output_from_r.
+     * Returns: list of levelset estimates, one per response.
+     */
+    if (TYPEOF(handle) != EXTPTRSXP || !R_ExternalPtrAddr(handle)) {
+      error("handle is not prepared data, prepared data does not survive "
+	    "saving and reloading a session.");
     }
-    free(le.inset_boxes);
-  
-    for (int i = 0; i < le.num_non_inset; i++) {
-      /* By definition, these boxes do not have children. */
-      free_box_but_not_children(le.non_inset_boxes[i]);
+    box_pyramid *pyr = (box_pyramid *)R_ExternalPtrAddr(handle);
+    check_solve_args(pyr->m, gamma, delta, rho, prune);
+    r_output out = output_from_r(output, pyr->d);
+    return solve_pyramid_to_list(pyr, gamma, delta, rho, prune, &out);
+  }
+
+  SEXP estimate_kmax_sweep(SEXP X, SEXP Y, SEXP k_max, SEXP gamma,
+			   SEXP delta, SEXP rho, SEXP prune, SEXP n_threads,
+			   SEXP output) {
+    /* Compute levelset estimations on several lattices, binning X once at
+     * the finest of them.
+     *
+     * Args:
+     *   X: matrix of the X points, each row contains one point.
+     *   Y: matrix of the response variables, one column per response.
+     *   k_max: integer matrix, one row per lattice giving its maximum
+     *     number of splits in each dimension.
+     *   gamma: numeric vector, level of the level set for each response.
+     *   delta: double, complexity factor.
+     *   rho: double, cost penalty.
+     *   prune: logical, skip boxes below boxes that are provably terminal.
+     *   n_threads: integer, most threads to use, 0 for one per core.
+     *   output: list of output options, see output_from_r.
+     * Returns: list with one element per row of k_max, each a list of
+     *   levelset estimates, one per column of Y.
+     */
+    SEXP dim;
+    PROTECT(dim = Rf_getAttrib(k_max, R_DimSymbol));
+    if (TYPEOF(k_max) != INTSXP || LENGTH(dim) != 2) {
+      error("k_max must be an integer matrix.");
     }
-    free(le.non_inset_boxes);
-  
+    int n_k = INTEGER(dim)[0];
+    UNPROTECT(1);
+    if (LENGTH(n_threads) != 1 || TYPEOF(n_threads) != INTSXP) {
+      error("n_threads must be a single integer value.");
+    }
+
+    /* Check each lattice and find the finest, row by row. */
+    int n, d, m;
+    SEXP row;
+    PROTECT(row = allocVector(INTSXP, LENGTH(k_max) / (n_k ? n_k : 1)));
+    vector<int> kmax(n_k * LENGTH(row));
+    vector<int> finest(LENGTH(row), 0);
+    for (int k = 0; k < n_k; k++) {
+      for (int j = 0; j < LENGTH(row); j++) {
+	INTEGER(row)[j] = INTEGER(k_max)[k + j * n_k];
+	kmax[k * LENGTH(row) + j] = INTEGER(row)[j];
+	finest[j] = std::max(finest[j], INTEGER(row)[j]);
+      }
+      pyramid_dims_from_r(X, Y, row, &n, &d, &m);
+    }
+    UNPROTECT(1);
+    if (!n_k) {
+      return allocVector(VECSXP, 0);
+    }
+    check_solve_args(m, gamma, delta, rho, prune);
+    r_output out = output_from_r(output, d);
+
+    box_pyramid *pyr = new_box_pyramid(REAL(X), REAL(Y), n, d, m,
+				       &finest[0]);
+    vector<levelset_estimate> estimates(n_k * m);
+    sweep_box_pyramid(pyr, n_k, &kmax[0], REAL(gamma), REAL(delta)[0],
+		      REAL(rho)[0], LOGICAL(prune)[0], INTEGER(n_threads)[0],
+		      &estimates[0]);
+    free_box_pyramid(pyr);
+
+    check_estimates_fit(estimates, &out);
+    SEXP ret, les;
+    PROTECT(ret = allocVector(VECSXP, n_k));
+    for (int k = 0; k < n_k; k++) {
+      PROTECT(les = allocVector(VECSXP, m));
+      for (int c = 0; c < m; c++) {
+	SET_VECTOR_ELT(les, c,
+		       levelset_estimate_to_r(&estimates[k * m + c], &out));
+      }
+      SET_VECTOR_ELT(ret, k, les);
+      UNPROTECT(1);
+    }
+    UNPROTECT(1);
+    return ret;
+  }
+
+  SEXP simd_level_r(SEXP level) {
+    /* Report or force the level of the vector kernels, see simd.h.
+     *
+     * Args:
+     *   level: name of the level to force, "auto" for the best supported,
+     *     or NULL to leave it.
+     * Returns:
+     *   list containing:
+     *     'level' - name of the level in use.
+     *     'supported' - name of the best level this CPU supports.
+     */
+    int supported = simd_supported_level();
+    if (level != R_NilValue) {
+      const char *name = CHAR(STRING_ELT(level, 0));
+      int l = simd_level_from_name(name);
+      if (l < SIMD_AUTO) {
+	error("unknown SIMD level %s.", name);
+      }
+      if (l > supported) {
+	error("this CPU does not support %s, only up to %s.", name,
+	      simd_level_name(supported));
+      }
+      set_simd_level(l);
+    }
+    SEXP ret, ret_names;
+    PROTECT(ret = allocVector(VECSXP, 2));
+    PROTECT(ret_names = allocVector(STRSXP, 2));
+    SET_STRING_ELT(ret_names, 0, mkChar("level"));
+    SET_STRING_ELT(ret_names, 1, mkChar("supported"));
+    Rf_namesgets(ret, ret_names);
+    SET_VECTOR_ELT(ret, 0, mkString(simd_level_name(simd_level())));
+    SET_VECTOR_ELT(ret, 1, mkString(simd_level_name(supported)));
+    UNPROTECT(2);
     return ret;
   }
 }
@@ -0,0 +1,205 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include <R.h>
+
+#include "raster.h"
+
+using std::vector;
+
+raster_window *new_raster_window(int d, const int *kmax) {
+  /* Create a window covering the whole lattice at full resolution.
+   *
+   * Args:
+   *   d: number of dimensions.
+   *   kmax: array of d integers, number of splits in the finest lattice in
+   *     each dimension.
+   * Returns:
+   *   pointer to the new window.
+   */
+  raster_window *w = (raster_window *)malloc(sizeof(raster_window));
+  w->d       = d;
+  w->kmax    = (int *)malloc(sizeof(int) * d);
+  w->cell_lo = (int *)malloc(sizeof(int) * d);
+  w->cell_hi = (int *)malloc(sizeof(int) * d);
+  w->res     = (int *)malloc(sizeof(int) * d);
+  for (int j = 0; j < d; j++) {
+    w->kmax[j]    = kmax[j];
+    w->cell_lo[j] = 0;
+    w->cell_hi[j] = 1 << kmax[j];
+    w->res[j]     = 1 << kmax[j];
+  }
+  return w;
+}
+
+void free_raster_window(raster_window *w) {
+  if (!w) {
+    return;
+  }
+  free(w->kmax);
+  free(w->cell_lo);
+  free(w->cell_hi);
+  free(w->res);
+  free(w);
+}
+
+long raster_size(raster_window *w) {
+  /* Number of pixels in a window. */
+  long n = 1;
+  for (int j = 0; j < w->d; j++) {
+    n *= w->res[j];
+  }
+  return n;
+}
+
+int split_to_cells(box_split *split, int dim, int kmax, int *c1, int *c2) {
+  /* Find the lattice cells covered by a split in one dimension.
+   *
+   * Args:
+   *   split: pointer to the split.
+   *   dim: which dimension to extract.
+   *   kmax: number of splits in the finest lattice in dimension dim.
+   *   c1: pointer to the first cell covered.
+   *   c2: pointer to one past the last cell covered.
+   * Returns:
+   *   BOX_SUCCESS if the split fits in the lattice, BOX_ERROR otherwise.
+   */
+  if (!split || dim < 0 || dim >= split->d || split->nsplit[dim] > kmax) {
+    return BOX_ERROR;
+  }
+
+  /* The first split is the most significant bit of the cell index. */
+  int index = 0;
+  for (int i = 0; i < split->nsplit[dim]; i++) {
+    index = (index << 1) | ((split->split[dim] >> i) & 1);
+  }
+  int width = kmax - split->nsplit[dim];
+  *c1 = index << width;
+  *c2 = (index + 1) << width;
+
+  return BOX_SUCCESS;
+}
+
+static void pixel_range(raster_window *w, int dim, int c1, int c2, int *p1,
+			int *p2) {
+  /* Find the pixels whose centers fall in lattice cells [c1, c2).
+   *
+   * Args:
+   *   w: pointer to the window.
+   *   dim: dimension.
+   *   c1: first cell.
+   *   c2: one past the last cell.
+   *   p1: pointer to the first pixel.
+   *   p2: pointer to one past the last pixel.
+   */
+  /* Pixel p samples cell lo + floor((2 p + 1) width / (2 res)), which is
+   * at least c exactly when 2 p + 1 >= ceil(2 res (c - lo) / width). */
+  long lo = w->cell_lo[dim];
+  long width = w->cell_hi[dim] - lo;
+  long res = w->res[dim];
+  long bounds[2] = {c1, c2};
+  long pixels[2];
+  for (int i = 0; i < 2; i++) {
+    long c = bounds[i] - lo;
+    if (c <= 0) {
+      pixels[i] = 0;
+    } else if (c >= width) {
+      pixels[i] = res;
+    } else {
+      long t = (2 * res * c + width - 1) / width;
+      pixels[i] = t / 2;
+    }
+  }
+  *p1 = pixels[0];
+  *p2 = pixels[1];
+}
+
+template <class T>
+static void fill_raster(raster_window *w, box_split **boxes, int n_boxes,
+			T *values, T *out) {
+  /* Paint every box with its value.
+   *
+   * Args:
+   *   w: pointer to the window.
+   *   boxes: array of box splits.
+   *   n_boxes: integer, length of boxes.
+   *   values: array with the value of each box.
+   *   out: raster, raster_size(w) elements.
+   */
+  int d = w->d;
+  vector<int> p1(d), p2(d), pos(d);
+  vector<long> stride(d);
+  for (int j = 0; j < d; j++) {
+    stride[j] = j ? stride[j - 1] * w->res[j - 1] : 1;
+  }
+
+  for (int b = 0; b < n_boxes; b++) {
+    int empty = 0;
+    for (int j = 0; j < d && !empty; j++) {
+      int c1, c2;
+      if (split_to_cells(boxes[b], j, w->kmax[j], &c1, &c2) != BOX_SUCCESS) {
+	empty = 1;
+	break;
+      }
+      pixel_range(w, j, c1, c2, &p1[j], &p2[j]);
+      empty = p1[j] >= p2[j];
+    }
+    if (empty) {
+      continue;
+    }
+
+    /* Step through the pixels of the box, dimension 0 fastest. */
+    long offset = 0;
+    for (int j = 0; j < d; j++) {
+      pos[j] = p1[j];
+      offset += p1[j] * stride[j];
+    }
+    while (1) {
+      T *row = out + offset;
+      for (int p = p1[0]; p < p2[0]; p++) {
+	row[p - p1[0]] = values[b];
+      }
+
+      int j = 1;
+      while (j < d && ++pos[j] == p2[j]) {
+	offset -= (long)(p2[j] - 1 - p1[j]) * stride[j];
+	pos[j] = p1[j];
+	j++;
+      }
+      if (j >= d) {
+	break;
+      }
+      offset += stride[j];
+    }
+  }
+}
+
+void rasterize_labels(raster_window *w, box_split **boxes, int n_boxes,
+		      unsigned char *labels, unsigned char *out) {
+  /* Paint boxes onto a byte raster, see fill_raster. */
+  fill_raster<unsigned char>(w, boxes, n_boxes, labels, out);
+}
+
+void rasterize_values(raster_window *w, box_split **boxes, int n_boxes,
+		      double *values, double *out) {
+  /* Paint boxes onto a double raster, see fill_raster. */
+  fill_raster<double>(w, boxes, n_boxes, values, out);
+}
+
+void pack_raster_bits(unsigned char *labels, long n, unsigned char value,
+		      unsigned char *out) {
+  /* Pack a label raster into a bitmap, one bit per pixel.
+   *
+   * Args:
+   *   labels: label raster.
+   *   n: number of pixels.
+   *   value: label whose pixels are set.
+   *   out: bitmap, (n + 7) / 8 bytes.  Pixel i is bit i % 8 of byte i / 8.
+   */
+  memset(out, 0, (n + 7) / 8);
+  for (long i = 0; i < n; i++) {
+    if (labels[i] == value) {
+      out[i >> 3] |= 1 << (i & 7);
+    }
+  }
+}
@@ -0,0 +1,41 @@
+#ifndef raster_h
+#define raster_h
+
+#include "box.h"
+
+/* Rasterizing paints terminal boxes onto a regular grid over a window of
+ * the finest dyadic lattice, which has 2^kmax[j] cells along axis j.
+ *
+ * The window covers cells cell_lo[j] <= c < cell_hi[j] in dimension j and
+ * is sampled with res[j] pixels along that dimension.  Pixel p takes the
+ * value of the cell at its center, so res[j] smaller than the window width
+ * downsamples the lattice.  Output arrays are column major, dimension 0
+ * varies fastest.  Pixels not covered by any box keep their value. */
+
+/* Cells are indexed with int, which limits the lattice of a raster to
+ * MAX_RASTER_SPLITS splits in each dimension. */
+#define MAX_RASTER_SPLITS 30
+
+typedef struct {
+  int d;        /* Number of dimensions. */
+  int *kmax;    /* Number of splits in the finest lattice in each
+		   dimension. */
+  int *cell_lo; /* First lattice cell of the window in each dimension. */
+  int *cell_hi; /* One past the last lattice cell of the window. */
+  int *res;     /* Number of pixels along each dimension. */
+} raster_window;
+
+raster_window *new_raster_window(int d, const int *kmax);
+void free_raster_window(raster_window *);
+long raster_size(raster_window *);
+
+int split_to_cells(box_split *split, int dim, int kmax, int *c1, int *c2);
+
+void rasterize_labels(raster_window *, box_split **boxes, int n_boxes,
+		      unsigned char *labels, unsigned char *out);
+void rasterize_values(raster_window *, box_split **boxes, int n_boxes,
+		      double *values, double *out);
+void pack_raster_bits(unsigned char *labels, long n, unsigned char value,
+		      unsigned char *out);
+
+#endif
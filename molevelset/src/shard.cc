@@ -0,0 +1,775 @@
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifndef _WIN32
+#include <signal.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#endif
+
+#include <map>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "async.h"
+#include "box.h"
+#include "molevelset.h"
+#include "pyramid.h"
+#include "shard.h"
+#include "simd.h"
+
+using std::map;
+using std::string;
+using std::vector;
+
+typedef struct {
+  char magic[8];  /* SHARD_MAGIC. */
+  int version;    /* SHARD_VERSION. */
+  int d;          /* Number of dimensions. */
+  int m;          /* Number of response columns. */
+  int shard;      /* Index of the shard. */
+  int n_cells;    /* Number of finest boxes. */
+  int n_nodes;    /* Number of solved boxes. */
+} shard_header;
+
+/* The boxes read back from every shard, along with the top boxes, stored
+ * as the levels of a pyramid are. */
+typedef struct {
+  int d;                            /* Number of dimensions. */
+  int m;                            /* Number of response columns. */
+  vector<int> nsplit;               /* Number of splits, n x d. */
+  vector<unsigned long long> split; /* Splits, n x d. */
+  vector<int> n_points;             /* Number of points in each box. */
+  vector<double> sum_y;             /* Sum of each response, n x m. */
+  vector<double> risk_cost;         /* Optimal risk + cost, n x m. */
+  vector<int> choice;               /* Optimal split, -1 for terminal boxes,
+				       n x m. */
+  vector<int> children;             /* Children, n x d x 2, -1 when empty or
+				       not read. */
+  vector<char> top;                 /* Is this a top box. */
+  map<BoxSplitKey, int> index;      /* Box for each split. */
+  box_split_info *info;             /* Key type for index. */
+} shard_tree;
+
+/* The finest boxes of every shard and their points, which locate each
+ * point in the terminal boxes. */
+typedef struct {
+  vector<unsigned long long> split; /* Splits, n_cells x d. */
+  vector<int> start;                /* Start of each box in points, n_cells
+				       + 1 entries. */
+  vector<int> points;               /* Points (0-relative rows). */
+} shard_cells;
+
+static void shard_layout(int d, const int *kmax, int shard_splits,
+			 int *shard_nsplit) {
+  /* Find the number of splits in each dimension of the shards, the first
+   * shard_splits splits of the Morton order: the first split of every
+   * dimension, then the second, and so on. */
+  memset(shard_nsplit, 0, sizeof(int) * d);
+  int t = 0;
+  for (int depth = 0; t < shard_splits; depth++) {
+    for (int j = 0; j < d && t < shard_splits; j++) {
+      if (depth < kmax[j]) {
+	shard_nsplit[j]++;
+	t++;
+      }
+    }
+  }
+}
+
+static int is_inside_shard(const int *nsplit, const int *shard_nsplit,
+			   int d) {
+  for (int j = 0; j < d; j++) {
+    if (nsplit[j] < shard_nsplit[j]) {
+      return 0;
+    }
+  }
+  return 1;
+}
+
+static int is_boundary_box(const int *nsplit, const int *shard_nsplit,
+			   int d) {
+  /* Check if a box inside a shard can be the child of a top box. */
+  if (!is_inside_shard(nsplit, shard_nsplit, d)) {
+    return 0;
+  }
+  for (int j = 0; j < d; j++) {
+    if (shard_nsplit[j] && nsplit[j] == shard_nsplit[j]) {
+      return 1;
+    }
+  }
+  return 0;
+}
+
+static int write_ints(FILE *f, const int *x, int n) {
+  return (int)fwrite(x, sizeof(int), n, f) == n;
+}
+
+static int read_ints(FILE *f, int *x, int n) {
+  return (int)fread(x, sizeof(int), n, f) == n;
+}
+
+static int write_doubles(FILE *f, const double *x, int n) {
+  return (int)fwrite(x, sizeof(double), n, f) == n;
+}
+
+static int read_doubles(FILE *f, double *x, int n) {
+  return (int)fread(x, sizeof(double), n, f) == n;
+}
+
+static int write_ulls(FILE *f, const unsigned long long *x, int n) {
+  return (int)fwrite(x, sizeof(unsigned long long), n, f) == n;
+}
+
+static int read_ulls(FILE *f, unsigned long long *x, int n) {
+  return (int)fread(x, sizeof(unsigned long long), n, f) == n;
+}
+
+static void mark_optimal_tree(box_pyramid *pyr, pyramid_solution *sol,
+			      int l, int i, int c,
+			      vector<vector<char> > &keep,
+			      vector<vector<char> > &seen) {
+  /* Mark a pyramid box and the optimal tree below it for one response. */
+  int m = pyr->m;
+  if (seen[l][i * m + c]) {
+    return;
+  }
+  seen[l][i * m + c] = 1;
+  keep[l][i] = 1;
+  int j = sol->choice->at(l)[i * m + c];
+  if (j < 0) {
+    return;
+  }
+  int *child = &pyr->levels[l].children->at((i * pyr->d + j) * 2);
+  for (int side = 0; side < 2; side++) {
+    if (child[side] >= 0) {
+      mark_optimal_tree(pyr, sol, l - 1, child[side], c, keep, seen);
+    }
+  }
+}
+
+static int write_shard_file(const char *path, int shard, box_pyramid *pyr,
+			    pyramid_solution *sol, const int *shard_nsplit) {
+  /* Write the finest boxes and the boxes the coordinator needs.
+   *
+   * Args:
+   *   path: name of the file to write.
+   *   shard: index of the shard.
+   *   pyr: pointer to the solved pyramid of the shard.
+   *   sol: pointer to its solution, found without pruning.
+   *   shard_nsplit: array of d integers, splits of the shard.
+   * Returns:
+   *   1 on success, 0 if the file could not be written.
+   */
+  int d = pyr->d;
+  int m = pyr->m;
+  box_split view;
+  vector<vector<char> > keep(pyr->n_levels), seen(pyr->n_levels);
+  for (int l = 0; l < pyr->n_levels; l++) {
+    keep[l].assign(pyr->levels[l].n_boxes, 0);
+    seen[l].assign((size_t)pyr->levels[l].n_boxes * m, 0);
+  }
+  shard_header h;
+  memset(&h, 0, sizeof(h));
+  memcpy(h.magic, SHARD_MAGIC, sizeof(h.magic));
+  h.version = SHARD_VERSION;
+  h.d       = d;
+  h.m       = m;
+  h.shard   = shard;
+  h.n_cells = pyr->levels[0].n_boxes;
+  for (int l = 0; l < pyr->n_levels; l++) {
+    for (int i = 0; i < pyr->levels[l].n_boxes; i++) {
+      pyramid_box_split(pyr, l, i, &view);
+      if (!is_boundary_box(view.nsplit, shard_nsplit, d)) {
+	continue;
+      }
+      for (int c = 0; c < m; c++) {
+	mark_optimal_tree(pyr, sol, l, i, c, keep, seen);
+      }
+    }
+  }
+  for (int l = 0; l < pyr->n_levels; l++) {
+    for (int i = 0; i < pyr->levels[l].n_boxes; i++) {
+      h.n_nodes += keep[l][i];
+    }
+  }
+
+  FILE *f = fopen(path, "wb");
+  if (!f) {
+    return 0;
+  }
+  int ok = fwrite(&h, sizeof(h), 1, f) == 1;
+  for (int i = 0; i < h.n_cells && ok; i++) {
+    pyramid_box_split(pyr, 0, i, &view);
+    int start = pyr->point_start->at(i);
+    int count = pyr->point_start->at(i + 1) - start;
+    ok = write_ulls(f, view.split, d) && write_ints(f, &count, 1) &&
+      write_ints(f, &pyr->points->at(start), count);
+  }
+  for (int l = 0; l < pyr->n_levels && ok; l++) {
+    pyramid_level *level = &pyr->levels[l];
+    for (int i = 0; i < level->n_boxes && ok; i++) {
+      if (!keep[l][i]) {
+	continue;
+      }
+      pyramid_box_split(pyr, l, i, &view);
+      ok = write_ints(f, view.nsplit, d) && write_ulls(f, view.split, d) &&
+	write_ints(f, &level->n_points->at(i), 1) &&
+	write_doubles(f, &level->sum_y->at(i * m), m) &&
+	write_doubles(f, &sol->risk_cost->at(l)[i * m], m) &&
+	write_ints(f, &sol->choice->at(l)[i * m], m);
+    }
+  }
+  if (fclose(f)) {
+    ok = 0;
+  }
+  return ok;
+}
+
+static int run_shard(double *x, double *y, int n, int d, int m, int *kmax,
+		     double *gamma, double delta, double rho,
+		     const vector<int> &rows, const double *A,
+		     const int *shard_nsplit, int shard, const char *path) {
+  /* Solve the pyramid of one shard and write it out, in a worker process.
+   * Nothing here may call R.
+   *
+   * Args:
+   *   x, y, n, d, m, kmax: all of the data, as for new_box_pyramid.
+   *   gamma, delta, rho: parameters, as for solve_box_pyramid.
+   *   rows: rows (0-relative) of the points in the shard.
+   *   A: array of m doubles, bound on |y| over all of the rows.
+   *   shard_nsplit: array of d integers, splits of the shard.
+   *   shard: index of the shard.
+   *   path: name of the file to write.
+   * Returns:
+   *   1 on success, 0 if the file could not be written.
+   */
+  int n_shard = rows.size();
+  vector<double> x_shard((size_t)n_shard * d), y_shard((size_t)n_shard * m);
+  for (int i = 0; i < n_shard; i++) {
+    for (int j = 0; j < d; j++) {
+      x_shard[i + (size_t)j * n_shard] = x[rows[i] + (size_t)j * n];
+    }
+    for (int c = 0; c < m; c++) {
+      y_shard[i + (size_t)c * n_shard] = y[rows[i] + (size_t)c * n];
+    }
+  }
+  box_pyramid *pyr = new_box_pyramid(&x_shard[0], &y_shard[0], n_shard, d, m,
+				     kmax);
+  set_pyramid_rows(pyr, &rows[0], n, 1, A);
+  pyramid_solution *sol = solve_box_pyramid(pyr, gamma, delta, rho, 0);
+  int ok = write_shard_file(path, shard, pyr, sol, shard_nsplit);
+  free_pyramid_solution(sol);
+  free_box_pyramid(pyr);
+  return ok;
+}
+
+static int add_shard_node(shard_tree *tree, box_split *split) {
+  /* Append a box to the tree, with empty aggregates. */
+  int d = tree->d;
+  int m = tree->m;
+  int i = tree->n_points.size();
+  tree->nsplit.insert(tree->nsplit.end(), split->nsplit, split->nsplit + d);
+  tree->split.insert(tree->split.end(), split->split, split->split + d);
+  tree->n_points.push_back(0);
+  tree->sum_y.resize(tree->sum_y.size() + m, 0.0);
+  tree->risk_cost.resize(tree->risk_cost.size() + m, 0.0);
+  tree->choice.resize(tree->choice.size() + m, -1);
+  tree->children.resize(tree->children.size() + 2 * d, -1);
+  tree->top.push_back(0);
+  tree->index[BoxSplitKey(split, tree->info)] = i;
+  return i;
+}
+
+static void shard_node_split(shard_tree *tree, int i, box_split *view) {
+  /* Point a box_split at a box of the tree, valid until a box is added. */
+  view->d      = tree->d;
+  view->nsplit = &tree->nsplit[(size_t)i * tree->d];
+  view->split  = &tree->split[(size_t)i * tree->d];
+}
+
+static int find_shard_node(shard_tree *tree, box_split *split) {
+  map<BoxSplitKey, int>::iterator it =
+    tree->index.find(BoxSplitKey(split, tree->info));
+  return it == tree->index.end() ? -1 : it->second;
+}
+
+static int read_shard_file(const char *path, int shard, shard_tree *tree,
+			   shard_cells *cells) {
+  /* Read the boxes written by write_shard_file.
+   *
+   * Args:
+   *   path: name of the file.
+   *   shard: index of the shard the file should hold.
+   *   tree: pointer to the tree to add the solved boxes to.
+   *   cells: pointer to the finest boxes to add to.
+   * Returns:
+   *   1 on success, 0 if the file is missing or corrupt.
+   */
+  int d = tree->d;
+  int m = tree->m;
+  FILE *f = fopen(path, "rb");
+  if (!f) {
+    return 0;
+  }
+  shard_header h;
+  if (fread(&h, sizeof(h), 1, f) != 1 ||
+      strncmp(h.magic, SHARD_MAGIC, sizeof(h.magic)) ||
+      h.version != SHARD_VERSION || h.d != d || h.m != m ||
+      h.shard != shard || h.n_cells < 0 || h.n_nodes < 0) {
+    fclose(f);
+    return 0;
+  }
+
+  int ok = 1;
+  for (int i = 0; i < h.n_cells && ok; i++) {
+    size_t first = cells->split.size();
+    cells->split.resize(first + d);
+    int count;
+    ok = read_ulls(f, &cells->split[first], d) && read_ints(f, &count, 1) &&
+      count > 0;
+    if (ok) {
+      size_t start = cells->points.size();
+      cells->points.resize(start + count);
+      ok = read_ints(f, &cells->points[start], count);
+      cells->start.push_back(cells->points.size());
+    }
+  }
+
+  box_split *split = new_box_split(d);
+  vector<double> sum_y(m), risk_cost(m);
+  vector<int> choice(m);
+  for (int k = 0; k < h.n_nodes && ok; k++) {
+    int n_points;
+    ok = read_ints(f, split->nsplit, d) && read_ulls(f, split->split, d) &&
+      read_ints(f, &n_points, 1) && read_doubles(f, &sum_y[0], m) &&
+      read_doubles(f, &risk_cost[0], m) && read_ints(f, &choice[0], m);
+    for (int j = 0; j < d && ok; j++) {
+      ok = split->nsplit[j] >= 0 && split->nsplit[j] <= MAX_SPLITS;
+    }
+    if (!ok) {
+      break;
+    }
+    int i = add_shard_node(tree, split);
+    tree->n_points[i] = n_points;
+    for (int c = 0; c < m; c++) {
+      tree->sum_y[i * m + c]     = sum_y[c];
+      tree->risk_cost[i * m + c] = risk_cost[c];
+      tree->choice[i * m + c]    = choice[c];
+    }
+  }
+  free_box_split(split);
+  fclose(f);
+  return ok;
+}
+
+static void solve_top_node(shard_tree *tree, int i, levelset_args *la) {
+  /* Aggregate a top box from its children and find its optimal split, the
+   * way build_pyramid_level and solve_box_pyramid do.
+   *
+   * Args:
+   *   tree: pointer to the tree, every child of the box solved.
+   *   i: integer, index of the top box.
+   *   la: array of m levelset_args, one per response.
+   */
+  int d = tree->d;
+  int m = tree->m;
+  for (int j = 0; j < d; j++) {
+    int *child = &tree->children[((size_t)i * d + j) * 2];
+    if (child[0] < 0 && child[1] < 0) {
+      continue;
+    }
+    for (int side = 0; side < 2; side++) {
+      if (child[side] < 0) {
+	continue;
+      }
+      tree->n_points[i] += tree->n_points[child[side]];
+      for (int c = 0; c < m; c++) {
+	tree->sum_y[i * m + c] += tree->sum_y[child[side] * m + c];
+      }
+    }
+    break;
+  }
+
+  box_split view;
+  shard_node_split(tree, i, &view);
+  int tree_level = split_tree_level(&view);
+  for (int c = 0; c < m; c++) {
+    double risk = inset_risk_from_sum(tree->n_points[i],
+				      tree->sum_y[i * m + c], la[c].gamma,
+				      la[c].A);
+    double risk_cost = levelset_cost_from_risk(risk, tree_level,
+					       tree->n_points[i],
+					       &la[c]).risk_cost;
+    int choice = -1;
+    for (int j = 0; j < d; j++) {
+      int *child = &tree->children[((size_t)i * d + j) * 2];
+      if (child[0] < 0 && child[1] < 0) {
+	continue;
+      }
+      double split_cost =
+	(child[0] < 0 ? 0 : tree->risk_cost[child[0] * m + c]) +
+	(child[1] < 0 ? 0 : tree->risk_cost[child[1] * m + c]);
+      if (choice < 0 ? !(risk_cost < split_cost) : split_cost < risk_cost) {
+	risk_cost = split_cost;
+	choice = j;
+      }
+    }
+    tree->risk_cost[i * m + c] = risk_cost;
+    tree->choice[i * m + c] = choice;
+  }
+}
+
+static void merge_shards(shard_tree *tree, const int *kmax,
+			 const int *shard_nsplit, levelset_args *la) {
+  /* Build and solve the top boxes, from the most splits to none.  Every
+   * box names its parent in each dimension it is split in, which is
+   * created if it is a top box, so the parents of a level are complete
+   * once the level has been gone through.  Boxes inside a shard are linked
+   * to their parents too, for locating points in the terminal boxes.
+   *
+   * Args:
+   *   tree: pointer to the boxes read from the shards.
+   *   kmax: array of d integers, max number of splits in each dimension.
+   *   shard_nsplit: array of d integers, splits of the shards.
+   *   la: array of m levelset_args, one per response.
+   */
+  int d = tree->d;
+  int n_levels = total_splits(d, kmax) + 1;
+  vector<vector<int> > by_level(n_levels);
+  box_split view;
+  for (size_t i = 0; i < tree->n_points.size(); i++) {
+    shard_node_split(tree, i, &view);
+    by_level[split_tree_level(&view)].push_back(i);
+  }
+
+  box_split *parent = new_box_split(d);
+  for (int t = n_levels - 1; t >= 0; t--) {
+    for (size_t k = 0; k < by_level[t].size(); k++) {
+      int i = by_level[t][k];
+      if (tree->top[i]) {
+	solve_top_node(tree, i, la);
+      }
+      for (int j = 0; j < d; j++) {
+	shard_node_split(tree, i, &view);
+	if (!view.nsplit[j]) {
+	  continue;
+	}
+	int side = (view.split[j] >> (view.nsplit[j] - 1)) & 1;
+	copy_box_split2(parent, &view);
+	remove_split(parent, j);
+	int p = find_shard_node(tree, parent);
+	if (p < 0) {
+	  if (is_inside_shard(parent->nsplit, shard_nsplit, d)) {
+	    continue;
+	  }
+	  p = add_shard_node(tree, parent);
+	  tree->top[p] = 1;
+	  by_level[t - 1].push_back(p);
+	}
+	tree->children[((size_t)p * d + j) * 2 + side] = i;
+      }
+    }
+  }
+  free_box_split(parent);
+}
+
+static void get_shard_terminal_boxes(shard_tree *tree, int c, int i,
+				     levelset_args *la,
+				     vector<box *> &terminal,
+				     vector<int> &terminal_index) {
+  /* Collect the terminal boxes of the optimal tree below a box, as
+   * get_pyramid_terminal_boxes does, without their points.
+   *
+   * Args:
+   *   tree: pointer to the solved tree.
+   *   c: integer, response column.
+   *   i: integer, index of the box.
+   *   la: pointer to the levelset_args for response c.
+   *   terminal: vector of terminal boxes, added to.
+   *   terminal_index: index in terminal of each terminal box, set.
+   */
+  int d = tree->d;
+  int m = tree->m;
+  int j = tree->choice[i * m + c];
+  if (j >= 0) {
+    for (int side = 0; side < 2; side++) {
+      int child = tree->children[((size_t)i * d + j) * 2 + side];
+      if (child >= 0) {
+	get_shard_terminal_boxes(tree, c, child, la, terminal,
+				 terminal_index);
+      }
+    }
+    return;
+  }
+
+  box_split view;
+  shard_node_split(tree, i, &view);
+  box *p = new_box(&view);
+  double risk = inset_risk_from_sum(tree->n_points[i], tree->sum_y[i * m + c],
+				    la->gamma, la->A);
+  p->risk = levelset_cost_from_risk(risk, split_tree_level(&view),
+				    tree->n_points[i], la);
+  terminal_index[i] = terminal.size();
+  terminal.push_back(p);
+}
+
+static levelset_estimate shard_levelset_estimate(shard_tree *tree,
+						 shard_cells *cells, int root,
+						 int c, levelset_args la) {
+  /* Convert the optimal tree for one response into a levelset estimate.
+   * Each finest box is walked down from the root, along the split chosen
+   * at each box, to the terminal box holding its points. */
+  if (root < 0) {
+    return terminal_levelset_estimate(la, 0, NULL, 0);
+  }
+  int d = tree->d;
+  int m = tree->m;
+  vector<box *> terminal;
+  vector<int> terminal_index(tree->n_points.size(), -1);
+  get_shard_terminal_boxes(tree, c, root, &la, terminal, terminal_index);
+
+  int n_cells = cells->start.size() - 1;
+  for (int k = 0; k < n_cells; k++) {
+    const unsigned long long *split = &cells->split[(size_t)k * d];
+    int i = root;
+    int j;
+    while ((j = tree->choice[i * m + c]) >= 0) {
+      int side = (split[j] >> tree->nsplit[(size_t)i * d + j]) & 1;
+      i = tree->children[((size_t)i * d + j) * 2 + side];
+    }
+    box *p = terminal[terminal_index[i]];
+    for (int q = cells->start[k]; q < cells->start[k + 1]; q++) {
+      add_point(p, cells->points[q]);
+    }
+  }
+  return terminal_levelset_estimate(la, tree->risk_cost[root * m + c],
+				    terminal.empty() ? NULL : &terminal[0],
+				    terminal.size());
+}
+
+static string shard_path(const char *scratch, int shard) {
+  char suffix[32];
+  snprintf(suffix, sizeof(suffix), "-%d", shard);
+  return string(scratch) + suffix;
+}
+
+#ifndef _WIN32
+/* How often the coordinator looks for finished workers, in microseconds. */
+#define WORKER_POLL_USEC 10000
+
+static int wait_for_worker(vector<pid_t> &running, int (*interrupted)(void),
+			   int *succeeded) {
+  /* Wait for whichever running worker exits first and take it out of
+   * running.  Only the workers' own pids are waited for, so children
+   * started by anything else in the process are left alone.
+   *
+   * Args:
+   *   running: pids of the running workers, not empty.
+   *   interrupted: polled while waiting, or NULL.
+   *   succeeded: set to whether the worker wrote its shard.
+   * Returns:
+   *   1 once a worker has exited, 0 if interrupted returned non-zero
+   *   first.
+   */
+  for (;;) {
+    for (size_t i = 0; i < running.size(); i++) {
+      int status;
+      pid_t pid = waitpid(running[i], &status, WNOHANG);
+      if (pid == 0 || (pid < 0 && errno == EINTR)) {
+	continue;
+      }
+      /* A worker someone else reaped can't be trusted to have finished. */
+      *succeeded = pid > 0 && WIFEXITED(status) && WEXITSTATUS(status) == 0;
+      running.erase(running.begin() + i);
+      return 1;
+    }
+    if (interrupted && interrupted()) {
+      return 0;
+    }
+    usleep(WORKER_POLL_USEC);
+  }
+}
+
+static void kill_workers(vector<pid_t> &running) {
+  /* Stop every running worker and reap it. */
+  for (size_t i = 0; i < running.size(); i++) {
+    kill(running[i], SIGKILL);
+  }
+  for (size_t i = 0; i < running.size(); i++) {
+    int status;
+    while (waitpid(running[i], &status, 0) < 0 && errno == EINTR) {
+    }
+  }
+  running.clear();
+}
+#endif
+
+int sharded_levelsets(double *x, double *y, int n, int d, int m, int *kmax,
+		      double *gamma, double delta, double rho,
+		      int shard_splits, int n_workers, const char *scratch,
+		      int (*interrupted)(void), levelset_estimate *estimates,
+		      const char **message) {
+  /* Compute levelset estimates for several responses, solving the points
+   * of each shard in its own worker process.  The estimates are those of
+   * solve_box_pyramid.
+   *
+   * Args:
+   *   x: pointer to points, column centric array, n x d.
+   *   y: pointer to responses, column centric array, n x m.
+   *   n: number of points.
+   *   d: dimension.
+   *   m: number of response columns.
+   *   kmax: array of d integers, max number of splits in each dimension.
+   *   gamma: array of m thresholds, one per response.
+   *   delta: double, complexity factor.
+   *   rho: double, cost penalty.
+   *   shard_splits: integer, number of splits that define the shards,
+   *     between 1 and min(sum(kmax), MAX_SHARD_SPLITS).
+   *   n_workers: integer, most worker processes to run at once, 0 for one
+   *     per core.
+   *   scratch: prefix of the names of the files the workers write, removed
+   *     once read.
+   *   interrupted: polled while waiting for the workers, or NULL.  Once it
+   *     returns non-zero the workers are killed and the estimation fails.
+   *   estimates: array of m levelset estimates, set on success.
+   *   message: set to the reason on failure, left alone on success.
+   * Returns:
+   *   1 on success, 0 on failure.
+   */
+#ifdef _WIN32
+  *message = "sharded estimation needs fork(), which this platform lacks";
+  return 0;
+#else
+  /* A forked child only has the thread that forked it.  A lock another
+   * thread held, such as malloc's, stays locked in the child for good. */
+  if (levelset_jobs_running()) {
+    *message = "background estimates are running, collect or cancel them "
+      "first";
+    return 0;
+  }
+
+  vector<int> shard_nsplit(d);
+  shard_layout(d, kmax, shard_splits, &shard_nsplit[0]);
+  if (n_workers <= 0) {
+    n_workers = std::thread::hardware_concurrency();
+  }
+  if (n_workers <= 0) {
+    n_workers = 1;
+  }
+
+  /* A shard is named by the top splits of its points, dimension by
+   * dimension. */
+  vector<vector<int> > rows(1 << shard_splits);
+  vector<unsigned long long> splits((size_t)BIN_BLOCK * d);
+  for (int i = 0; i < n; i++) {
+    if (i % BIN_BLOCK == 0) {
+      bin_points(x, n, d, &shard_nsplit[0], i,
+		 n - i < BIN_BLOCK ? n - i : BIN_BLOCK, &splits[0]);
+    }
+    unsigned long long shard = 0;
+    for (int j = 0; j < d; j++) {
+      shard = (shard << shard_nsplit[j]) |
+	splits[(size_t)(i % BIN_BLOCK) * d + j];
+    }
+    rows[shard].push_back(i);
+  }
+
+  vector<double> A(m);
+  vector<levelset_args> la(m);
+  for (int c = 0; c < m; c++) {
+    A[c] = max_vector_fabs(y + (size_t)c * n, n) + 1.0;
+    la[c].d     = d;
+    la[c].kmax  = kmax;
+    la[c].n     = n;
+    la[c].x     = NULL;
+    la[c].y     = NULL;
+    la[c].A     = A[c];
+    la[c].gamma = gamma[c];
+    la[c].delta = delta;
+    la[c].rho   = rho;
+  }
+
+  /* Each worker is forked with its shard already in memory, and exits
+   * without running anything the parent registered. */
+  int ok = 1;
+  const char *reason = "a worker process failed to write its shard";
+  vector<pid_t> running;
+  vector<int> started;
+  for (size_t k = 0; k < rows.size() && ok; k++) {
+    if (rows[k].empty()) {
+      continue;
+    }
+    if ((int)running.size() >= n_workers) {
+      if (!wait_for_worker(running, interrupted, &ok)) {
+	reason = "the sharded estimation was interrupted";
+	ok = 0;
+      }
+      if (!ok) {
+	break;
+      }
+    }
+    string path = shard_path(scratch, k);
+    pid_t pid = fork();
+    if (pid < 0) {
+      reason = "could not start a worker process";
+      ok = 0;
+      break;
+    }
+    if (!pid) {
+      _exit(run_shard(x, y, n, d, m, kmax, gamma, delta, rho, rows[k], &A[0],
+		      &shard_nsplit[0], k, path.c_str()) ? 0 : 1);
+    }
+    running.push_back(pid);
+    started.push_back(k);
+  }
+  /* Once a worker has failed the others are of no use. */
+  while (!running.empty()) {
+    if (ok && !wait_for_worker(running, interrupted, &ok)) {
+      reason = "the sharded estimation was interrupted";
+      ok = 0;
+    }
+    if (!ok) {
+      kill_workers(running);
+    }
+  }
+
+  shard_tree tree;
+  tree.d    = d;
+  tree.m    = m;
+  tree.info = new_box_split_info(d, kmax);
+  shard_cells cells;
+  cells.start.push_back(0);
+  for (size_t k = 0; k < started.size(); k++) {
+    string path = shard_path(scratch, started[k]);
+    if (ok && !read_shard_file(path.c_str(), started[k], &tree, &cells)) {
+      reason = "could not read back the file of a shard";
+      ok = 0;
+    }
+    remove(path.c_str());
+  }
+
+  if (ok) {
+    merge_shards(&tree, kmax, &shard_nsplit[0], &la[0]);
+    box_split *root_split = new_box_split(d);
+    for (int j = 0; j < d; j++) {
+      root_split->nsplit[j] = 0;
+      root_split->split[j] = 0;
+    }
+    int root = find_shard_node(&tree, root_split);
+    free_box_split(root_split);
+    for (int c = 0; c < m; c++) {
+      estimates[c] = shard_levelset_estimate(&tree, &cells, root, c, la[c]);
+    }
+  }
+  free_box_split_info(tree.info);
+  if (!ok) {
+    *message = reason;
+  }
+  return ok;
+#endif
+}
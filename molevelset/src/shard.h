@@ -0,0 +1,49 @@
+#ifndef shard_h
+#define shard_h
+
+#include "molevelset.h"
+
+/* Sharded estimation splits the points across worker processes by the
+ * first s splits of the lattice, in the coarsest first, dimension by
+ * dimension order of the Morton keys, so shard k holds the points of one
+ * of the 2^s boxes with those splits.  Each worker builds and solves a
+ * box pyramid of its own points (see pyramid.h) and writes what the
+ * coordinator needs to a scratch file; the coordinator reads them back
+ * and solves the boxes that span several shards.
+ *
+ * A box is inside a shard when it has at least as many splits as the
+ * shard in every dimension, and a top box otherwise.  The aggregates and
+ * the optimal tree of a box inside a shard only depend on the points of
+ * that shard, so the worker solves them exactly, with the complexity
+ * penalty and A of all n points.  The children of a top box are top boxes
+ * or boundary boxes, boxes inside a shard with exactly the splits of the
+ * shard in some dimension, so each worker writes
+ *
+ *   - its finest boxes, with their points, and
+ *   - every boundary box and every box of the optimal tree below one, with
+ *     its aggregates, its optimal risk + cost and its choice of split.
+ *
+ * The coordinator builds the top boxes bottom up from their children, the
+ * same way build_pyramid_level does, and solves them with the same rule as
+ * solve_box_pyramid, so the estimates are the ones the pyramid finds
+ * without sharding.  The top boxes span all of the shards in the
+ * dimensions they are not split in, so the coordinator handles a thin
+ * slab of the lattice, not just the 2^s - 1 boxes above the shards.
+ *
+ * Workers are forked, one per shard and at most n_workers at a time, and
+ * hand their results back in files written in the native byte order.  A
+ * new worker starts as soon as any running one exits.  Forking is refused
+ * while background estimates run on other threads, see async.h.
+ * Nothing is pruned: no worker can tell whether a top box is pure, so
+ * every box inside a shard is solved. */
+#define SHARD_MAGIC "MLSSHARD"
+#define SHARD_VERSION 1
+#define MAX_SHARD_SPLITS 16
+
+int sharded_levelsets(double *x, double *y, int n, int d, int m, int *kmax,
+		      double *gamma, double delta, double rho,
+		      int shard_splits, int n_workers, const char *scratch,
+		      int (*interrupted)(void), levelset_estimate *estimates,
+		      const char **message);
+
+#endif
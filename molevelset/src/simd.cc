@@ -0,0 +1,272 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include <atomic>
+#include <vector>
+
+#include "box.h"
+#include "simd.h"
+
+#if (defined(__x86_64__) || defined(__i386__)) && defined(__GNUC__)
+#define SIMD_X86 1
+#include <immintrin.h>
+#endif
+
+typedef void (*bin_kernel)(const double *x, int n, int d, const int *kmax,
+			   int from, int count, unsigned long long *splits);
+
+static const char *level_names[] = {"generic", "sse4", "avx2", "avx512"};
+
+static void bin_points_generic(const double *x, int n, int d,
+			       const int *kmax, int from, int count,
+			       unsigned long long *splits) {
+  /* Bin a block of points one at a time, as point_to_box does. */
+  for (int j = 0; j < d; j++) {
+    const double *xj = x + (size_t)j * n + from;
+    for (int k = 0; k < count; k++) {
+      splits[(size_t)k * d + j] = point_to_split((double *)xj + k, 1,
+						 kmax[j]);
+    }
+  }
+}
+
+#ifdef SIMD_X86
+/* The vector kernels take the same steps as point_to_split, a lane per
+ * point: a point goes right of a split unless it is below it (so NaN goes
+ * right, the unordered compare), and the next split moves by exactly the
+ * divisor.  The points left over at the end of a block go through
+ * point_to_split. */
+
+__attribute__((target("sse4.1")))
+static void bin_points_sse4(const double *x, int n, int d, const int *kmax,
+			    int from, int count, unsigned long long *splits) {
+  for (int j = 0; j < d; j++) {
+    const double *xj = x + (size_t)j * n + from;
+    int k = 0;
+    for (; k + 2 <= count; k += 2) {
+      __m128d xv = _mm_loadu_pd(xj + k);
+      __m128d next = _mm_set1_pd(0.5);
+      __m128i split = _mm_setzero_si128();
+      double divisor = 0.25;
+      for (int i = 0; i < kmax[j]; i++) {
+	__m128d right = _mm_cmpnlt_pd(xv, next);
+	__m128i bit = _mm_set1_epi64x((long long)(1ULL << i));
+	split = _mm_or_si128(split,
+			     _mm_and_si128(_mm_castpd_si128(right), bit));
+	next = _mm_add_pd(next, _mm_blendv_pd(_mm_set1_pd(-divisor),
+					      _mm_set1_pd(divisor), right));
+	divisor = divisor / 2;
+      }
+      unsigned long long s[2];
+      _mm_storeu_si128((__m128i *)s, split);
+      for (int l = 0; l < 2; l++) {
+	splits[(size_t)(k + l) * d + j] = s[l];
+      }
+    }
+    for (; k < count; k++) {
+      splits[(size_t)k * d + j] = point_to_split((double *)xj + k, 1,
+						 kmax[j]);
+    }
+  }
+}
+
+__attribute__((target("avx2")))
+static void bin_points_avx2(const double *x, int n, int d, const int *kmax,
+			    int from, int count, unsigned long long *splits) {
+  for (int j = 0; j < d; j++) {
+    const double *xj = x + (size_t)j * n + from;
+    int k = 0;
+    for (; k + 4 <= count; k += 4) {
+      __m256d xv = _mm256_loadu_pd(xj + k);
+      __m256d next = _mm256_set1_pd(0.5);
+      __m256i split = _mm256_setzero_si256();
+      double divisor = 0.25;
+      for (int i = 0; i < kmax[j]; i++) {
+	__m256d right = _mm256_cmp_pd(xv, next, _CMP_NLT_UQ);
+	__m256i bit = _mm256_set1_epi64x((long long)(1ULL << i));
+	split = _mm256_or_si256(split,
+				_mm256_and_si256(_mm256_castpd_si256(right),
+						 bit));
+	next = _mm256_add_pd(next,
+			     _mm256_blendv_pd(_mm256_set1_pd(-divisor),
+					      _mm256_set1_pd(divisor), right));
+	divisor = divisor / 2;
+      }
+      unsigned long long s[4];
+      _mm256_storeu_si256((__m256i *)s, split);
+      for (int l = 0; l < 4; l++) {
+	splits[(size_t)(k + l) * d + j] = s[l];
+      }
+    }
+    for (; k < count; k++) {
+      splits[(size_t)k * d + j] = point_to_split((double *)xj + k, 1,
+						 kmax[j]);
+    }
+  }
+}
+
+__attribute__((target("avx512f")))
+static void bin_points_avx512(const double *x, int n, int d,
+			      const int *kmax, int from, int count,
+			      unsigned long long *splits) {
+  for (int j = 0; j < d; j++) {
+    const double *xj = x + (size_t)j * n + from;
+    int k = 0;
+    for (; k + 8 <= count; k += 8) {
+      __m512d xv = _mm512_loadu_pd(xj + k);
+      __m512d next = _mm512_set1_pd(0.5);
+      __m512i split = _mm512_setzero_si512();
+      double divisor = 0.25;
+      for (int i = 0; i < kmax[j]; i++) {
+	__mmask8 right = _mm512_cmp_pd_mask(xv, next, _CMP_NLT_UQ);
+	__m512i bit = _mm512_set1_epi64((long long)(1ULL << i));
+	split = _mm512_mask_or_epi64(split, right, split, bit);
+	next = _mm512_add_pd(next,
+			     _mm512_mask_blend_pd(right,
+						  _mm512_set1_pd(-divisor),
+						  _mm512_set1_pd(divisor)));
+	divisor = divisor / 2;
+      }
+      unsigned long long s[8];
+      _mm512_storeu_si512((void *)s, split);
+      for (int l = 0; l < 8; l++) {
+	splits[(size_t)(k + l) * d + j] = s[l];
+      }
+    }
+    for (; k < count; k++) {
+      splits[(size_t)k * d + j] = point_to_split((double *)xj + k, 1,
+						 kmax[j]);
+    }
+  }
+}
+
+static bin_kernel bin_kernels[] = {bin_points_generic, bin_points_sse4,
+				   bin_points_avx2, bin_points_avx512};
+#else
+static bin_kernel bin_kernels[] = {bin_points_generic, bin_points_generic,
+				   bin_points_generic, bin_points_generic};
+#endif
+
+/* Level in use, SIMD_AUTO until init_simd has run. */
+static std::atomic<int> current_level(SIMD_AUTO);
+
+int simd_supported_level(void) {
+  /* The highest level that the CPU and the OS support. */
+#ifdef SIMD_X86
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx512f")) {
+    return SIMD_AVX512;
+  }
+  if (__builtin_cpu_supports("avx2")) {
+    return SIMD_AVX2;
+  }
+  if (__builtin_cpu_supports("sse4.1")) {
+    return SIMD_SSE4;
+  }
+#endif
+  return SIMD_GENERIC;
+}
+
+void init_simd(void) {
+  /* Pick the kernels when the library is loaded, the best supported
+   * unless MOLEVELSET_SIMD names a level. */
+  const char *name = getenv("MOLEVELSET_SIMD");
+  int level = name ? simd_level_from_name(name) : SIMD_AUTO;
+  set_simd_level(level < SIMD_AUTO ? SIMD_AUTO : level);
+}
+
+int simd_level(void) {
+  /* The level of the kernels in use. */
+  if (current_level.load() == SIMD_AUTO) {
+    init_simd();
+  }
+  return current_level.load();
+}
+
+int set_simd_level(int level) {
+  /* Force the level of the kernels.
+   *
+   * Args:
+   *   level: integer, SIMD_GENERIC to SIMD_AVX512, or SIMD_AUTO for the
+   *     best supported.  A level above the best supported is lowered to
+   *     it.
+   * Returns:
+   *   the level now in use.
+   */
+  int supported = simd_supported_level();
+  if (level == SIMD_AUTO || level > supported) {
+    level = supported;
+  }
+  if (level < SIMD_GENERIC) {
+    level = SIMD_GENERIC;
+  }
+  current_level.store(level);
+  return level;
+}
+
+const char *simd_level_name(int level) {
+  /* Name of a level, "auto" for SIMD_AUTO. */
+  if (level < SIMD_GENERIC || level > SIMD_AVX512) {
+    return "auto";
+  }
+  return level_names[level];
+}
+
+int simd_level_from_name(const char *name) {
+  /* Level of a name, SIMD_AUTO for "auto" and SIMD_AUTO - 1 for a name
+   * that isn't a level. */
+  if (!strcmp(name, "auto")) {
+    return SIMD_AUTO;
+  }
+  for (int level = SIMD_GENERIC; level <= SIMD_AVX512; level++) {
+    if (!strcmp(name, level_names[level])) {
+      return level;
+    }
+  }
+  return SIMD_AUTO - 1;
+}
+
+void bin_points(const double *x, int n, int d, const int *kmax, int from,
+		int count, unsigned long long *splits) {
+  /* Find the finest splits of a block of points.
+   *
+   * Args:
+   *   x: pointer to the n x d column major matrix of points, in the unit
+   *     cube.
+   *   n: integer, number of points in x.
+   *   d: integer, number of dimensions.
+   *   kmax: array of d integers, number of splits in each dimension.
+   *   from: integer, first point of the block.
+   *   count: integer, number of points in the block.
+   *   splits: array of count * d split words, set to the splits of the
+   *     block's points, d words per point, as point_to_box gives them.
+   */
+  bin_kernels[simd_level()](x, n, d, kmax, from, count, splits);
+}
+
+void bin_points_float(const float *x, int n, int d, const int *kmax,
+		      const double *offset, const double *scale, int from,
+		      int count, unsigned long long *splits) {
+  /* bin_points for single precision points in their original coordinates.
+   *
+   * Each point is widened and mapped into the unit cube, (x - offset) /
+   * scale in double as forward.transform.X does, into a buffer for the
+   * block, so the splits are those of the double points R would have
+   * passed and the full double copy is never made.
+   *
+   * Args:
+   *   x: pointer to the n x d column major matrix of points.
+   *   offset, scale: arrays of d doubles, the map of each dimension into
+   *     the unit cube.
+   *   the rest as for bin_points.
+   */
+  std::vector<double> block((size_t)count * d + 1);
+  for (int j = 0; j < d; j++) {
+    const float *xj = x + (size_t)j * n + from;
+    double *bj = &block[(size_t)j * count];
+    for (int k = 0; k < count; k++) {
+      bj[k] = ((double)xj[k] - offset[j]) / scale[j];
+    }
+  }
+  bin_kernels[simd_level()](&block[0], count, d, kmax, 0, count, splits);
+}
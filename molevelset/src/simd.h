@@ -0,0 +1,42 @@
+#ifndef simd_h
+#define simd_h
+
+/* Kernels with one version per x86 instruction set level.
+ *
+ * The package is built once for the baseline of its platform, so the
+ * kernels that gain from wider vectors are compiled again for each level
+ * with target attributes, and a dispatch table picks the best version the
+ * CPU (and its OS) supports when the library is loaded.  Every version
+ * gives bit for bit the same results, only the speed differs.
+ *
+ * The level may be forced down for benchmarking, with set_simd_level or
+ * with the MOLEVELSET_SIMD environment variable ("generic", "sse4",
+ * "avx2" or "avx512") read when the library is loaded.  Other platforms
+ * and compilers only have the generic versions.
+ *
+ * Only binning has a vector kernel.  inset_risk and the pyramid sums add
+ * in a fixed order that the estimates depend on to the last bit, and key
+ * packing loops over the dimensions, too short to vectorize. */
+#define SIMD_AUTO    -1
+#define SIMD_GENERIC 0
+#define SIMD_SSE4    1
+#define SIMD_AVX2    2
+#define SIMD_AVX512  3
+
+/* Points binned at a time by callers of bin_points. */
+#define BIN_BLOCK 256
+
+void init_simd(void);
+int simd_supported_level(void);
+int simd_level(void);
+int set_simd_level(int level);
+const char *simd_level_name(int level);
+int simd_level_from_name(const char *name);
+
+void bin_points(const double *x, int n, int d, const int *kmax, int from,
+		int count, unsigned long long *splits);
+void bin_points_float(const float *x, int n, int d, const int *kmax,
+		      const double *offset, const double *scale, int from,
+		      int count, unsigned long long *splits);
+
+#endif
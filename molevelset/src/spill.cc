@@ -0,0 +1,230 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include <set>
+
+#include <R.h>
+
+#include "checkpoint.h"
+#include "molevelset.h"
+#include "spill.h"
+
+using std::set;
+using std::vector;
+
+/* Rough overhead of one entry in a std::map, beyond its key and value. */
+#define MAP_NODE_BYTES 32
+
+static double box_bytes(box *p) {
+  /* Estimate the memory held by a box. */
+  return sizeof(box) + sizeof(box_split) + sizeof(vector<int>) +
+    p->split->d * (2 * sizeof(int) + sizeof(unsigned long long)) +
+    p->points->capacity() * sizeof(int) +
+    sizeof(BoxSplitKey) + sizeof(box *) + MAP_NODE_BYTES;
+}
+
+static double level_bytes(box_collection *pc) {
+  /* Estimate the memory held by a level. */
+  double bytes = sizeof(box_collection);
+  box **boxes = list_boxes(pc);
+  for (int i = 0; boxes[i]; i++) {
+    bytes += box_bytes(boxes[i]);
+  }
+  free(boxes);
+  return bytes;
+}
+
+static void drop_inner_points(box_collection *pc) {
+  /* Free the points of the non-terminal boxes in a finished level. */
+  box **boxes = list_boxes(pc);
+  for (int i = 0; boxes[i]; i++) {
+    if (!boxes[i]->terminal_box) {
+      vector<int>().swap(*boxes[i]->points);
+    }
+  }
+  free(boxes);
+}
+
+level_spill *new_level_spill(double budget, const char *path) {
+  /* Create a spill for compute_levelset.
+   *
+   * Args:
+   *   budget: double, memory budget in bytes.
+   *   path: name of the scratch file, or NULL for a temporary file.  The
+   *     file is removed by free_level_spill.
+   * Returns:
+   *   pointer to the new spill.
+   */
+  level_spill *s = (level_spill *)malloc(sizeof(level_spill));
+  s->budget    = budget;
+  s->path      = path ? strdup(path) : NULL;
+  s->f         = NULL;
+  s->failed    = 0;
+  s->n_written = 0;
+  s->n_freed   = 0;
+  s->offset    = new vector<long>;
+  s->bytes     = new vector<double>;
+  return s;
+}
+
+void free_level_spill(level_spill *s) {
+  /* Close and remove the scratch file and free the spill. */
+  if (!s) {
+    return;
+  }
+  if (s->f) {
+    fclose(s->f);
+    if (s->path) {
+      remove(s->path);
+    }
+  }
+  free(s->path);
+  delete s->offset;
+  delete s->bytes;
+  free(s);
+}
+
+static int write_levels(level_spill *s, box_collection **pc, int level) {
+  /* Write every level up to and including level to the scratch file.  A
+   * level is always written while the level below it is still in memory,
+   * since its record names its children. */
+  if (!s->f) {
+    s->f = s->path ? fopen(s->path, "w+b") : tmpfile();
+    if (!s->f) {
+      return BOX_ERROR;
+    }
+  }
+  for (; s->n_written <= level; s->n_written++) {
+    if (fseek(s->f, 0, SEEK_END)) {
+      return BOX_ERROR;
+    }
+    s->offset->push_back(ftell(s->f));
+    if (write_checkpoint_level(s->f, s->n_written, pc[s->n_written]) !=
+	BOX_SUCCESS) {
+      s->offset->pop_back();
+      return BOX_ERROR;
+    }
+  }
+  return BOX_SUCCESS;
+}
+
+int spill_levels(level_spill *s, box_collection **pc, int level) {
+  /* Called by compute_levelset once a level is complete.  Levels below it
+   * are finished and are spilled, finest first, while the levels in memory
+   * are over budget.
+   *
+   * Args:
+   *   s: pointer to the spill.
+   *   pc: array of levels.
+   *   level: integer, index of the level just completed.
+   * Returns:
+   *   BOX_SUCCESS, or BOX_ERROR the first time the scratch file can't be
+   *   written.  From then on the remaining levels stay in memory.
+   */
+  s->bytes->resize(level + 1);
+  if (level) {
+    drop_inner_points(pc[level - 1]);
+    s->bytes->at(level - 1) = level_bytes(pc[level - 1]);
+  }
+  s->bytes->at(level) = level_bytes(pc[level]);
+  if (s->failed) {
+    return BOX_SUCCESS;
+  }
+
+  double total = 0;
+  for (int l = s->n_freed; l <= level; l++) {
+    total += s->bytes->at(l);
+  }
+
+  /* Once spilling has started every new level is written straight away,
+   * while its children are still in memory. */
+  if (total <= s->budget && !s->n_written) {
+    return BOX_SUCCESS;
+  }
+  if (write_levels(s, pc, level) != BOX_SUCCESS) {
+    s->failed = 1;
+    return BOX_ERROR;
+  }
+
+  for (; total > s->budget && s->n_freed < level; s->n_freed++) {
+    total -= s->bytes->at(s->n_freed);
+    free_box_collection(pc[s->n_freed]);
+    pc[s->n_freed] = NULL;
+  }
+  return BOX_SUCCESS;
+}
+
+static void find_boundary(box *p, int level, int boundary,
+			  box_split_info *info, set<BoxSplitKey> *keep) {
+  /* Find the reachable non-terminal boxes in the lowest level still in
+   * memory, their children have been freed. */
+  if (!p || p->terminal_box) {
+    return;
+  }
+  if (level == boundary) {
+    keep->insert(BoxSplitKey(p->split, info));
+    return;
+  }
+  find_boundary(p->children[0], level - 1, boundary, info, keep);
+  find_boundary(p->children[1], level - 1, boundary, info, keep);
+}
+
+int restore_levels(level_spill *s, box_collection **pc, int max_depth) {
+  /* Read back the freed boxes that are part of the final tree.
+   *
+   * Args:
+   *   s: pointer to the spill.
+   *   pc: array of levels, the top level must be in memory.
+   *   max_depth: integer, number of levels.
+   * Returns:
+   *   BOX_SUCCESS if the tree below the top box is complete, BOX_ERROR
+   *   otherwise.
+   */
+  int boundary = s->n_freed;
+  if (!boundary) {
+    return BOX_SUCCESS;
+  }
+  box_split_info *info = pc[max_depth - 1]->info;
+  int d = info->d;
+
+  /* The children of the boundary boxes come from the boundary level's own
+   * record.  Its boxes are read into a scratch collection only to find
+   * the splits of those children. */
+  set<BoxSplitKey> keep;
+  find_boundary(get_first_box(pc[max_depth - 1]), max_depth - 1, boundary,
+		info, &keep);
+
+  vector<checkpoint_link> links;
+  box_collection *tmp = new_box_collection(info);
+  int ok = !fseek(s->f, s->offset->at(boundary), SEEK_SET) &&
+    read_checkpoint_level(s->f, boundary, d, tmp, &keep, &links) ==
+    BOX_SUCCESS;
+  for (size_t i = 0; i < links.size(); i++) {
+    box *parent = find_box(pc[boundary], links[i].parent->split);
+    if (parent) {
+      links[i].parent = parent;
+    } else {
+      ok = 0;
+    }
+  }
+
+  /* Then level by level, top down, keeping only the children named by the
+   * level above. */
+  for (int l = boundary - 1; l >= 0; l--) {
+    keep.clear();
+    for (size_t i = 0; i < links.size(); i++) {
+      keep.insert(BoxSplitKey(links[i].split, info));
+    }
+    vector<checkpoint_link> below;
+    pc[l] = new_box_collection(info);
+    ok = ok && !fseek(s->f, s->offset->at(l), SEEK_SET) &&
+      read_checkpoint_level(s->f, l, d, pc[l], &keep, &below) == BOX_SUCCESS;
+    ok = link_checkpoint_children(&links, pc[l]) == BOX_SUCCESS && ok;
+    links.swap(below);
+  }
+  ok = link_checkpoint_children(&links, NULL) == BOX_SUCCESS && ok;
+  free_box_collection(tmp);
+
+  s->n_freed = 0;
+  return ok ? BOX_SUCCESS : BOX_ERROR;
+}
@@ -0,0 +1,39 @@
+#ifndef spill_h
+#define spill_h
+
+#include <stdio.h>
+
+#include <vector>
+
+#include "box.h"
+
+/* Keeps the levels of compute_levelset within a memory budget.
+ *
+ * Once a level has been collapsed into its parents it is only needed to
+ * find the terminal boxes of the final tree.  When the levels in memory
+ * grow past the budget, the points of non-terminal boxes in finished
+ * levels are dropped (they are never used again) and then whole finished
+ * levels, finest first, are written to a scratch file with the checkpoint
+ * level format and freed.  restore_levels streams back only the boxes
+ * reachable from the top of the tree, top down, before the estimate is
+ * extracted. */
+typedef struct {
+  double budget;               /* Memory budget in bytes. */
+  char *path;                  /* Name of the scratch file, NULL for an
+				  anonymous temporary file. */
+  FILE *f;                     /* Scratch file, NULL until it is needed. */
+  int failed;                  /* Set once the scratch file can't be
+				  written, no more levels are freed. */
+  int n_written;               /* Levels 0 to n_written - 1 are in the
+				  scratch file. */
+  int n_freed;                 /* Levels 0 to n_freed - 1 are freed. */
+  std::vector<long> *offset;   /* Offset of each level in the file. */
+  std::vector<double> *bytes;  /* Estimated size of each level. */
+} level_spill;
+
+level_spill *new_level_spill(double budget, const char *path);
+void free_level_spill(level_spill *);
+int spill_levels(level_spill *, box_collection **pc, int level);
+int restore_levels(level_spill *, box_collection **pc, int max_depth);
+
+#endif
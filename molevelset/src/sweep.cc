@@ -0,0 +1,86 @@
+#include <atomic>
+#include <thread>
+#include <vector>
+
+#include "sweep.h"
+
+using std::vector;
+
+typedef struct {
+  box_pyramid *pyr;             /* Pyramid of the finest lattice. */
+  int n_k;                      /* Number of lattices. */
+  const int *kmax;              /* Limits of each lattice, n_k x d. */
+  double *gamma;                /* Threshold for each response. */
+  double delta;                 /* Complexity factor. */
+  double rho;                   /* Cost penalty. */
+  int prune;                    /* Passed to solve_box_pyramid. */
+  levelset_estimate *estimates; /* Estimates, n_k x m. */
+  std::atomic<int> next;        /* Next lattice to take. */
+} sweep_state;
+
+static void sweep_worker(sweep_state *s) {
+  /* Take lattices until none are left. */
+  int d = s->pyr->d, m = s->pyr->m;
+  for (int k = s->next++; k < s->n_k; k = s->next++) {
+    box_pyramid *pyr = coarsen_box_pyramid(s->pyr, s->kmax + k * d);
+    pyramid_solution *sol = solve_box_pyramid(pyr, s->gamma, s->delta,
+					      s->rho, s->prune);
+    for (int c = 0; c < m; c++) {
+      s->estimates[k * m + c] = pyramid_levelset_estimate(pyr, sol, c,
+							  s->delta, s->rho);
+    }
+    free_pyramid_solution(sol);
+    free_box_pyramid(pyr);
+  }
+}
+
+void sweep_box_pyramid(box_pyramid *pyr, int n_k, const int *kmax,
+		       double *gamma, double delta, double rho, int prune,
+		       int n_threads, levelset_estimate *estimates) {
+  /* Estimate the levelset of every response on several lattices.
+   *
+   * Args:
+   *   pyr: pointer to the pyramid of the finest lattice, it is only read.
+   *   n_k: integer, number of lattices.
+   *   kmax: array of n_k x d integers, the max number of splits in each
+   *     dimension for each lattice, lattice by lattice.  No lattice may be
+   *     finer than pyr->kmax.
+   *   gamma: array of pyr->m thresholds, one per response.
+   *   delta: double, complexity factor.
+   *   rho: double, cost penalty.
+   *   prune: integer, passed to solve_box_pyramid.
+   *   n_threads: integer, most worker threads to use, 0 for one per
+   *     hardware thread.
+   *   estimates: array of n_k x pyr->m estimates, populated lattice by
+   *     lattice.
+   */
+  sweep_state s;
+  s.pyr       = pyr;
+  s.n_k       = n_k;
+  s.kmax      = kmax;
+  s.gamma     = gamma;
+  s.delta     = delta;
+  s.rho       = rho;
+  s.prune     = prune;
+  s.estimates = estimates;
+  s.next      = 0;
+
+  if (n_threads <= 0) {
+    n_threads = std::thread::hardware_concurrency();
+  }
+  if (n_threads > n_k) {
+    n_threads = n_k;
+  }
+  if (n_threads <= 1) {
+    sweep_worker(&s);
+    return;
+  }
+
+  vector<std::thread> workers;
+  for (int t = 0; t < n_threads; t++) {
+    workers.push_back(std::thread(sweep_worker, &s));
+  }
+  for (int t = 0; t < n_threads; t++) {
+    workers[t].join();
+  }
+}
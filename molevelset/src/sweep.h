@@ -0,0 +1,17 @@
+#ifndef sweep_h
+#define sweep_h
+
+#include "molevelset.h"
+#include "pyramid.h"
+
+/* A kmax sweep estimates the levelset on several lattices from one
+ * binning of the points.  The points are binned once into the pyramid of
+ * the finest lattice, and each coarser lattice is derived from its finest
+ * boxes by coarsen_box_pyramid.  The lattices are independent, so they
+ * are built and solved on worker threads, one lattice at a time per
+ * thread.  Nothing on the worker threads calls R. */
+void sweep_box_pyramid(box_pyramid *pyr, int n_k, const int *kmax,
+		       double *gamma, double delta, double rho, int prune,
+		       int n_threads, levelset_estimate *estimates);
+
+#endif
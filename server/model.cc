@@ -0,0 +1,337 @@
+#include <stdio.h>
+#include <string.h>
+
+#include <algorithm>
+
+#include "model.h"
+
+using std::string;
+using std::vector;
+
+typedef struct {
+  const unsigned char *data; /* Contents of the file. */
+  size_t size;               /* Size of the file. */
+  size_t at;                 /* Next byte to read. */
+} model_reader;
+
+static int read_bytes(model_reader *r, size_t n, unsigned long long *value) {
+  /* Read an n byte little endian value, returns 0 past the end. */
+  if (r->size - r->at < n) {
+    return 0;
+  }
+  *value = 0;
+  for (size_t i = 0; i < n; i++) {
+    *value |= (unsigned long long)r->data[r->at + i] << (8 * i);
+  }
+  r->at += n;
+  return 1;
+}
+
+static int read_int(model_reader *r, int *value) {
+  unsigned long long v;
+  if (!read_bytes(r, 4, &v)) {
+    return 0;
+  }
+  *value = (int)(unsigned int)v;
+  return 1;
+}
+
+static int read_split(model_reader *r, unsigned long long *value) {
+  return read_bytes(r, 8, value);
+}
+
+static int read_double(model_reader *r, double *value) {
+  unsigned long long v;
+  if (!read_bytes(r, 8, &v)) {
+    return 0;
+  }
+  memcpy(value, &v, sizeof(double));
+  return 1;
+}
+
+typedef struct {
+  vector<double> offset;         /* Transform of each dimension. */
+  vector<double> scale;
+  vector<vector<double> > unit;  /* Knots of each dimension, empty for */
+  vector<vector<double> > x;     /* a uniform grid. */
+} model_transform;
+
+static double unit_to_x(const model_transform *t, int j, double unit) {
+  /* Map a coordinate of the unit cube back to the coordinates of X. */
+  double v = unit * t->scale[j] + t->offset[j];
+  const vector<double> &u = t->unit[j], &x = t->x[j];
+  if (u.empty()) {
+    return v;
+  }
+  size_t k = std::upper_bound(u.begin() + 1, u.end() - 1, v) - u.begin();
+  return x[k - 1] + (v - u[k - 1]) * (x[k] - x[k - 1]) / (u[k] - u[k - 1]);
+}
+
+typedef struct {
+  model *m;
+  const vector<int> *nsplit;     /* Splits of each box, n_boxes x d. */
+  const vector<unsigned long long> *split;
+  const model_transform *transform;
+  vector<int> cur_nsplit;        /* Box of the node being built. */
+  vector<double> unit_lo;
+  vector<double> unit_hi;
+} index_builder;
+
+static int build_index(index_builder *b, vector<int> &boxes) {
+  /* Build the node for the region holding some boxes, and the nodes below
+   * it.
+   *
+   * Args:
+   *   b: pointer to the builder, its current box is the region.
+   *   boxes: the boxes inside the region.
+   * Returns:
+   *   index of the node, -1 if the boxes overlap.
+   */
+  model *m = b->m;
+  int d = m->d;
+  model_node node = {-1, 0.0, {-1, -1}, -1};
+  int at = m->nodes.size();
+  m->nodes.push_back(node);
+  /* One box left needs no more decisions, the bounds of the box are
+   * checked at the end of every query. */
+  if (boxes.size() <= 1) {
+    m->nodes[at].box = boxes.empty() ? -1 : boxes[0];
+    return at;
+  }
+
+  /* Every box in the region is split along the dimension the region is
+   * split in next. */
+  int j;
+  for (j = 0; j < d; j++) {
+    size_t i;
+    for (i = 0; i < boxes.size() &&
+	   b->nsplit->at(boxes[i] * d + j) > b->cur_nsplit[j]; i++);
+    if (i == boxes.size()) {
+      break;
+    }
+  }
+  if (j == d) {
+    return -1;
+  }
+
+  vector<int> side[2];
+  for (size_t i = 0; i < boxes.size(); i++) {
+    int right = (b->split->at(boxes[i] * d + j) >> b->cur_nsplit[j]) & 1;
+    side[right].push_back(boxes[i]);
+  }
+  boxes.clear();
+
+  double lo = b->unit_lo[j], hi = b->unit_hi[j];
+  double mid = (lo + hi) / 2;
+  m->nodes[at].dim = j;
+  m->nodes[at].threshold = unit_to_x(b->transform, j, mid);
+  b->cur_nsplit[j]++;
+  for (int k = 0; k < 2; k++) {
+    b->unit_lo[j] = k ? mid : lo;
+    b->unit_hi[j] = k ? hi : mid;
+    int child = build_index(b, side[k]);
+    if (child < 0) {
+      return -1;
+    }
+    m->nodes[at].child[k] = child;
+  }
+  b->cur_nsplit[j]--;
+  b->unit_lo[j] = lo;
+  b->unit_hi[j] = hi;
+  return at;
+}
+
+int load_model(const string &path, model *m, string *error) {
+  /* Load a model file and build its index.
+   *
+   * Args:
+   *   path: name of the file.
+   *   m: pointer to the model to fill in, its name is left alone.
+   *   error: pointer to a string, set to the reason loading failed.
+   * Returns:
+   *   1 on success, 0 on failure.
+   */
+  FILE *f = fopen(path.c_str(), "rb");
+  if (!f) {
+    *error = "unable to open " + path;
+    return 0;
+  }
+  vector<unsigned char> data;
+  unsigned char buffer[65536];
+  size_t n_read;
+  while ((n_read = fread(buffer, 1, sizeof(buffer), f)) > 0) {
+    data.insert(data.end(), buffer, buffer + n_read);
+  }
+  fclose(f);
+
+  model_reader r = {data.empty() ? NULL : &data[0], data.size(), 0};
+  int version, d, n_boxes;
+  if (data.size() < 8 || memcmp(&data[0], "MOLEVSET", 8)) {
+    *error = path + " is not a molevelset model";
+    return 0;
+  }
+  r.at = 8;
+  if (!read_int(&r, &version) || !read_int(&r, &d) ||
+      !read_int(&r, &n_boxes)) {
+    *error = path + " is truncated";
+    return 0;
+  }
+  if (version < MODEL_MIN_VERSION || version > MODEL_VERSION) {
+    *error = path + " has an unsupported version";
+    return 0;
+  }
+  if (d < 1 || n_boxes < 0) {
+    *error = path + " is corrupt";
+    return 0;
+  }
+  /* Check the counts against the size of the file before allocating for
+   * them: the transform takes at least 16 bytes per dimension and a box
+   * 4 + 12 bytes per dimension. */
+  size_t left = data.size() - r.at;
+  if ((size_t)d > left / 16 ||
+      (size_t)n_boxes > (left - 16 * (size_t)d) / (4 + 12 * (size_t)d)) {
+    *error = path + " is truncated";
+    return 0;
+  }
+
+  model_transform t;
+  t.offset.resize(d);
+  t.scale.resize(d);
+  t.unit.resize(d);
+  t.x.resize(d);
+  vector<int> nsplit((size_t)n_boxes * d);
+  vector<unsigned long long> split((size_t)n_boxes * d);
+  m->d = d;
+  m->n_boxes = n_boxes;
+  m->path = path;
+  m->inset.assign(n_boxes, 0);
+  for (int j = 0; j < d; j++) {
+    if (!read_double(&r, &t.offset[j])) {
+      *error = path + " is truncated";
+      return 0;
+    }
+  }
+  for (int j = 0; j < d; j++) {
+    if (!read_double(&r, &t.scale[j])) {
+      *error = path + " is truncated";
+      return 0;
+    }
+  }
+  for (int j = 0; j < d && version >= 3; j++) {
+    int n_knots;
+    if (!read_int(&r, &n_knots)) {
+      *error = path + " is truncated";
+      return 0;
+    }
+    if (n_knots == 1 || n_knots < 0 ||
+	(size_t)n_knots > (data.size() - r.at) / 16) {
+      *error = path + " is corrupt";
+      return 0;
+    }
+    t.unit[j].resize(n_knots);
+    t.x[j].resize(n_knots);
+    int ok = 1;
+    for (int k = 0; k < n_knots && ok; k++) {
+      ok = read_double(&r, &t.unit[j][k]);
+    }
+    for (int k = 0; k < n_knots && ok; k++) {
+      ok = read_double(&r, &t.x[j][k]);
+    }
+    for (int k = 1; k < n_knots && ok; k++) {
+      if (!(t.unit[j][k - 1] < t.unit[j][k]) ||
+	  !(t.x[j][k - 1] < t.x[j][k])) {
+	*error = path + " is corrupt";
+	return 0;
+      }
+    }
+    if (!ok) {
+      *error = path + " is truncated";
+      return 0;
+    }
+  }
+  for (int i = 0; i < n_boxes; i++) {
+    int inset;
+    int ok = read_int(&r, &inset);
+    for (int j = 0; j < d && ok; j++) {
+      ok = read_int(&r, &nsplit[i * d + j]);
+    }
+    for (int j = 0; j < d && ok; j++) {
+      ok = read_split(&r, &split[i * d + j]);
+    }
+    if (!ok) {
+      *error = path + " is truncated";
+      return 0;
+    }
+    m->inset[i] = inset != 0;
+    for (int j = 0; j < d; j++) {
+      int k = nsplit[i * d + j];
+      if (k < 0 || k > MODEL_MAX_SPLITS || split[i * d + j] >> k) {
+	*error = path + " is corrupt";
+	return 0;
+      }
+    }
+  }
+
+  /* The corners of each box, as molevelset reports them. */
+  m->lo.resize((size_t)n_boxes * d);
+  m->hi.resize((size_t)n_boxes * d);
+  for (int i = 0; i < n_boxes; i++) {
+    for (int j = 0; j < d; j++) {
+      double x1 = 0, x2 = 1;
+      for (int k = 0; k < nsplit[i * d + j]; k++) {
+	double next_split = (x1 + x2) / 2;
+	if ((split[i * d + j] >> k) & 1) {
+	  x1 = next_split;
+	} else {
+	  x2 = next_split;
+	}
+      }
+      m->lo[i * d + j] = unit_to_x(&t, j, x1);
+      m->hi[i * d + j] = unit_to_x(&t, j, x2);
+    }
+  }
+
+  index_builder b;
+  b.m = m;
+  b.nsplit = &nsplit;
+  b.split = &split;
+  b.transform = &t;
+  b.cur_nsplit.assign(d, 0);
+  b.unit_lo.assign(d, 0.0);
+  b.unit_hi.assign(d, 1.0);
+  vector<int> boxes(n_boxes);
+  for (int i = 0; i < n_boxes; i++) {
+    boxes[i] = i;
+  }
+  m->nodes.clear();
+  if (build_index(&b, boxes) < 0) {
+    *error = path + " has overlapping boxes";
+    return 0;
+  }
+  return 1;
+}
+
+int model_find_box(const model *m, const double *x) {
+  /* Find the box holding a point.
+   *
+   * Args:
+   *   m: pointer to the model.
+   *   x: array of m->d coordinates.
+   * Returns:
+   *   index of the box, -1 if no box holds the point.
+   */
+  const model_node *node = &m->nodes[0];
+  while (node->dim >= 0) {
+    node = &m->nodes[node->child[x[node->dim] > node->threshold]];
+  }
+  int box = node->box;
+  if (box < 0) {
+    return -1;
+  }
+  for (int j = 0; j < m->d; j++) {
+    if (!(x[j] > m->lo[box * m->d + j] && x[j] <= m->hi[box * m->d + j])) {
+      return -1;
+    }
+  }
+  return box;
+}
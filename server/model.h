@@ -0,0 +1,64 @@
+#ifndef model_h
+#define model_h
+
+#include <string>
+#include <vector>
+
+/* A model is the set of terminal boxes of one levelset estimate, written
+ * by molevelset.save.model.  The file holds, every value little endian:
+ *
+ *   "MOLEVSET"              8 bytes.
+ *   version                 int32, MODEL_VERSION.
+ *   d                       int32, number of dimensions.
+ *   n_boxes                 int32, number of boxes.
+ *   offset, scale           2 x d doubles, the transform of X into the
+ *                           unit cube, x = unit * scale + offset.
+ *   then, from version 3, for each dimension:
+ *     n_knots               int32, 0 unless the splits are on a quantile
+ *                           grid.
+ *     unit, x               2 x n_knots doubles, the knots of the map of
+ *                           the dimension, both strictly increasing.  x is
+ *                           then the piecewise linear function of
+ *                           unit * scale + offset through the knots,
+ *                           continued along the end pieces.
+ *   then for each box:
+ *     inset                 int32, 1 if the box is in the levelset.
+ *     nsplit                d x int32, number of splits in each dimension.
+ *     split                 d x uint64, bit i is set when split i of the
+ *                           dimension, coarsest first, is to the right.
+ *
+ * The inset boxes come first, in the order of levelset.estimate$inset_boxes,
+ * then the rest in the order of non_inset_boxes.  A box is identified by
+ * its index in the file.
+ *
+ * The boxes are leaves of one dyadic tree, so the index is that tree
+ * rebuilt as a flat array of decision nodes: each node compares one
+ * coordinate with the midpoint of its box and a point reaches the only
+ * box that can hold it in at most sum(nsplit) steps.  Boxes hold a point
+ * x when lo < x <= hi in every dimension, as in in.molevelset. */
+#define MODEL_VERSION 3
+#define MODEL_MIN_VERSION 2
+#define MODEL_MAX_SPLITS 63
+
+typedef struct {
+  int dim;          /* Dimension compared, -1 for a leaf. */
+  double threshold; /* Points above it go to child[1]. */
+  int child[2];     /* Children, for nodes that aren't leaves. */
+  int box;          /* Box of a leaf, -1 for space no box covers. */
+} model_node;
+
+typedef struct {
+  std::string name;           /* Name queries use for the model. */
+  std::string path;           /* File the model was loaded from. */
+  int d;                      /* Number of dimensions. */
+  int n_boxes;                /* Number of boxes. */
+  std::vector<char> inset;    /* Is each box in the levelset. */
+  std::vector<double> lo;     /* Lower corner of each box, n_boxes x d. */
+  std::vector<double> hi;     /* Upper corner of each box, n_boxes x d. */
+  std::vector<model_node> nodes; /* The index, the root first. */
+} model;
+
+int load_model(const std::string &path, model *m, std::string *error);
+int model_find_box(const model *m, const double *x);
+
+#endif
@@ -0,0 +1,60 @@
+#ifndef protocol_h
+#define protocol_h
+
+#include <stdint.h>
+
+/* The query server speaks a binary protocol over a Unix domain socket.
+ * Both ends are on one machine, so every value is in the byte order of
+ * the host.  A connection carries any number of requests, each answered
+ * in turn.
+ *
+ * A request is a request_header, then name_length bytes naming the model,
+ * then for QUERY_INSET and QUERY_BOX, n_points x d doubles, point by
+ * point, in the columns of X the model was fit with.
+ *
+ * A response is a response_header, then n_items items:
+ *   QUERY_INSET  one byte per point, 1 if it is in the levelset.
+ *   QUERY_BOX    one int32 per point, the index of its box in the model
+ *                file, -1 for points in no box.
+ *   STATS        doubles: the number of queries timed, then the 50th,
+ *                90th, 99th and 99.9th percentile and the largest query
+ *                time, in microseconds, over the last STATS_WINDOW
+ *                queries.  The model name is ignored.
+ *   RELOAD       every model file is read again.  Nothing follows, and
+ *                n_items is the number of models that failed to load,
+ *                which keep their old boxes.  The model name is ignored.
+ * The d of the response header tells a client how many coordinates the
+ * model takes, a query with no points is the way to ask for it.  After an
+ * error the header is followed by nothing and the connection is closed,
+ * since the rest of the request can't be skipped reliably. */
+#define PROTOCOL_MAGIC 0x314c4f4dU  /* "MOL1". */
+
+#define QUERY_INSET 1
+#define QUERY_BOX   2
+#define STATS       3
+#define RELOAD      4
+
+#define STATUS_OK            0
+#define STATUS_UNKNOWN_MODEL 1  /* No model has that name. */
+#define STATUS_BAD_REQUEST   2  /* Bad magic, op or size. */
+
+#define STATS_WINDOW 65536
+#define MAX_NAME_LENGTH 4096
+#define MAX_REQUEST_POINTS (1 << 24)
+
+typedef struct {
+  uint32_t magic;        /* PROTOCOL_MAGIC. */
+  uint32_t op;           /* QUERY_INSET, QUERY_BOX, STATS or RELOAD. */
+  uint32_t name_length;  /* Length of the model name. */
+  uint32_t n_points;     /* Number of points to query. */
+} request_header;
+
+typedef struct {
+  uint32_t magic;        /* PROTOCOL_MAGIC. */
+  uint32_t status;       /* STATUS_OK or the error. */
+  uint32_t n_items;      /* Number of items following. */
+  uint32_t d;            /* Number of dimensions of the model, 0 if there
+			    is none. */
+} response_header;
+
+#endif
@@ -0,0 +1,159 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include <string>
+#include <vector>
+
+#include "protocol.h"
+
+using std::string;
+using std::vector;
+
+/* A small client for molevelset-server, for scripts and for checking a
+ * server by hand.  Points are read from stdin, one per line. */
+
+static int read_full(int fd, void *buffer, size_t n) {
+  char *at = (char *)buffer;
+  while (n) {
+    ssize_t got = read(fd, at, n);
+    if (got <= 0) {
+      return 0;
+    }
+    at += got;
+    n -= got;
+  }
+  return 1;
+}
+
+static int request(int fd, uint32_t op, const string &name,
+		   const vector<double> &points, uint32_t n_points,
+		   response_header *response) {
+  /* Send a request and read the header of its response. */
+  request_header header = {PROTOCOL_MAGIC, op, (uint32_t)name.size(),
+			   n_points};
+  if (write(fd, &header, sizeof(header)) != (ssize_t)sizeof(header) ||
+      write(fd, name.data(), name.size()) != (ssize_t)name.size() ||
+      (points.size() &&
+       write(fd, &points[0], sizeof(double) * points.size()) !=
+       (ssize_t)(sizeof(double) * points.size()))) {
+    return 0;
+  }
+  return read_full(fd, response, sizeof(*response)) &&
+    response->magic == PROTOCOL_MAGIC;
+}
+
+static void usage() {
+  fprintf(stderr,
+	  "usage: molevelset-query -s SOCKET -m MODEL [-b]  < points\n"
+	  "       molevelset-query -s SOCKET -t | -r\n"
+	  "\n"
+	  "  -m MODEL  print 1 or 0 for each point, in the levelset or not.\n"
+	  "  -b        print the index of the box of each point instead, -1\n"
+	  "            for none.\n"
+	  "  -t        print the query time percentiles of the server.\n"
+	  "  -r        reload the models of the server.\n");
+}
+
+int main(int argc, char **argv) {
+  const char *socket_path = NULL;
+  string name;
+  uint32_t op = QUERY_INSET;
+  for (int i = 1; i < argc; i++) {
+    if (!strcmp(argv[i], "-s") && i + 1 < argc) {
+      socket_path = argv[++i];
+    } else if (!strcmp(argv[i], "-m") && i + 1 < argc) {
+      name = argv[++i];
+    } else if (!strcmp(argv[i], "-b")) {
+      op = QUERY_BOX;
+    } else if (!strcmp(argv[i], "-t")) {
+      op = STATS;
+    } else if (!strcmp(argv[i], "-r")) {
+      op = RELOAD;
+    } else {
+      usage();
+      return 2;
+    }
+  }
+  if (!socket_path || (name.empty() && op != STATS && op != RELOAD)) {
+    usage();
+    return 2;
+  }
+
+  struct sockaddr_un addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  strncpy(addr.sun_path, socket_path, sizeof(addr.sun_path) - 1);
+  int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (fd < 0 || connect(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+    fprintf(stderr, "molevelset-query: unable to connect to %s.\n",
+	    socket_path);
+    return 1;
+  }
+
+  response_header response;
+  vector<double> points;
+  if (op == STATS || op == RELOAD) {
+    if (!request(fd, op, name, points, 0, &response)) {
+      fprintf(stderr, "molevelset-query: no response.\n");
+      return 1;
+    }
+    vector<double> stats(response.n_items);
+    if (op == STATS && response.n_items &&
+	!read_full(fd, &stats[0], sizeof(double) * response.n_items)) {
+      fprintf(stderr, "molevelset-query: truncated response.\n");
+      return 1;
+    }
+    if (op == RELOAD) {
+      printf("%u model(s) failed to reload\n", response.n_items);
+    } else if (stats.size() == 6) {
+      printf("queries %.0f\np50 %.3f\np90 %.3f\np99 %.3f\np99.9 %.3f\n"
+	     "max %.3f\n", stats[0], stats[1], stats[2], stats[3], stats[4],
+	     stats[5]);
+    }
+    return response.n_items && op == RELOAD;
+  }
+
+  /* Ask for the dimension of the model, then send every point at once. */
+  if (!request(fd, op, name, points, 0, &response) ||
+      response.status != STATUS_OK) {
+    fprintf(stderr, "molevelset-query: unknown model %s.\n", name.c_str());
+    return 1;
+  }
+  uint32_t d = response.d;
+  double x;
+  while (scanf("%lf", &x) == 1) {
+    points.push_back(x);
+  }
+  if (points.size() % d) {
+    fprintf(stderr, "molevelset-query: expected %u coordinates per point.\n",
+	    d);
+    return 1;
+  }
+  uint32_t n = points.size() / d;
+  if (!request(fd, op, name, points, n, &response) ||
+      response.status != STATUS_OK) {
+    fprintf(stderr, "molevelset-query: query failed.\n");
+    return 1;
+  }
+  size_t size = op == QUERY_INSET ? 1 : sizeof(int32_t);
+  vector<unsigned char> items(size * n + 1);
+  if (!read_full(fd, &items[0], size * n)) {
+    fprintf(stderr, "molevelset-query: truncated response.\n");
+    return 1;
+  }
+  for (uint32_t i = 0; i < n; i++) {
+    if (op == QUERY_INSET) {
+      printf("%d\n", items[i]);
+    } else {
+      int32_t box;
+      memcpy(&box, &items[i * size], size);
+      printf("%d\n", box);
+    }
+  }
+  close(fd);
+  return 0;
+}
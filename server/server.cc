@@ -0,0 +1,316 @@
+#include <errno.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <chrono>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "model.h"
+#include "protocol.h"
+
+using std::string;
+using std::vector;
+
+typedef vector<model> model_list;
+
+typedef struct {
+  vector<string> names;       /* Name of each model. */
+  vector<string> paths;       /* File of each model. */
+  std::mutex lock;            /* Guards models. */
+  std::shared_ptr<const model_list> models;
+                              /* The models queries use, replaced whole
+				 on a reload. */
+  std::mutex stats_lock;      /* Guards latency and n_timed. */
+  vector<double> latency;     /* Recent query times in microseconds, a
+				 ring of STATS_WINDOW. */
+  unsigned long n_timed;      /* Number of queries timed. */
+} server_state;
+
+static volatile sig_atomic_t reload_requested = 0;
+static volatile sig_atomic_t stop_requested = 0;
+
+static void handle_signal(int sig) {
+  if (sig == SIGHUP) {
+    reload_requested = 1;
+  } else {
+    stop_requested = 1;
+  }
+}
+
+static std::shared_ptr<const model_list> current_models(server_state *s) {
+  std::lock_guard<std::mutex> guard(s->lock);
+  return s->models;
+}
+
+static int reload_models(server_state *s) {
+  /* Read every model file again.  A model that fails to load keeps its
+   * old boxes, queries in flight keep the models they started with.
+   * Returns the number of models that failed. */
+  std::shared_ptr<const model_list> old = current_models(s);
+  std::shared_ptr<model_list> models(new model_list(s->names.size()));
+  int failed = 0;
+  for (size_t i = 0; i < s->names.size(); i++) {
+    string error;
+    model *m = &(*models)[i];
+    m->name = s->names[i];
+    if (!load_model(s->paths[i], m, &error)) {
+      fprintf(stderr, "molevelset-server: %s, keeping the old model.\n",
+	      error.c_str());
+      *m = old->at(i);
+      failed++;
+    }
+  }
+  std::lock_guard<std::mutex> guard(s->lock);
+  s->models = models;
+  return failed;
+}
+
+static void record_latency(server_state *s, double microseconds) {
+  std::lock_guard<std::mutex> guard(s->stats_lock);
+  s->latency[s->n_timed++ % STATS_WINDOW] = microseconds;
+}
+
+static vector<double> latency_stats(server_state *s) {
+  /* The items of a STATS response. */
+  vector<double> times;
+  unsigned long n_timed;
+  {
+    std::lock_guard<std::mutex> guard(s->stats_lock);
+    n_timed = s->n_timed;
+    times.assign(s->latency.begin(), s->latency.begin() +
+		 std::min(n_timed, (unsigned long)STATS_WINDOW));
+  }
+  std::sort(times.begin(), times.end());
+  double quantiles[] = {0.5, 0.9, 0.99, 0.999, 1.0};
+  vector<double> stats(1, (double)n_timed);
+  for (int k = 0; k < 5; k++) {
+    stats.push_back(times.empty() ? 0.0 :
+		    times[(size_t)(quantiles[k] * (times.size() - 1))]);
+  }
+  return stats;
+}
+
+static int read_full(int fd, void *buffer, size_t n) {
+  /* Read exactly n bytes, returns 0 on end of file or error. */
+  char *at = (char *)buffer;
+  while (n) {
+    ssize_t got = read(fd, at, n);
+    if (got < 0 && errno == EINTR) {
+      continue;
+    }
+    if (got <= 0) {
+      return 0;
+    }
+    at += got;
+    n -= got;
+  }
+  return 1;
+}
+
+static int write_full(int fd, const void *buffer, size_t n) {
+  /* Write exactly n bytes, returns 0 on error. */
+  const char *at = (const char *)buffer;
+  while (n) {
+    ssize_t put = write(fd, at, n);
+    if (put < 0 && errno == EINTR) {
+      continue;
+    }
+    if (put <= 0) {
+      return 0;
+    }
+    at += put;
+    n -= put;
+  }
+  return 1;
+}
+
+static int respond(int fd, uint32_t status, uint32_t n_items, uint32_t d,
+		   const void *items, size_t size) {
+  response_header header = {PROTOCOL_MAGIC, status, n_items, d};
+  return write_full(fd, &header, sizeof(header)) &&
+    (!size || write_full(fd, items, size));
+}
+
+static void serve_client(server_state *s, int fd) {
+  /* Answer the requests of one connection until it is closed. */
+  request_header request;
+  vector<double> points;
+  vector<unsigned char> inset;
+  vector<int32_t> boxes;
+  while (read_full(fd, &request, sizeof(request))) {
+    if (request.magic != PROTOCOL_MAGIC ||
+	request.op < QUERY_INSET || request.op > RELOAD ||
+	request.name_length > MAX_NAME_LENGTH ||
+	request.n_points > MAX_REQUEST_POINTS) {
+      respond(fd, STATUS_BAD_REQUEST, 0, 0, NULL, 0);
+      break;
+    }
+    string name(request.name_length, '\0');
+    if (request.name_length &&
+	!read_full(fd, &name[0], request.name_length)) {
+      break;
+    }
+
+    if (request.op == STATS) {
+      vector<double> stats = latency_stats(s);
+      if (!respond(fd, STATUS_OK, stats.size(), 0, &stats[0],
+		   sizeof(double) * stats.size())) {
+	break;
+      }
+      continue;
+    }
+    if (request.op == RELOAD) {
+      if (!respond(fd, STATUS_OK, reload_models(s), 0, NULL, 0)) {
+	break;
+      }
+      continue;
+    }
+
+    std::shared_ptr<const model_list> models = current_models(s);
+    const model *m = NULL;
+    for (size_t i = 0; i < models->size(); i++) {
+      if ((*models)[i].name == name) {
+	m = &(*models)[i];
+      }
+    }
+    if (!m) {
+      respond(fd, STATUS_UNKNOWN_MODEL, 0, 0, NULL, 0);
+      break;
+    }
+    size_t n = request.n_points;
+    points.resize(n * m->d);
+    if (n && !read_full(fd, &points[0], sizeof(double) * n * m->d)) {
+      break;
+    }
+
+    std::chrono::steady_clock::time_point start =
+      std::chrono::steady_clock::now();
+    int ok;
+    if (request.op == QUERY_INSET) {
+      inset.resize(n);
+      for (size_t i = 0; i < n; i++) {
+	int box = model_find_box(m, &points[i * m->d]);
+	inset[i] = box >= 0 && m->inset[box];
+      }
+      ok = respond(fd, STATUS_OK, n, m->d, n ? &inset[0] : NULL, n);
+    } else {
+      boxes.resize(n);
+      for (size_t i = 0; i < n; i++) {
+	boxes[i] = model_find_box(m, &points[i * m->d]);
+      }
+      ok = respond(fd, STATUS_OK, n, m->d, n ? &boxes[0] : NULL,
+		   sizeof(int32_t) * n);
+    }
+    record_latency(s, std::chrono::duration<double, std::micro>(
+		     std::chrono::steady_clock::now() - start).count());
+    if (!ok) {
+      break;
+    }
+  }
+  close(fd);
+}
+
+static void usage() {
+  fprintf(stderr,
+	  "usage: molevelset-server -s SOCKET NAME=MODEL_FILE ...\n"
+	  "\n"
+	  "Answer levelset membership queries for models written by\n"
+	  "molevelset.save.model, see protocol.h.  SIGHUP reloads every\n"
+	  "model file.\n");
+}
+
+int main(int argc, char **argv) {
+  /* Client threads may still be running when main returns, so the state
+   * is never freed. */
+  server_state &s = *new server_state;
+  const char *socket_path = NULL;
+  for (int i = 1; i < argc; i++) {
+    if (!strcmp(argv[i], "-s") && i + 1 < argc) {
+      socket_path = argv[++i];
+      continue;
+    }
+    const char *eq = strchr(argv[i], '=');
+    if (!eq || eq == argv[i] || !eq[1]) {
+      usage();
+      return 2;
+    }
+    s.names.push_back(string(argv[i], eq - argv[i]));
+    s.paths.push_back(string(eq + 1));
+  }
+  if (!socket_path || s.names.empty()) {
+    usage();
+    return 2;
+  }
+  s.latency.assign(STATS_WINDOW, 0.0);
+  s.n_timed = 0;
+
+  std::shared_ptr<model_list> models(new model_list(s.names.size()));
+  for (size_t i = 0; i < s.names.size(); i++) {
+    string error;
+    (*models)[i].name = s.names[i];
+    if (!load_model(s.paths[i], &(*models)[i], &error)) {
+      fprintf(stderr, "molevelset-server: %s.\n", error.c_str());
+      return 1;
+    }
+  }
+  s.models = models;
+
+  struct sockaddr_un addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  if (strlen(socket_path) >= sizeof(addr.sun_path)) {
+    fprintf(stderr, "molevelset-server: socket path is too long.\n");
+    return 1;
+  }
+  strcpy(addr.sun_path, socket_path);
+  int listen_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  unlink(socket_path);
+  if (listen_fd < 0 ||
+      bind(listen_fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 ||
+      listen(listen_fd, 64) < 0) {
+    fprintf(stderr, "molevelset-server: unable to listen on %s: %s.\n",
+	    socket_path, strerror(errno));
+    return 1;
+  }
+
+  struct sigaction action;
+  memset(&action, 0, sizeof(action));
+  action.sa_handler = handle_signal;
+  sigaction(SIGHUP, &action, NULL);
+  sigaction(SIGINT, &action, NULL);
+  sigaction(SIGTERM, &action, NULL);
+  signal(SIGPIPE, SIG_IGN);
+
+  fprintf(stderr, "molevelset-server: %d model(s) on %s.\n",
+	  (int)s.names.size(), socket_path);
+  while (!stop_requested) {
+    if (reload_requested) {
+      reload_requested = 0;
+      int failed = reload_models(&s);
+      fprintf(stderr, "molevelset-server: reloaded, %d failed.\n", failed);
+    }
+    struct pollfd p = {listen_fd, POLLIN, 0};
+    if (poll(&p, 1, 250) <= 0) {
+      continue;
+    }
+    int fd = accept(listen_fd, NULL, NULL);
+    if (fd >= 0) {
+      std::thread(serve_client, &s, fd).detach();
+    }
+  }
+
+  close(listen_fd);
+  unlink(socket_path);
+  return 0;
+}
@@ -0,0 +1,359 @@
+/* File to test the functions in model.h */
+#include "model.h"
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <iostream>
+#include <new>
+#include <string>
+#include <vector>
+
+using namespace::std;
+
+typedef struct {
+  int inset;
+  vector<int> nsplit;
+  vector<unsigned long long> split;
+} test_box;
+
+static void put_int(FILE *f, int value) {
+  unsigned char bytes[4];
+  for (int i = 0; i < 4; i++) {
+    bytes[i] = ((unsigned int)value >> (8 * i)) & 0xff;
+  }
+  fwrite(bytes, 1, 4, f);
+}
+
+static void put_split(FILE *f, unsigned long long v) {
+  unsigned char bytes[8];
+  for (int i = 0; i < 8; i++) {
+    bytes[i] = (v >> (8 * i)) & 0xff;
+  }
+  fwrite(bytes, 1, 8, f);
+}
+
+static void put_double(FILE *f, double value) {
+  unsigned long long v;
+  memcpy(&v, &value, sizeof(double));
+  unsigned char bytes[8];
+  for (int i = 0; i < 8; i++) {
+    bytes[i] = (v >> (8 * i)) & 0xff;
+  }
+  fwrite(bytes, 1, 8, f);
+}
+
+static void write_model(const char *path, int d, const vector<double> &offset,
+			const vector<double> &scale,
+			const vector<test_box> &boxes,
+			const vector<vector<double> > *unit = NULL,
+			const vector<vector<double> > *x = NULL,
+			int version = MODEL_VERSION) {
+  /* Write a model, with the knots of a quantile grid when unit and x are
+   * given. */
+  FILE *f = fopen(path, "wb");
+  fwrite("MOLEVSET", 1, 8, f);
+  put_int(f, version);
+  put_int(f, d);
+  put_int(f, boxes.size());
+  for (int j = 0; j < d; j++) {
+    put_double(f, offset[j]);
+  }
+  for (int j = 0; j < d; j++) {
+    put_double(f, scale[j]);
+  }
+  for (int j = 0; j < d && version >= 3; j++) {
+    int n_knots = unit ? unit->at(j).size() : 0;
+    put_int(f, n_knots);
+    for (int k = 0; k < n_knots; k++) {
+      put_double(f, unit->at(j)[k]);
+    }
+    for (int k = 0; k < n_knots; k++) {
+      put_double(f, x->at(j)[k]);
+    }
+  }
+  for (size_t i = 0; i < boxes.size(); i++) {
+    put_int(f, boxes[i].inset);
+    for (int j = 0; j < d; j++) {
+      put_int(f, boxes[i].nsplit[j]);
+    }
+    for (int j = 0; j < d; j++) {
+      put_split(f, boxes[i].split[j]);
+    }
+  }
+  fclose(f);
+}
+
+static void random_partition(test_box box, int depth,
+			     vector<test_box> *boxes) {
+  /* Split a box at random into the leaves of a dyadic tree, dropping some
+   * leaves so that part of the space is in no box. */
+  int d = box.nsplit.size();
+  if (depth == 0 || rand() % 4 == 0) {
+    if (rand() % 5) {
+      box.inset = rand() % 2;
+      boxes->push_back(box);
+    }
+    return;
+  }
+  int j = rand() % d;
+  for (int side = 0; side < 2; side++) {
+    test_box child = box;
+    child.split[j] |= (unsigned long long)side << child.nsplit[j];
+    child.nsplit[j]++;
+    random_partition(child, depth - 1, boxes);
+  }
+}
+
+int TestFindBoxMatchesScan() {
+  int success = 1;
+
+  cout << "TestFindBoxMatchesScan\n";
+  cout << "  Checking model_find_box agrees with a scan of every box...";
+  const char *path = "testModel.model";
+  int d = 3;
+  vector<double> offset(d), scale(d);
+  for (int j = 0; j < d; j++) {
+    offset[j] = -1.0 + j;
+    scale[j] = 2.0 + j;
+  }
+  srand(1);
+  for (int trial = 0; trial < 20 && success; trial++) {
+    test_box root;
+    root.inset = 0;
+    root.nsplit.assign(d, 0);
+    root.split.assign(d, 0);
+    vector<test_box> boxes;
+    random_partition(root, 12, &boxes);
+    write_model(path, d, offset, scale, boxes);
+
+    model m;
+    string error;
+    if (!load_model(path, &m, &error)) {
+      cout << " FAILURE. " << error << ".\n";
+      success = 0;
+      break;
+    }
+    for (int i = 0; i < 20000; i++) {
+      double x[3];
+      for (int j = 0; j < d; j++) {
+	/* Points on the grid of the finest splits land on box faces. */
+	double unit = rand() % 2 ? (double)rand() / RAND_MAX :
+	  (rand() % 65) / 64.0;
+	x[j] = unit * scale[j] + offset[j];
+      }
+      int expected = -1;
+      for (int b = 0; b < m.n_boxes && expected < 0; b++) {
+	int j;
+	for (j = 0; j < d && x[j] > m.lo[b * d + j] && x[j] <= m.hi[b * d + j];
+	     j++);
+	if (j == d) {
+	  expected = b;
+	}
+      }
+      int got = model_find_box(&m, x);
+      if (got != expected) {
+	cout << " FAILURE. Got box " << got << ", expected " << expected
+	     << ".\n";
+	success = 0;
+	break;
+      }
+    }
+  }
+  remove(path);
+  if (success) {
+    cout << " Success.\n";
+  }
+  return(success);
+}
+
+int TestFindBoxDeepSplits() {
+  int success = 1;
+
+  cout << "TestFindBoxDeepSplits\n";
+  cout << "  Checking boxes with more than 32 splits are found...";
+  const char *path = "testModel.model";
+  int d = 1, depth = 50;
+  vector<double> offset(d, 0.0), scale(d, 1.0);
+  /* Box k is (1 - 2^-k, 1 - 2^-(k + 1)], right k times then left. */
+  vector<test_box> boxes;
+  for (int k = 0; k < depth; k++) {
+    test_box box;
+    box.inset = k % 2;
+    box.nsplit.assign(d, k + 1);
+    box.split.assign(d, (1ULL << k) - 1);
+    boxes.push_back(box);
+  }
+  write_model(path, d, offset, scale, boxes);
+
+  model m;
+  string error;
+  if (!load_model(path, &m, &error)) {
+    cout << " FAILURE. " << error << ".\n";
+    success = 0;
+  }
+  for (int k = 0; k < depth && success; k++) {
+    double x = 1.0 - ldexp(1.0, -(k + 1));
+    int got = model_find_box(&m, &x);
+    if (got != k) {
+      cout << " FAILURE. Got box " << got << ", expected " << k << ".\n";
+      success = 0;
+    }
+  }
+  remove(path);
+  if (success) {
+    cout << " Success.\n";
+  }
+  return(success);
+}
+
+int TestQuantileGrid() {
+  int success = 1;
+
+  cout << "TestQuantileGrid\n";
+  cout << "  Checking boxes on a quantile grid map through the knots...";
+  const char *path = "testModel.model";
+  int d = 2;
+  vector<double> offset(d, 0.0), scale(d, 1.0);
+  /* Dimension 0 is on a quantile grid, split 1/2 at x = 10 and 3/4 at
+   * x = 100, dimension 1 is uniform. */
+  vector<vector<double> > unit(d), x(d);
+  double unit_knots[] = {0.125, 0.5, 0.75, 0.875};
+  double x_knots[] = {1, 10, 100, 1000};
+  unit[0].assign(unit_knots, unit_knots + 4);
+  x[0].assign(x_knots, x_knots + 4);
+  vector<test_box> boxes;
+  for (int k = 0; k < 4; k++) {
+    test_box box;
+    box.inset = k % 2;
+    box.nsplit.assign(d, 2);
+    box.nsplit[1] = 0;
+    box.split.assign(d, 0);
+    box.split[0] = k;
+    boxes.push_back(box);
+  }
+  write_model(path, d, offset, scale, boxes, &unit, &x);
+
+  model m;
+  string error;
+  if (!load_model(path, &m, &error)) {
+    cout << " FAILURE. " << error << ".\n";
+    success = 0;
+  }
+  /* Box 1 is right then left, (1/2, 3/4], box 3 is (3/4, 1], which goes
+   * past the last knot along the last piece. */
+  if (success && (m.lo[1 * d] != 10 || m.hi[1 * d] != 100 ||
+		  m.lo[3 * d] != 100 || m.hi[3 * d] != 100 + 900 * 2)) {
+    cout << " FAILURE. Wrong corners.\n";
+    success = 0;
+  }
+  double points[][2] = {{5, 0.5}, {10, 0.5}, {10.5, 0.5}, {100, 0.5},
+			{500, 0.5}};
+  int expected[] = {2, 2, 1, 1, 3};
+  for (int i = 0; i < 5 && success; i++) {
+    int got = model_find_box(&m, points[i]);
+    if (got != expected[i]) {
+      cout << " FAILURE. Got box " << got << ", expected " << expected[i]
+	   << ".\n";
+      success = 0;
+    }
+  }
+
+  /* Models from before quantile grids still load. */
+  write_model(path, d, offset, scale, boxes, NULL, NULL, 2);
+  if (success && (!load_model(path, &m, &error) || m.hi[1 * d] != 0.75)) {
+    cout << " FAILURE. Could not load a version 2 model.\n";
+    success = 0;
+  }
+  remove(path);
+  if (success) {
+    cout << " Success.\n";
+  }
+  return(success);
+}
+
+int TestLoadModelRejectsBadFiles() {
+  int success = 1;
+
+  cout << "TestLoadModelRejectsBadFiles\n";
+  cout << "  Checking overlapping, corrupt and truncated models fail...";
+  const char *path = "testModel.model";
+  int d = 2;
+  vector<double> offset(d, 0.0), scale(d, 1.0);
+  test_box whole, half;
+  whole.inset = 1;
+  whole.nsplit.assign(d, 0);
+  whole.split.assign(d, 0);
+  half = whole;
+  half.nsplit[1] = 1;
+  model m;
+  string error;
+
+  vector<test_box> boxes;
+  boxes.push_back(whole);
+  boxes.push_back(half);
+  write_model(path, d, offset, scale, boxes);
+  if (load_model(path, &m, &error)) {
+    cout << " FAILURE. Loaded overlapping boxes.\n";
+    success = 0;
+  }
+
+  boxes.clear();
+  half.split[1] = 2;
+  boxes.push_back(half);
+  write_model(path, d, offset, scale, boxes);
+  if (success && load_model(path, &m, &error)) {
+    cout << " FAILURE. Loaded a split beyond nsplit.\n";
+    success = 0;
+  }
+
+  FILE *f = fopen(path, "wb");
+  fwrite("MOLEVSET", 1, 8, f);
+  put_int(f, MODEL_VERSION);
+  put_int(f, d);
+  put_int(f, 4);
+  fclose(f);
+  if (success && load_model(path, &m, &error)) {
+    cout << " FAILURE. Loaded a truncated model.\n";
+    success = 0;
+  }
+
+  /* Counts far larger than the file are refused before anything is
+   * allocated for them. */
+  int counts[][2] = {{d, 0x7fffffff}, {0x7fffffff, 1}};
+  for (int k = 0; k < 2 && success; k++) {
+    f = fopen(path, "wb");
+    fwrite("MOLEVSET", 1, 8, f);
+    put_int(f, MODEL_VERSION);
+    put_int(f, counts[k][0]);
+    put_int(f, counts[k][1]);
+    fclose(f);
+    try {
+      if (load_model(path, &m, &error)) {
+	cout << " FAILURE. Loaded a model with too many boxes.\n";
+	success = 0;
+      }
+    } catch (std::bad_alloc &) {
+      cout << " FAILURE. Ran out of memory on a corrupt model.\n";
+      success = 0;
+    }
+  }
+  remove(path);
+  if (success) {
+    cout << " Success.\n";
+  }
+  return(success);
+}
+
+int main(int argc, char**argv) {
+  int success = 1;
+  success *= TestFindBoxMatchesScan();
+  success *= TestFindBoxDeepSplits();
+  success *= TestQuantileGrid();
+  success *= TestLoadModelRejectsBadFiles();
+  cout << (success ? "All tests passed." : "FAILURE.  Some tests failed.")
+       << "\n";
+  return(!success);
+}